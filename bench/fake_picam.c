@@ -0,0 +1,150 @@
+/*
+ *  fake_picam.c
+ *    Picam stand-in answering hooks with state files
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "fake_picam.h"
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+write_state (struct fake_picam *fp, const char *state)
+{
+    int dirfd, fd;
+
+    dirfd = open (fp->state_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+        return;
+
+    fd = openat (dirfd, "record", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0644);
+    if (fd >= 0)
+      {
+        if (write (fd, state, strlen (state)) < 0)
+            perror ("fake picam: write");
+        close (fd);
+      }
+    close (dirfd);
+}
+
+static void
+handle_hook (struct fake_picam *fp, const char *name, uint64_t ns)
+{
+    char path[4096];
+
+    if (strcmp (name, "start_record") == 0)
+      {
+        if (fp->starts < FAKE_PICAM_MAX_HOOKS)
+            fp->start_ns[fp->starts] = ns;
+        fp->starts++;
+        write_state (fp, "true");
+      }
+    else if (strcmp (name, "stop_record") == 0)
+      {
+        fp->stops++;
+        write_state (fp, "false");
+      }
+    else
+        return;
+
+    snprintf (path, sizeof (path), "%s/%s", fp->hooks_dir, name);
+    unlink (path);
+}
+
+static void *
+fake_picam_loop (void *arg)
+{
+    struct fake_picam *fp = arg;
+    struct pollfd pfds[2] = {
+        { .fd = fp->inotify_fd, .events = POLLIN },
+        { .fd = fp->stopfd, .events = POLLIN }
+    };
+    char buf[8192] __attribute__ ((aligned (__alignof__ (struct
+                                                          inotify_event))));
+    ssize_t n;
+
+    while (poll (pfds, 2, -1) >= 0 && !(pfds[1].revents & POLLIN))
+      {
+        uint64_t ns = now_ns ();
+
+        n = read (fp->inotify_fd, buf, sizeof (buf));
+        for (char *p = buf; n > 0 && p < buf + n;)
+          {
+            struct inotify_event *ev = (struct inotify_event *) p;
+
+            if (ev->len)
+                handle_hook (fp, ev->name, ns);
+            p += sizeof (struct inotify_event) + ev->len;
+          }
+      }
+
+    return NULL;
+}
+
+int
+fake_picam_start (struct fake_picam *fp, const char *hooks_dir,
+                  const char *state_dir)
+{
+    fp->hooks_dir = hooks_dir;
+    fp->state_dir = state_dir;
+    fp->starts = 0;
+    fp->stops = 0;
+
+    fp->inotify_fd = inotify_init1 (IN_CLOEXEC);
+    if (fp->inotify_fd < 0)
+        return 1;
+    if (inotify_add_watch (fp->inotify_fd, hooks_dir, IN_CLOSE_WRITE) < 0)
+        return 1;
+
+    fp->stopfd = eventfd (0, EFD_CLOEXEC);
+    if (fp->stopfd < 0)
+        return 1;
+
+    return pthread_create (&fp->thread, NULL, &fake_picam_loop, fp);
+}
+
+void
+fake_picam_stop (struct fake_picam *fp)
+{
+    uint64_t u = 1;
+
+    if (write (fp->stopfd, &u, sizeof (u)) == sizeof (u))
+        pthread_join (fp->thread, NULL);
+    close (fp->stopfd);
+    close (fp->inotify_fd);
+}
@@ -0,0 +1,54 @@
+/*
+ *  fake_picam.h
+ *    Picam stand-in answering hooks with state files
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _FAKE_PICAM_H_
+#define _FAKE_PICAM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Start hooks remembered for latency, later ones are only counted */
+#define FAKE_PICAM_MAX_HOOKS 65536
+
+struct fake_picam {
+    const char *hooks_dir;
+    const char *state_dir;
+    int        inotify_fd;
+    int        stopfd;
+    pthread_t  thread;
+    size_t     starts;
+    size_t     stops;
+    uint64_t   start_ns[FAKE_PICAM_MAX_HOOKS]; /* CLOCK_MONOTONIC */
+};
+
+/* Watch hooks_dir from a thread of its own. Like picam, a start_record or
+   stop_record hook is removed and answered by writing record = true or
+   false to state_dir */
+extern int fake_picam_start (struct fake_picam *, const char *,
+                             const char *);
+
+/* Stop the thread, counts and timestamps stay valid */
+extern void fake_picam_stop (struct fake_picam *);
+
+#endif /* _FAKE_PICAM_H_ */
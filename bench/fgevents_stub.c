@@ -0,0 +1,110 @@
+/*
+ *  fgevents_stub.c
+ *    Loopback fgevents server feeding core sensor events
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+/*
+ * Instead of listening for clients, the server calls core's event callback
+ * from a thread of its own with a sensor data event FG_STUB_SENSOR_HZ
+ * times a second (taken from the environment, 0 or unset for none). The
+ * answer is read like a serializer would and then dropped, which is what
+ * core sees from a datalogger on the real socket minus the network.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <fgevents.h>
+
+static void *
+loop_start (void *arg)
+{
+    struct fg_events_data *etdata = arg;
+    struct pollfd pfd = { .fd = etdata->stopfd, .events = POLLIN };
+    int32_t payload[] = { OUTTEMP, 215, INTEMP, 230, PRESSURE, 10130,
+                          HUMIDITY, 45 };
+    struct fgevent fgev = { FG_SENSOR_DATA, FG_MASTER, 1,
+                            sizeof (payload) / sizeof (payload[0]),
+                            payload };
+    struct fgevent ansev;
+    unsigned long events = 0;
+    volatile int32_t sink = 0;
+
+    /* Poll timeout is the event period, stopfd ends the loop */
+    while (poll (&pfd, 1, 1000 / etdata->sensor_hz) == 0)
+      {
+        ansev.payload = NULL;
+        if (etdata->cb (etdata->cb_arg, &fgev, &ansev))
+          {
+            for (int i = 0; i < ansev.length; i++)
+                sink += ansev.payload[i];
+          }
+        /* Like fgevents, the answer payload is ours to free */
+        free (ansev.payload);
+        events++;
+      }
+
+    fprintf (stderr, "fgevents stub: %lu sensor events\n", events);
+
+    return NULL;
+}
+
+int
+fg_events_server_init (struct fg_events_data *etdata, fg_handle_event_cb cb,
+                       void *arg, __attribute__ ((unused)) int port,
+                       __attribute__ ((unused)) char *path,
+                       __attribute__ ((unused)) int type)
+{
+    const char *hz = getenv ("FG_STUB_SENSOR_HZ");
+
+    etdata->cb = cb;
+    etdata->cb_arg = arg;
+    etdata->sensor_hz = hz ? atol (hz) : 0;
+    etdata->stopfd = -1;
+    if (etdata->sensor_hz <= 0)
+        return 0;
+    if (etdata->sensor_hz > 1000)
+        etdata->sensor_hz = 1000;
+
+    etdata->stopfd = eventfd (0, EFD_CLOEXEC);
+    if (etdata->stopfd < 0)
+        return 1;
+
+    return pthread_create (&etdata->loop_t, NULL, &loop_start, etdata);
+}
+
+void
+fg_events_server_shutdown (struct fg_events_data *etdata)
+{
+    uint64_t u = 1;
+
+    if (etdata->stopfd < 0)
+        return;
+
+    if (write (etdata->stopfd, &u, sizeof (u)) == sizeof (u))
+        pthread_join (etdata->loop_t, NULL);
+    close (etdata->stopfd);
+    etdata->stopfd = -1;
+}
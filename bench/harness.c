@@ -0,0 +1,135 @@
+/*
+ *  harness.c
+ *    Running a host build of core under a bench driver
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "harness.h"
+
+uint64_t
+harness_now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+harness_prepare (void)
+{
+    mkdir (BENCH_DIR, 0755);
+    mkdir (STATE_DIR, 0755);
+    mkdir (HOOKS_DIR, 0755);
+    unlink (GPIO_SOCKET);
+    unlink (METRICS_SOCKET);
+
+    return access (STATE_DIR, W_OK) || access (HOOKS_DIR, W_OK);
+}
+
+pid_t
+harness_spawn (const char *core)
+{
+    pid_t pid;
+    int fd;
+
+    pid = fork ();
+    if (pid != 0)
+        return pid;
+
+    fd = open (CORE_LOG, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+      {
+        dup2 (fd, STDOUT_FILENO);
+        dup2 (fd, STDERR_FILENO);
+      }
+    execl (core, core, (char *) NULL);
+    perror ("exec core");
+    _exit (127);
+}
+
+/* Read the whole scrape and look for a line starting with name */
+double
+harness_scrape (const char *name)
+{
+    int fd;
+    ssize_t n;
+    size_t len = 0, l = strlen (name);
+    char buf[16384], *p;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    strncpy (addr.sun_path, METRICS_SOCKET, sizeof (addr.sun_path) - 1);
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+      {
+        close (fd);
+        return -1;
+      }
+    while (len < sizeof (buf) - 1 &&
+           (n = read (fd, buf + len, sizeof (buf) - 1 - len)) > 0)
+        len += n;
+    close (fd);
+    buf[len] = '\0';
+
+    for (p = buf; p != NULL && *p; p = strchr (p, '\n'), p = p ? p + 1 : NULL)
+        if (strncmp (p, name, l) == 0 && p[l] == ' ')
+            return atof (p + l + 1);
+
+    return -1;
+}
+
+int
+harness_wait_metrics (long ms)
+{
+    for (long i = 0; i < ms / 10; i++)
+      {
+        if (harness_scrape ("fg_isr_total") >= 0)
+            return 0;
+        usleep (10000);
+      }
+
+    return 1;
+}
+
+int
+harness_stop (pid_t pid)
+{
+    int status = 0;
+
+    kill (pid, SIGTERM);
+    waitpid (pid, &status, 0);
+
+    return status;
+}
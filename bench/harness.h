@@ -0,0 +1,61 @@
+/*
+ *  harness.h
+ *    Running a host build of core under a bench driver
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _HARNESS_H_
+#define _HARNESS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef BENCH_DIR
+#define BENCH_DIR "/dev/shm/fg-bench"
+#endif
+
+/* Paths core-bench and core-sim are built with, see Makefile */
+#define STATE_DIR BENCH_DIR "/state"
+#define HOOKS_DIR BENCH_DIR "/hooks"
+#define GPIO_SOCKET BENCH_DIR "/gpio.sock"
+#define GPIO_TRACE BENCH_DIR "/trace"
+#define METRICS_SOCKET BENCH_DIR "/metrics.sock"
+#define CORE_LOG BENCH_DIR "/core.log"
+
+/* CLOCK_MONOTONIC in nanoseconds */
+extern uint64_t harness_now_ns (void);
+
+/* Create BENCH_DIR and its state and hooks directories and remove sockets
+   left by an earlier run, returns non-zero on failure */
+extern int harness_prepare (void);
+
+/* Run core with stdout and stderr going to CORE_LOG, returns the pid */
+extern pid_t harness_spawn (const char *);
+
+/* Value of a metric in a scrape of core, -1 if it could not be read */
+extern double harness_scrape (const char *);
+
+/* Wait up to ms for core to serve metrics, returns non-zero if it doesn't */
+extern int harness_wait_metrics (long);
+
+/* SIGTERM core and reap it, returns its exit status */
+extern int harness_stop (pid_t);
+
+#endif /* _HARNESS_H_ */
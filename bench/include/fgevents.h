@@ -0,0 +1,51 @@
+/*
+ *  fgevents.h
+ *    Loopback stand-in for the fgevents server on the host bench
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _FGEVENTS_H_
+#define _FGEVENTS_H_
+
+#include <pthread.h>
+
+#include <serializer.h>
+
+typedef int (*fg_handle_event_cb) (void *, struct fgevent *,
+                                   struct fgevent *);
+
+struct fg_events_data {
+    int                save_errno;
+    char               *error;
+
+    /* Loopback state, see fgevents_stub.c */
+    fg_handle_event_cb cb;
+    void               *cb_arg;
+    int                stopfd;
+    long               sensor_hz;
+    pthread_t          loop_t;
+};
+
+extern int fg_events_server_init (struct fg_events_data *, fg_handle_event_cb,
+                                  void *, int, char *, int);
+
+extern void fg_events_server_shutdown (struct fg_events_data *);
+
+#endif /* _FGEVENTS_H_ */
@@ -0,0 +1,58 @@
+/*
+ *  serializer.h
+ *    Stand-in for the fgevents serializer header on the host bench
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SERIALIZER_H_
+#define _SERIALIZER_H_
+
+#include <stdint.h>
+
+/* Only what core uses, values do not have to match the real library */
+enum {
+    FG_ALIVE,
+    FG_CONFIRMED,
+    FG_SENSOR_DATA,
+    FG_USER
+};
+
+enum {
+    FG_MASTER,
+    FG_DATALOGGER
+};
+
+enum {
+    OUTTEMP = 1,
+    INTEMP,
+    PRESSURE,
+    HUMIDITY,
+    CPUTEMP
+};
+
+struct fgevent {
+    int32_t id;
+    int32_t receiver;
+    int32_t writeback;
+    int32_t length;
+    int32_t *payload;
+};
+
+#endif /* _SERIALIZER_H_ */
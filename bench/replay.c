@@ -0,0 +1,373 @@
+/*
+ *  replay.c
+ *    Replay PIR edges into a host build of core and measure it
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+/*
+ * Runs core-bench (core built with the sim gpio backend and paths under
+ * BENCH_DIR) with a fake picam, feeds it edges over the sim socket and
+ * reports:
+ *
+ *   - edges sent and handled per second (handled from fg_isr_total)
+ *   - start hook latency percentiles, from the latest rising edge sent
+ *     before the hook until the fake picam sees it, which holds as long as
+ *     the latency is below the time between rising edges
+ *   - CPU time of core from /proc/<pid>/stat
+ *   - read and write syscalls of core from /proc/<pid>/io, other syscalls
+ *     are not counted there
+ *
+ * Edges either alternate at a fixed rate (-r) or come from a trace in the
+ * gpio_sim.c format (-t) replayed at its delays divided by -s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "fake_picam.h"
+#include "harness.h"
+
+struct options {
+    const char *core;
+    const char *trace;
+    double     rate;
+    double     speed;
+    long       edges;
+    long       settle_ms;
+};
+
+struct proc_usage {
+    double   cpu_ms;
+    uint64_t syscalls;
+};
+
+static struct fake_picam picam;
+
+static void
+sleep_until (uint64_t ns)
+{
+    struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+        ;
+}
+
+static int
+cmp_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr, "usage: %s [-c core] [-r edges/s] [-n edges] "
+                     "[-t trace [-s speed]] [-w settle_ms]\n", prog);
+    exit (2);
+}
+
+static void
+parse_options (int argc, char **argv, struct options *o)
+{
+    int c;
+
+    o->core = "./core-bench";
+    o->trace = NULL;
+    o->rate = 100;
+    o->speed = 1;
+    o->edges = 1000;
+    o->settle_ms = 500;
+
+    while ((c = getopt (argc, argv, "c:r:n:t:s:w:")) != -1)
+      {
+        switch (c)
+          {
+            case 'c': o->core = optarg; break;
+            case 'r': o->rate = atof (optarg); break;
+            case 'n': o->edges = atol (optarg); break;
+            case 't': o->trace = optarg; break;
+            case 's': o->speed = atof (optarg); break;
+            case 'w': o->settle_ms = atol (optarg); break;
+            default: usage (argv[0]);
+          }
+      }
+
+    if (o->rate <= 0 || o->speed <= 0 || o->edges <= 0)
+        usage (argv[0]);
+}
+
+static int
+listen_gpio (void)
+{
+    int fd;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    strncpy (addr.sun_path, GPIO_SOCKET, sizeof (addr.sun_path) - 1);
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+        listen (fd, 1) < 0)
+      {
+        perror ("gpio socket");
+        return -1;
+      }
+
+    return fd;
+}
+
+static int
+read_usage (pid_t pid, struct proc_usage *u)
+{
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    unsigned long long v;
+    FILE *f;
+
+    snprintf (path, sizeof (path), "/proc/%d/stat", (int) pid);
+    f = fopen (path, "r");
+    if (f == NULL)
+        return 1;
+    p = fgets (buf, sizeof (buf), f);
+    fclose (f);
+    if (p == NULL || (p = strrchr (buf, ')')) == NULL)
+        return 1;
+    /* utime and stime are fields 14 and 15, 12 and 13 after the state */
+    if (sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2)
+        return 1;
+    u->cpu_ms = (utime + stime) * 1000.0 / sysconf (_SC_CLK_TCK);
+
+    u->syscalls = 0;
+    snprintf (path, sizeof (path), "/proc/%d/io", (int) pid);
+    f = fopen (path, "r");
+    if (f == NULL)
+        return 1;
+    while (fgets (buf, sizeof (buf), f))
+        if (sscanf (buf, "syscr: %llu", &v) == 1 ||
+            sscanf (buf, "syscw: %llu", &v) == 1)
+            u->syscalls += v;
+    fclose (f);
+
+    return 0;
+}
+
+/* Send one edge, remembering when rising edges went out */
+static int
+send_edge (int fd, int level, uint64_t *rising, long *nrising)
+{
+    const char *line = level ? "1\n" : "0\n";
+
+    if (level)
+        rising[(*nrising)++] = harness_now_ns ();
+
+    return write (fd, line, 2) == 2 ? 0 : 1;
+}
+
+static long
+replay_rate (int fd, const struct options *o, uint64_t *rising,
+             long *nrising)
+{
+    uint64_t start = harness_now_ns (), period = 1E9 / o->rate;
+    long i;
+
+    for (i = 0; i < o->edges; i++)
+      {
+        sleep_until (start + i * period);
+        if (send_edge (fd, !(i & 1), rising, nrising))
+            break;
+      }
+
+    return i;
+}
+
+static long
+replay_trace (int fd, const struct options *o, uint64_t *rising,
+              long *nrising)
+{
+    FILE *f;
+    char line[128];
+    long sent = 0, delay;
+    int level;
+    uint64_t t = harness_now_ns ();
+
+    f = fopen (o->trace, "r");
+    if (f == NULL)
+      {
+        perror ("trace");
+        return 0;
+      }
+
+    while (sent < o->edges && fgets (line, sizeof (line), f))
+      {
+        if (sscanf (line, "%ld %d", &delay, &level) == 2)
+            t += delay * 1E6 / o->speed;
+        else if (sscanf (line, "%d", &level) != 1)
+            continue;
+        sleep_until (t);
+        if (send_edge (fd, level != 0, rising, nrising))
+            break;
+        sent++;
+      }
+    fclose (f);
+
+    return sent;
+}
+
+/* Latency of each start hook from the latest rising edge before it */
+static size_t
+hook_latencies (const uint64_t *rising, long nrising, uint64_t *lat)
+{
+    size_t n = 0, starts = picam.starts;
+    long j = 0;
+
+    if (starts > FAKE_PICAM_MAX_HOOKS)
+        starts = FAKE_PICAM_MAX_HOOKS;
+
+    for (size_t i = 0; i < starts; i++)
+      {
+        while (j + 1 < nrising && rising[j + 1] <= picam.start_ns[i])
+            j++;
+        if (j < nrising && rising[j] <= picam.start_ns[i])
+            lat[n++] = picam.start_ns[i] - rising[j];
+      }
+    qsort (lat, n, sizeof (*lat), &cmp_u64);
+
+    return n;
+}
+
+static double
+percentile_us (const uint64_t *sorted, size_t n, double p)
+{
+    size_t i;
+
+    if (n == 0)
+        return 0;
+    i = (size_t) (p / 100 * (n - 1) + 0.5);
+
+    return sorted[i] / 1E3;
+}
+
+int
+main (int argc, char **argv)
+{
+    struct options o;
+    struct proc_usage before, after;
+    int lfd, fd = -1, status;
+    long sent, nrising = 0;
+    double isr_before, isr_after;
+    uint64_t t0, t1, *rising, *lat;
+    size_t nlat;
+    struct pollfd pfd;
+    pid_t pid;
+
+    parse_options (argc, argv, &o);
+
+    rising = calloc (o.edges, sizeof (*rising));
+    lat = calloc (FAKE_PICAM_MAX_HOOKS, sizeof (*lat));
+    if (rising == NULL || lat == NULL || harness_prepare () != 0)
+      {
+        fprintf (stderr, "could not set up %s\n", BENCH_DIR);
+        return 1;
+      }
+
+    if (fake_picam_start (&picam, HOOKS_DIR, STATE_DIR) != 0)
+      {
+        perror ("fake picam");
+        return 1;
+      }
+
+    lfd = listen_gpio ();
+    if (lfd < 0)
+        return 1;
+
+    pid = harness_spawn (o.core);
+    if (pid < 0)
+      {
+        perror ("fork");
+        return 1;
+      }
+
+    /* Core connects to the sim socket while starting up and serves metrics
+       once it is done */
+    pfd.fd = lfd;
+    pfd.events = POLLIN;
+    if (poll (&pfd, 1, 5000) == 1)
+        fd = accept (lfd, NULL, NULL);
+    harness_wait_metrics (5000);
+    isr_before = harness_scrape ("fg_isr_total");
+    if (fd < 0 || isr_before < 0 || read_usage (pid, &before) != 0)
+      {
+        fprintf (stderr, "core did not start, see %s\n", CORE_LOG);
+        harness_stop (pid);
+        return 1;
+      }
+
+    t0 = harness_now_ns ();
+    if (o.trace)
+        sent = replay_trace (fd, &o, rising, &nrising);
+    else
+        sent = replay_rate (fd, &o, rising, &nrising);
+    t1 = harness_now_ns ();
+
+    /* Let core catch up and the last recording stop */
+    usleep (o.settle_ms * 1000);
+    isr_after = harness_scrape ("fg_isr_total");
+    read_usage (pid, &after);
+
+    status = harness_stop (pid);
+    close (fd);
+    close (lfd);
+    fake_picam_stop (&picam);
+
+    nlat = hook_latencies (rising, nrising, lat);
+
+    printf ("edges sent       %ld in %.3f s, %.1f/s\n", sent, (t1 - t0) / 1E9,
+            sent / ((t1 - t0) / 1E9));
+    printf ("edges handled    %.0f\n", isr_after - isr_before);
+    printf ("start hooks      %zu, stop hooks %zu\n", picam.starts,
+            picam.stops);
+    printf ("hook latency us  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f "
+            "(%zu samples)\n", percentile_us (lat, nlat, 50),
+            percentile_us (lat, nlat, 90), percentile_us (lat, nlat, 99),
+            percentile_us (lat, nlat, 100), nlat);
+    printf ("cpu time         %.0f ms, %.1f us/edge\n",
+            after.cpu_ms - before.cpu_ms,
+            sent ? (after.cpu_ms - before.cpu_ms) * 1E3 / sent : 0);
+    printf ("read/write calls %llu, %.2f/edge\n",
+            (unsigned long long) (after.syscalls - before.syscalls),
+            sent ? (double) (after.syscalls - before.syscalls) / sent : 0);
+
+    free (rising);
+    free (lat);
+
+    return WIFEXITED (status) && WEXITSTATUS (status) == 0 ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+/*
+ *  sensor-bench.c
+ *    Read throughput of the SensorData seqlock against a mutex
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+/*
+ * Times 1 to -r readers copying SensorData for -d seconds while a writer
+ * publishes a new version every -w microseconds, once through the
+ * sensor_store core uses (see sensors.h) and once through a mutex held by
+ * reader and writer alike, as sensor_mutex was. Reports reads per second
+ * in total and per reader, and the longest wait of the writer, which with
+ * the mutex is time the fgevents thread spends behind readers.
+ *
+ * Run it on the Pi itself, the numbers depend on the cores and their
+ * caches. Readers are not pinned, with fewer cores than readers they take
+ * turns.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sensors.h"
+
+#define MAX_READERS 8
+
+struct options {
+    int  readers;
+    long duration_ms;
+    long write_us;
+};
+
+enum mode {
+    MODE_SEQLOCK,
+    MODE_MUTEX
+};
+
+struct run {
+    enum mode           mode;
+    atomic_bool         stop;
+    struct sensor_store store;
+    pthread_mutex_t     mutex;
+    struct SensorData   data; /* Guarded by mutex */
+    long                write_us;
+    uint64_t            writes;
+    uint64_t            write_max_ns;
+};
+
+struct reader {
+    struct run *run;
+    pthread_t  thread;
+    uint64_t   reads;
+    float      sink;
+};
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+reader_loop (void *arg)
+{
+    struct reader *rd = arg;
+    struct run *run = rd->run;
+    struct SensorData sd;
+    uint64_t reads = 0;
+    float sink = 0;
+
+    while (!atomic_load_explicit (&run->stop, memory_order_relaxed))
+      {
+        if (run->mode == MODE_SEQLOCK)
+            sensors_read (&run->store, &sd);
+        else
+          {
+            pthread_mutex_lock (&run->mutex);
+            sd = run->data;
+            pthread_mutex_unlock (&run->mutex);
+          }
+        sink += sd.outtemp;
+        reads++;
+      }
+    rd->reads = reads;
+    rd->sink = sink;
+
+    return NULL;
+}
+
+static void *
+writer_loop (void *arg)
+{
+    struct run *run = arg;
+    struct SensorData sd;
+    struct timespec period = { 0, run->write_us * 1000 };
+    uint64_t t0, t;
+
+    while (!atomic_load_explicit (&run->stop, memory_order_relaxed))
+      {
+        t0 = now_ns ();
+        if (run->mode == MODE_SEQLOCK)
+          {
+            sensors_write_begin (&run->store, &sd);
+            sd.outtemp += 1;
+            sd.present = 1;
+            sensors_write_end (&run->store, &sd);
+          }
+        else
+          {
+            pthread_mutex_lock (&run->mutex);
+            run->data.outtemp += 1;
+            run->data.present = 1;
+            pthread_mutex_unlock (&run->mutex);
+          }
+        t = now_ns () - t0;
+        if (t > run->write_max_ns)
+            run->write_max_ns = t;
+        run->writes++;
+        nanosleep (&period, NULL);
+      }
+
+    return NULL;
+}
+
+/* Run mode with n readers, prints one line */
+static void
+measure (enum mode mode, int n, const struct options *o)
+{
+    static struct run run;
+    struct reader readers[MAX_READERS];
+    pthread_t writer;
+    struct timespec duration = { o->duration_ms / 1000,
+                                 o->duration_ms % 1000 * 1000000L };
+    uint64_t t0, elapsed, total = 0;
+
+    run.mode = mode;
+    atomic_store (&run.stop, false);
+    sensors_store_init (&run.store);
+    pthread_mutex_init (&run.mutex, NULL);
+    run.write_us = o->write_us;
+    run.writes = 0;
+    run.write_max_ns = 0;
+
+    t0 = now_ns ();
+    pthread_create (&writer, NULL, &writer_loop, &run);
+    for (int i = 0; i < n; i++)
+      {
+        readers[i].run = &run;
+        pthread_create (&readers[i].thread, NULL, &reader_loop, &readers[i]);
+      }
+
+    nanosleep (&duration, NULL);
+    atomic_store (&run.stop, true);
+
+    pthread_join (writer, NULL);
+    for (int i = 0; i < n; i++)
+      {
+        pthread_join (readers[i].thread, NULL);
+        total += readers[i].reads;
+      }
+    elapsed = now_ns () - t0;
+
+    printf ("%-8s %d reader%s %10.0f reads/s %10.0f per reader "
+            "%7" PRIu64 " writes, longest %6.1f us\n",
+            mode == MODE_SEQLOCK ? "seqlock" : "mutex", n, n > 1 ? "s" : " ",
+            total / (elapsed / 1E9), total / (elapsed / 1E9) / n,
+            run.writes, run.write_max_ns / 1E3);
+
+    sensors_store_destroy (&run.store);
+    pthread_mutex_destroy (&run.mutex);
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr, "usage: %s [-r readers] [-d duration_ms] "
+                     "[-w write_us]\n", prog);
+    exit (2);
+}
+
+static void
+parse_options (int argc, char **argv, struct options *o)
+{
+    int c;
+
+    o->readers = 4;
+    o->duration_ms = 1000;
+    o->write_us = 1000;
+
+    while ((c = getopt (argc, argv, "r:d:w:")) != -1)
+      {
+        switch (c)
+          {
+            case 'r': o->readers = atoi (optarg); break;
+            case 'd': o->duration_ms = atol (optarg); break;
+            case 'w': o->write_us = atol (optarg); break;
+            default: usage (argv[0]);
+          }
+      }
+
+    if (optind != argc || o->readers < 1 || o->readers > MAX_READERS ||
+        o->duration_ms <= 0 || o->write_us <= 0 || o->write_us >= 1000000)
+        usage (argv[0]);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct options o;
+
+    parse_options (argc, argv, &o);
+
+    printf ("%ld cpus online, a write every %ld us\n",
+            sysconf (_SC_NPROCESSORS_ONLN), o.write_us);
+    for (int n = 1; n <= o.readers; n++)
+      {
+        measure (MODE_MUTEX, n, &o);
+        measure (MODE_SEQLOCK, n, &o);
+      }
+
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ *  simulate.c
+ *    Replay a trace of PIR edges through core on a virtual clock
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+/*
+ * Runs core-sim, core built with the virtual clock and the sim gpio backend
+ * reading GPIO_TRACE, against a fake picam. The trace is in the gpio_sim.c
+ * format with delays, and core replays it as fast as it keeps up: virtual
+ * time jumps from one timer deadline to the next. Once no timer is left
+ * the recordings core made are reported, so hold time and grace window
+ * settings (rebuild core-sim with SIM_FLAGS) can be compared on the same
+ * trace. With -n the run fails unless core made that many recordings,
+ * which is how make check tests the traces in traces/.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "fake_picam.h"
+#include "harness.h"
+
+/* Real time core gets to go idle, a trace that keeps it recording forever
+   fails instead of hanging */
+#define WAIT_IDLE_MS 60000
+
+static struct fake_picam picam;
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr, "usage: %s [-c core] [-e epoch] [-n recordings] "
+             "trace\n", prog);
+    exit (2);
+}
+
+static int
+copy_trace (const char *path)
+{
+    FILE *in, *out;
+    char buf[4096];
+    size_t n;
+
+    in = fopen (path, "r");
+    if (in == NULL)
+        return 1;
+    out = fopen (GPIO_TRACE, "w");
+    if (out == NULL)
+      {
+        fclose (in);
+        return 1;
+      }
+    while ((n = fread (buf, 1, sizeof (buf), in)) > 0)
+        fwrite (buf, 1, n, out);
+    fclose (in);
+
+    return fclose (out) != 0;
+}
+
+/* Core is done once the virtual clock has been idle for a few scrapes in a
+   row, the last stop hook may still be on its way before that */
+static int
+wait_idle (void)
+{
+    int idle = 0;
+    uint64_t give_up = harness_now_ns () + WAIT_IDLE_MS * 1000000ULL;
+
+    while (idle < 5)
+      {
+        double v = harness_scrape ("fg_clock_idle");
+
+        if (v < 0 || harness_now_ns () > give_up)
+            return 1;
+        idle = v > 0 ? idle + 1 : 0;
+        usleep (20000);
+      }
+
+    return 0;
+}
+
+static void
+report (const char *label, const char *name)
+{
+    printf ("%-22s %.0f\n", label, harness_scrape (name));
+}
+
+int
+main (int argc, char **argv)
+{
+    int c, status, expect = -1;
+    const char *core = "./core-sim";
+    double simulated, recorded, count;
+    uint64_t t0, t1;
+    pid_t pid;
+
+    while ((c = getopt (argc, argv, "c:e:n:")) != -1)
+      {
+        switch (c)
+          {
+            case 'c': core = optarg; break;
+            case 'e': setenv ("FG_CLOCK_EPOCH", optarg, 1); break;
+            case 'n': expect = atoi (optarg); break;
+            default: usage (argv[0]);
+          }
+      }
+    if (optind != argc - 1)
+        usage (argv[0]);
+
+    if (harness_prepare () != 0 || copy_trace (argv[optind]) != 0)
+      {
+        fprintf (stderr, "could not set up %s\n", BENCH_DIR);
+        return 1;
+      }
+
+    if (fake_picam_start (&picam, HOOKS_DIR, STATE_DIR) != 0)
+      {
+        perror ("fake picam");
+        return 1;
+      }
+
+    t0 = harness_now_ns ();
+    pid = harness_spawn (core);
+    if (pid < 0)
+      {
+        perror ("fork");
+        return 1;
+      }
+
+    if (harness_wait_metrics (5000) != 0 || wait_idle () != 0)
+      {
+        fprintf (stderr, "core did not run or never went idle, see %s\n",
+                 CORE_LOG);
+        harness_stop (pid);
+        return 1;
+      }
+    t1 = harness_now_ns ();
+
+    simulated = harness_scrape ("fg_clock_virtual_seconds");
+    printf ("%-22s %.1f s in %.2f s, %.0fx\n", "simulated", simulated,
+            (t1 - t0) / 1E9, simulated / ((t1 - t0) / 1E9));
+    report ("edges", "fg_isr_total");
+    report ("recordings started", "fg_recordings_started_total");
+    report ("recordings stopped", "fg_recordings_stopped_total");
+    report ("merged by grace", "fg_recordings_merged_total");
+    report ("split after stop", "fg_recordings_split_total");
+    report ("hold timer expiries", "fg_timer_expirations_total");
+    recorded = harness_scrape ("fg_recording_duration_seconds_sum");
+    count = harness_scrape ("fg_recording_duration_seconds_count");
+    printf ("%-22s %.1f s in %.0f, %.1f s each\n", "recorded", recorded,
+            count, count > 0 ? recorded / count : 0);
+
+    status = harness_stop (pid);
+    fake_picam_stop (&picam);
+
+    if (expect >= 0 && count != expect)
+      {
+        fprintf (stderr, "%s: %.0f recordings, expected %d\n", argv[optind],
+                 count, expect);
+        return 1;
+      }
+
+    return WIFEXITED (status) && WEXITSTATUS (status) == 0 ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+/*
+ *  cameras.c
+ *    Camera table, hooks and per camera recording statistics
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "cameras.h"
+#include "hooks.h"
+#include "common.h"
+#include "log.h"
+
+void
+cameras_open (struct cameras *cams, const struct camera_config *cfgs, int n)
+{
+    memset (cams, 0, sizeof (*cams));
+
+    if (n > CAMERA_MAX)
+      {
+        log_error_en (ERANGE, "too many cameras, ignoring the last ones");
+        n = CAMERA_MAX;
+      }
+
+    for (int i = 0; i < n; i++)
+      {
+        struct camera *cam = &cams->camera[i];
+
+        cam->cfg = &cfgs[i];
+        cam->dirfd = -1;
+        cam->wd = -1;
+        cam->parent_wd = -1;
+        atomic_init (&cam->state, RECORD_IDLE);
+        hooks_open (&cam->hooks, cfgs[i].hooks_dir, cfgs[i].hook_fifo);
+      }
+    cams->n = n;
+}
+
+uint32_t
+cameras_for_zones (struct cameras *cams, uint32_t zone_mask)
+{
+    uint32_t mask = 0;
+
+    for (int i = 0; i < cams->n; i++)
+        if (cams->camera[i].cfg->zones & zone_mask)
+            mask |= 1U << i;
+
+    return mask;
+}
+
+struct camera *
+cameras_by_wd (struct cameras *cams, int wd)
+{
+    for (int i = 0; i < cams->n; i++)
+        if (cams->camera[i].wd == wd && cams->camera[i].dirfd >= 0)
+            return &cams->camera[i];
+
+    return NULL;
+}
+
+struct camera *
+cameras_by_parent (struct cameras *cams, int parent_wd, const char *name)
+{
+    for (int i = 0; i < cams->n; i++)
+      {
+        const char *dir = cams->camera[i].cfg->state_dir;
+        const char *slash = strrchr (dir, '/');
+
+        if (cams->camera[i].parent_wd == parent_wd &&
+            strcmp (slash ? slash + 1 : dir, name) == 0)
+            return &cams->camera[i];
+      }
+
+    return NULL;
+}
+
+void
+camera_recorded (struct camera *cam, uint64_t elapsed_ns)
+{
+    uint64_t ms = elapsed_ns / 1000000, max;
+    struct camera_stats *st = &cam->stats;
+
+    atomic_fetch_add_explicit (&st->recordings, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&st->recorded_ms, ms, memory_order_relaxed);
+    max = atomic_load_explicit (&st->longest_ms, memory_order_relaxed);
+    while (ms > max &&
+           !atomic_compare_exchange_weak_explicit (&st->longest_ms, &max, ms,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+        ;
+}
+
+void
+cameras_close (struct cameras *cams)
+{
+    for (int i = 0; i < cams->n; i++)
+      {
+        struct camera *cam = &cams->camera[i];
+
+        _log_debug ("camera %s: %" PRIuFAST64 " recordings, %.1f s "
+                    "recorded, longest %.1f s, %" PRIuFAST64 " hooks "
+                    "retried, %" PRIuFAST64 " given up\n", cam->cfg->name,
+                    atomic_load (&cam->stats.recordings),
+                    atomic_load (&cam->stats.recorded_ms) / 1E3,
+                    atomic_load (&cam->stats.longest_ms) / 1E3,
+                    atomic_load (&cam->stats.retries),
+                    atomic_load (&cam->stats.ack_timeouts));
+        hooks_close (&cam->hooks);
+      }
+    cams->n = 0;
+}
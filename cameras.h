@@ -0,0 +1,108 @@
+/*
+ *  cameras.h
+ *    Set of picam instances started by motion in mapped PIR zones
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _CAMERAS_H_
+#define _CAMERAS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "hooks.h"
+#include "record.h"
+
+/* Cameras are bits in 32 bit masks like zones */
+#define CAMERA_MAX 4
+
+/* Zone mask of a camera started by motion anywhere */
+#define CAMERA_ALL_ZONES 0xffffffffU
+
+/* One picam instance. zones is the mask of PIR zones (index into the zone
+   table) whose motion starts it, a zone may start several cameras */
+struct camera_config {
+    const char *name;
+    const char *state_dir;
+    const char *hooks_dir;
+    const char *hook_fifo; /* NULL for hook files only */
+    uint32_t   zones;
+};
+
+struct camera_stats {
+    atomic_uint_fast64_t recordings;   /* Reported stopped by picam */
+    atomic_uint_fast64_t recorded_ms;
+    atomic_uint_fast64_t longest_ms;
+    atomic_uint_fast64_t retries;      /* Hooks fired again for want of an
+                                          acknowledgement */
+    atomic_uint_fast64_t ack_timeouts; /* Given up on after the retries */
+};
+
+/* Only the thread watching picam (see picam_state.c) writes a camera,
+   state and stats may be read from any thread */
+struct camera {
+    const struct camera_config *cfg;
+    struct hooks               hooks;
+    int                        dirfd;       /* State dir, -1 without a
+                                               watch */
+    int                        wd;
+    int                        parent_wd;   /* Dir holding the state dir,
+                                               to see it created */
+    atomic_int                 state;       /* enum record_state */
+    uint64_t                   start_ns;    /* When picam reported
+                                               recording, or the start
+                                               hook fired without a state
+                                               dir */
+    uint64_t                   deadline_ns; /* For the acknowledgement while
+                                               starting or stopping */
+    int                        attempts;    /* Hooks fired for it */
+    bool                       stop_unacked; /* Stop hook picam has not
+                                                answered "false" to */
+    struct camera_stats        stats;
+};
+
+struct cameras {
+    int           n;
+    struct camera camera[CAMERA_MAX];
+};
+
+/* Open the hooks of n cameras. Never fails, see hooks_open */
+extern void cameras_open (struct cameras *, const struct camera_config *,
+                          int);
+
+/* Mask of the cameras started by motion in any zone of zone_mask */
+extern uint32_t cameras_for_zones (struct cameras *, uint32_t);
+
+/* Camera whose state dir has inotify watch descriptor wd, or NULL */
+extern struct camera *cameras_by_wd (struct cameras *, int);
+
+/* Camera whose state dir is named name in the dir with watch descriptor
+   parent_wd, or NULL */
+extern struct camera *cameras_by_parent (struct cameras *, int,
+                                         const char *);
+
+/* Account a recording of elapsed_ns reported by picam */
+extern void camera_recorded (struct camera *, uint64_t);
+
+/* Log statistics and close every camera's hooks */
+extern void cameras_close (struct cameras *);
+
+#endif /* _CAMERAS_H_ */
@@ -0,0 +1,109 @@
+/*
+ *  clock.c
+ *    Real clock backend, kernel clocks and timerfds
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+const struct clock_backend *clock_backend = &clock_real_backend;
+
+int
+clock_init (const struct clock_backend *backend)
+{
+    clock_backend = backend;
+    _log_debug ("using %s clock\n", backend->name);
+
+    return backend->init ? backend->init () : 0;
+}
+
+static uint64_t
+real_now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int64_t
+real_wall_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+real_timer_create (void)
+{
+    int fd;
+
+    fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        log_error ("error in timerfd_create");
+
+    return fd;
+}
+
+static int
+real_timer_arm (int fd, uint64_t deadline_ns, uint64_t interval_ns)
+{
+    ssize_t s;
+    struct itimerspec timer_value;
+
+    memset (&timer_value, 0, sizeof (timer_value));
+    timer_value.it_value.tv_sec = deadline_ns / 1000000000ULL;
+    timer_value.it_value.tv_nsec = deadline_ns % 1000000000ULL;
+    timer_value.it_interval.tv_sec = interval_ns / 1000000000ULL;
+    timer_value.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+
+    s = timerfd_settime (fd, TFD_TIMER_ABSTIME, &timer_value, NULL);
+    if (s < 0)
+        log_error ("timerfd_settime failed");
+
+    return s;
+}
+
+static void
+real_timer_close (int fd)
+{
+    if (fd >= 0)
+        close (fd);
+}
+
+const struct clock_backend clock_real_backend = {
+    .name         = "real",
+    .init         = NULL,
+    .now_ns       = real_now_ns,
+    .wall_ns      = real_wall_ns,
+    .timer_create = real_timer_create,
+    .timer_arm    = real_timer_arm,
+    .timer_close  = real_timer_close,
+};
@@ -0,0 +1,136 @@
+/*
+ *  clock.h
+ *    Clock and timers used for all of core's timing
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _FG_CLOCK_H_
+#define _FG_CLOCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Timers of the virtual clock live in a fixed table, with room for the
+   pulse timer of every zone */
+#define CLOCK_MAX_TIMERS 16
+
+/* Real time the virtual clock waits after firing a timer, so that work the
+   timer started gets done before time moves on (microseconds) */
+#define CLOCK_VIRTUAL_SETTLE_US 200
+
+/* Time is read from and timers are armed against a monotonic timeline in
+   nanoseconds. Wall clock time is only for timestamps that are stored or
+   depend on the time of day, never for durations. A timer is a file
+   descriptor that becomes readable when it expires, reading it returns
+   the number of expirations as an uint64_t like a timerfd */
+struct clock_backend {
+    const char *name;
+
+    int      (*init) (void);
+    uint64_t (*now_ns) (void);
+    int64_t  (*wall_ns) (void);
+
+    /* Returns a non-blocking fd or -1 */
+    int      (*timer_create) (void);
+
+    /* Expire at deadline_ns, then every interval_ns unless that is zero. A
+       deadline of zero disarms. Pending expirations are discarded */
+    int      (*timer_arm) (int, uint64_t, uint64_t);
+
+    void     (*timer_close) (int);
+};
+
+/* CLOCK_MONOTONIC, CLOCK_REALTIME and timerfds */
+extern const struct clock_backend clock_real_backend;
+
+/* Time only moves when the thread running thread_clock_start advances it,
+   which it does straight to the next timer deadline */
+extern const struct clock_backend clock_virtual_backend;
+
+extern const struct clock_backend *clock_backend;
+
+/* Select backend, call before anything reads the time */
+extern int clock_init (const struct clock_backend *);
+
+static inline uint64_t
+clock_now_ns (void)
+{
+    return clock_backend->now_ns ();
+}
+
+/* Milliseconds since epoch */
+static inline int64_t
+clock_wall_ms (void)
+{
+    return clock_backend->wall_ns () / 1000000;
+}
+
+static inline void
+clock_wall_ts (struct timespec *ts)
+{
+    int64_t ns = clock_backend->wall_ns ();
+
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+static inline int
+clock_timer_create (void)
+{
+    return clock_backend->timer_create ();
+}
+
+static inline int
+clock_timer_arm (int fd, uint64_t deadline_ns, uint64_t interval_ns)
+{
+    return clock_backend->timer_arm (fd, deadline_ns, interval_ns);
+}
+
+/* Arm fd to expire once ms milliseconds from now */
+static inline int
+clock_timer_arm_ms (int fd, uint32_t ms)
+{
+    return clock_timer_arm (fd, clock_now_ns () + ms * 1000000ULL, 0);
+}
+
+static inline void
+clock_timer_close (int fd)
+{
+    clock_backend->timer_close (fd);
+}
+
+static inline bool
+clock_is_virtual (void)
+{
+    return clock_backend == &clock_virtual_backend;
+}
+
+/* Virtual time advanced since clock_init */
+extern uint64_t clock_virtual_elapsed_ns (void);
+
+/* True once no one-shot timer is armed, periodic timers alone never make
+   anything happen that the simulation is waiting for */
+extern bool clock_virtual_idle (void);
+
+/* Start routine for the thread advancing the virtual clock */
+extern void *thread_clock_start (void *);
+
+#endif /* _FG_CLOCK_H_ */
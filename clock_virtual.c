@@ -0,0 +1,321 @@
+/*
+ *  clock_virtual.c
+ *    Virtual clock backend for time-accelerated simulation
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+/*
+ * Virtual time starts at the real monotonic time of clock_init and only
+ * moves when thread_clock_start advances it, which it does straight to the
+ * earliest timer deadline. Timers are eventfds: expiring one writes the
+ * number of expirations to it, so readers treat it like a timerfd.
+ *
+ * Work a timer starts in other threads runs in real time, so after firing
+ * a timer the thread waits until the eventfd has been read and then
+ * CLOCK_VIRTUAL_SETTLE_US more before moving on. A periodic timer that
+ * would fire several times before the next other deadline fires once with
+ * the count of all of them, like a timerfd that was read late.
+ *
+ * Wall clock time is virtual time plus the offset at clock_init, or the
+ * epoch in seconds given by FG_CLOCK_EPOCH, which lets a trace recorded at
+ * night replay at night.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+/* How long to wait for a fired timer to be read before moving on anyway
+   (microseconds) */
+#define CONSUME_TIMEOUT_US 1000000
+
+struct vtimer {
+    int      fd; /* -1 if the slot is free */
+    bool     armed;
+    uint64_t deadline_ns;
+    uint64_t interval_ns;
+};
+
+static pthread_mutex_t vmutex = PTHREAD_MUTEX_INITIALIZER;
+static struct vtimer vtimers[CLOCK_MAX_TIMERS];
+static atomic_uint_fast64_t vnow;
+static uint64_t vstart;
+static int64_t wall_offset;
+static atomic_bool idle;
+
+static int
+virtual_init (void)
+{
+    const char *epoch;
+    struct timespec ts;
+
+    for (int i = 0; i < CLOCK_MAX_TIMERS; i++)
+        vtimers[i].fd = -1;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    vstart = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    atomic_store (&vnow, vstart);
+
+    epoch = getenv ("FG_CLOCK_EPOCH");
+    if (epoch != NULL)
+        wall_offset = atoll (epoch) * 1000000000LL - (int64_t) vstart;
+    else
+      {
+        clock_gettime (CLOCK_REALTIME, &ts);
+        wall_offset = (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec -
+                      (int64_t) vstart;
+      }
+
+    return 0;
+}
+
+static uint64_t
+virtual_now_ns (void)
+{
+    return atomic_load (&vnow);
+}
+
+static int64_t
+virtual_wall_ns (void)
+{
+    return (int64_t) atomic_load (&vnow) + wall_offset;
+}
+
+static struct vtimer *
+find_timer (int fd)
+{
+    for (int i = 0; i < CLOCK_MAX_TIMERS; i++)
+        if (vtimers[i].fd == fd)
+            return &vtimers[i];
+
+    return NULL;
+}
+
+static int
+virtual_timer_create (void)
+{
+    int fd;
+    struct vtimer *t;
+
+    fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+      {
+        log_error ("error in eventfd");
+        return -1;
+      }
+
+    pthread_mutex_lock (&vmutex);
+    t = find_timer (-1);
+    if (t != NULL)
+      {
+        t->fd = fd;
+        t->armed = false;
+      }
+    pthread_mutex_unlock (&vmutex);
+
+    if (t == NULL)
+      {
+        log_error_en (ENOSPC, "no free virtual timer");
+        close (fd);
+        return -1;
+      }
+
+    return fd;
+}
+
+static int
+virtual_timer_arm (int fd, uint64_t deadline_ns, uint64_t interval_ns)
+{
+    uint64_t u;
+    struct vtimer *t;
+
+    pthread_mutex_lock (&vmutex);
+    t = find_timer (fd);
+    if (t != NULL)
+      {
+        /* Discard pending expirations like timerfd_settime */
+        while (read (fd, &u, sizeof (uint64_t)) > 0)
+            ;
+        t->armed = deadline_ns != 0;
+        t->deadline_ns = deadline_ns;
+        t->interval_ns = interval_ns;
+        if (t->armed && interval_ns == 0)
+            atomic_store (&idle, false);
+      }
+    pthread_mutex_unlock (&vmutex);
+
+    if (t == NULL)
+      {
+        log_error_en (EBADF, "not a virtual timer");
+        return -1;
+      }
+
+    return 0;
+}
+
+static void
+virtual_timer_close (int fd)
+{
+    struct vtimer *t;
+
+    if (fd < 0)
+        return;
+
+    pthread_mutex_lock (&vmutex);
+    t = find_timer (fd);
+    if (t != NULL)
+        t->fd = -1;
+    pthread_mutex_unlock (&vmutex);
+    close (fd);
+}
+
+const struct clock_backend clock_virtual_backend = {
+    .name         = "virtual",
+    .init         = virtual_init,
+    .now_ns       = virtual_now_ns,
+    .wall_ns      = virtual_wall_ns,
+    .timer_create = virtual_timer_create,
+    .timer_arm    = virtual_timer_arm,
+    .timer_close  = virtual_timer_close,
+};
+
+uint64_t
+clock_virtual_elapsed_ns (void)
+{
+    return atomic_load (&vnow) - vstart;
+}
+
+bool
+clock_virtual_idle (void)
+{
+    return atomic_load (&idle);
+}
+
+/* Move time to the earliest deadline and expire that timer. Returns its
+   fd, or -1 when no one-shot timer is armed and time stands still */
+static int
+advance (void)
+{
+    int fd = -1;
+    uint64_t count = 1, next_other = UINT64_MAX;
+    bool oneshot = false;
+    struct vtimer *first = NULL;
+
+    pthread_mutex_lock (&vmutex);
+    for (int i = 0; i < CLOCK_MAX_TIMERS; i++)
+      {
+        struct vtimer *t = &vtimers[i];
+
+        if (t->fd < 0 || !t->armed)
+            continue;
+        if (t->interval_ns == 0)
+            oneshot = true;
+        if (first == NULL || t->deadline_ns < first->deadline_ns)
+          {
+            if (first != NULL)
+                next_other = first->deadline_ns;
+            first = t;
+          }
+        else if (t->deadline_ns < next_other)
+            next_other = t->deadline_ns;
+      }
+
+    if (oneshot)
+      {
+        uint64_t deadline = first->deadline_ns;
+
+        if (first->interval_ns != 0 && next_other != UINT64_MAX &&
+            next_other > deadline)
+            count += (next_other - deadline) / first->interval_ns;
+
+        deadline += (count - 1) * first->interval_ns;
+        if (deadline > atomic_load (&vnow))
+            atomic_store (&vnow, deadline);
+
+        if (first->interval_ns != 0)
+            first->deadline_ns = deadline + first->interval_ns;
+        else
+            first->armed = false;
+
+        fd = first->fd;
+        if (write (fd, &count, sizeof (uint64_t)) < 0)
+            log_error ("write to virtual timer failed");
+      }
+    pthread_mutex_unlock (&vmutex);
+
+    return fd;
+}
+
+/* Start routine for the thread advancing virtual time */
+void *
+thread_clock_start (void *arg)
+{
+    int fd;
+    ssize_t s;
+    struct thread_data *tdata = arg;
+    struct pollfd pfd;
+    struct timespec settle = { 0, CLOCK_VIRTUAL_SETTLE_US * 1000L };
+    struct timespec slice = { 0, 20000 };
+    struct timespec still = { 0, 10000000 };
+
+    pfd.fd = tdata->timerpipe[0];
+    pfd.events = POLLIN | POLLPRI;
+
+    while (1)
+      {
+        fd = advance ();
+
+        /* Wait for the timer to be read, then for what it started */
+        if (fd >= 0)
+          {
+            struct pollfd tfd = { .fd = fd, .events = POLLIN };
+
+            for (long waited = 0; waited < CONSUME_TIMEOUT_US;
+                 waited += slice.tv_nsec / 1000)
+              {
+                if (poll (&tfd, 1, 0) == 0)
+                    break;
+                nanosleep (&slice, NULL);
+              }
+          }
+        else if (!atomic_load (&idle))
+          {
+            atomic_store (&idle, true);
+            _log_debug ("virtual clock idle after %.3f s\n",
+                        clock_virtual_elapsed_ns () / 1E9);
+          }
+
+        /* If there is data to read on timerpipe, we shall exit */
+        s = ppoll (&pfd, 1, fd >= 0 ? &settle : &still, NULL);
+        if (s < 0 && errno != EINTR)
+            log_error ("ppoll failed");
+        else if (s > 0)
+            break;
+      }
+
+    return NULL;
+}
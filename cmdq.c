@@ -0,0 +1,130 @@
+/*
+ *  cmdq.c
+ *    Multiple producer, single consumer ring of recording commands
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+
+#include "cmdq.h"
+
+_Static_assert ((CMDQ_SIZE & (CMDQ_SIZE - 1)) == 0,
+                "CMDQ_SIZE must be a power of two");
+
+static const char *const type_names[] = {
+    "start",
+    "stop",
+    "extend",
+    "snapshot"
+};
+
+static const char *const source_names[] = {
+    "zones",
+    "fake isr",
+    "timer",
+    "signal"
+};
+
+/* Slot i starts out ready for position i. A producer claims position p by
+   moving head past it and publishes by setting seq to p + 1, the consumer
+   frees the slot for the next lap by setting seq to p + CMDQ_SIZE */
+void
+cmdq_init (struct cmdq *q)
+{
+    memset (q, 0, sizeof (*q));
+    for (size_t i = 0; i < CMDQ_SIZE; i++)
+        atomic_init (&q->slots[i].seq, i);
+    atomic_init (&q->head, 0);
+    atomic_init (&q->tail, 0);
+}
+
+int
+cmdq_push (struct cmdq *q, const struct cmd *cmd)
+{
+    size_t pos, seq, used, max;
+    struct cmdq_slot *slot;
+
+    pos = atomic_load_explicit (&q->head, memory_order_relaxed);
+    while (1)
+      {
+        slot = &q->slots[pos & (CMDQ_SIZE - 1)];
+        seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+        if (seq == pos)
+          {
+            if (atomic_compare_exchange_weak_explicit (&q->head, &pos,
+                                                       pos + 1,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed))
+                break;
+          }
+        else if ((ptrdiff_t) (seq - pos) < 0)
+          {
+            /* Still holding a command from the previous lap */
+            atomic_fetch_add_explicit (&q->dropped, 1, memory_order_relaxed);
+            return 1;
+          }
+        else
+            pos = atomic_load_explicit (&q->head, memory_order_relaxed);
+      }
+
+    slot->cmd = *cmd;
+    atomic_store_explicit (&slot->seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add_explicit (&q->pushed, 1, memory_order_relaxed);
+    /* Approximate, the consumer may be popping meanwhile */
+    used = pos + 1 - atomic_load_explicit (&q->tail, memory_order_relaxed);
+    max = atomic_load_explicit (&q->high_water, memory_order_relaxed);
+    while (used <= CMDQ_SIZE && used > max &&
+           !atomic_compare_exchange_weak_explicit (&q->high_water, &max, used,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+        ;
+
+    return 0;
+}
+
+bool
+cmdq_pop (struct cmdq *q, struct cmd *cmd)
+{
+    size_t tail = atomic_load_explicit (&q->tail, memory_order_relaxed);
+    struct cmdq_slot *slot = &q->slots[tail & (CMDQ_SIZE - 1)];
+
+    if (atomic_load_explicit (&slot->seq, memory_order_acquire) != tail + 1)
+        return false;
+
+    *cmd = slot->cmd;
+    atomic_store_explicit (&slot->seq, tail + CMDQ_SIZE,
+                           memory_order_release);
+    atomic_store_explicit (&q->tail, tail + 1, memory_order_relaxed);
+
+    return true;
+}
+
+const char *
+cmd_type_name (enum cmd_type type)
+{
+    return type_names[type];
+}
+
+const char *
+cmd_source_name (enum cmd_source source)
+{
+    return source_names[source];
+}
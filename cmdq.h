@@ -0,0 +1,88 @@
+/*
+ *  cmdq.h
+ *    Bounded lock-free queue of recording commands for the picam thread
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _CMDQ_H_
+#define _CMDQ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Slots in the ring, a power of two. Producers only queue a command when
+   the recording changes, so a burst of edges queues a handful */
+#define CMDQ_SIZE 64
+
+enum cmd_type {
+    CMD_START,    /* Start cameras for a new recording */
+    CMD_STOP,     /* Stop every camera of the recording */
+    CMD_EXTEND,   /* Add cameras to the ongoing recording */
+    CMD_SNAPSHOT  /* Log the recording state */
+};
+
+/* Who asked, zones holds the zones that saw motion for CMD_SOURCE_ZONES */
+enum cmd_source {
+    CMD_SOURCE_ZONES,
+    CMD_SOURCE_FAKE_ISR,
+    CMD_SOURCE_TIMER,
+    CMD_SOURCE_SIGNAL
+};
+
+struct cmd {
+    enum cmd_type   type;
+    enum cmd_source source;
+    uint32_t        zones;
+    uint32_t        cameras;    /* Mask, unused by CMD_STOP */
+    uint64_t        trigger_ns; /* Edge or expiry behind it (clock_now_ns) */
+};
+
+struct cmdq_slot {
+    atomic_size_t seq; /* Position the slot is ready for, see cmdq.c */
+    struct cmd    cmd;
+};
+
+/* Any thread may push, only one may pop */
+struct cmdq {
+    struct cmdq_slot     slots[CMDQ_SIZE];
+    atomic_size_t        head; /* Next position to push */
+    atomic_size_t        tail; /* Next position to pop */
+    atomic_uint_fast64_t pushed;
+    atomic_uint_fast64_t dropped;
+    atomic_uint_fast64_t high_water;
+};
+
+extern void cmdq_init (struct cmdq *);
+
+/* Copy cmd into the queue, returns non-zero if it is full */
+extern int cmdq_push (struct cmdq *, const struct cmd *);
+
+/* Take the oldest command, returns false if there is none. A command still
+   being written by its producer ends the batch, the producer rings the
+   doorbell once it is done */
+extern bool cmdq_pop (struct cmdq *, struct cmd *);
+
+extern const char *cmd_type_name (enum cmd_type);
+
+extern const char *cmd_source_name (enum cmd_source);
+
+#endif /* _CMDQ_H_ */
@@ -33,6 +33,21 @@
 
 #include <fgevents.h>
 
+#include "gpio.h"
+#include "zones.h"
+#include "tsdb.h"
+#include "sampler.h"
+#include "seqlock.h"
+#include "holdtime.h"
+#include "hooks.h"
+#include "record.h"
+#include "cameras.h"
+#include "cmdq.h"
+#include "trace.h"
+#include "metrics.h"
+#include "clock.h"
+#include "rt.h"
+
 /* Define _GNU_SOURCE for pthread_timedjoin_np and asprintf */
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
@@ -41,44 +56,198 @@
 /* Define _DEBUG to enable debug messages */
 #define _DEBUG
 
+/* Define _REACTOR to handle the timer, picam state, record events and signals
+   on a single epoll loop in the main thread instead of one thread each */
+/* #define _REACTOR */
+
+/* Define RT_PROFILE to pin the motion path to RT_MOTION_CPU with SCHED_FIFO
+   priority, lock all memory and run the jitter probe (see rt.c). Needs
+   CAP_SYS_NICE and CAP_IPC_LOCK. Without it only the timer thread gets
+   SCHED_FIFO */
+/* #define RT_PROFILE */
+
 #define TIMESTAMP_MAX_LENGTH 32
 
-/* Temporary defs before config file is setup */
+/* Temporary defs before config file is setup. Each can be overridden with
+   -D, the host bench (see bench/) builds with its own paths and timings */
+#ifndef PICAM_STATE_DIR
 #define PICAM_STATE_DIR "/mnt/mmcblk0p2/picam/state"
-#define PICAM_STOP_HOOK "/mnt/mmcblk0p2/picam/hooks/stop_record"
-#define PICAM_START_HOOK "/mnt/mmcblk0p2/picam/hooks/start_record"
+#endif
+#ifndef PICAM_HOOKS_DIR
+#define PICAM_HOOKS_DIR "/mnt/mmcblk0p2/picam/hooks"
+#endif
+/* Define for picam builds reading hooks as lines from a FIFO, hook files
+   are still used while nothing reads it */
+/* #define PICAM_HOOK_FIFO "/mnt/mmcblk0p2/picam/hooks/fifo" */
+#ifndef UNIX_SOCKET_PATH
 #define UNIX_SOCKET_PATH "/tmp/fg.socket"
+#endif
+#ifndef METRICS_SOCKET_PATH
+#define METRICS_SOCKET_PATH "/tmp/fg.metrics.socket"
+#endif
+/* POSIX shared memory segment the live status is published in, see
+   status.h */
+#ifndef STATUS_SHM_NAME
+#define STATUS_SHM_NAME "/fg.status"
+#endif
+#ifndef PORT
 #define PORT 1337
+#endif
+#ifndef GPIO_CHIP_PATH
+#define GPIO_CHIP_PATH "/dev/gpiochip0"
+#endif
+#ifndef GPIO_SIM_SOURCE
+#define GPIO_SIM_SOURCE "/tmp/fg-gpio-sim"
+#endif
+#ifndef TSDB_PATH
+#define TSDB_PATH "/mnt/mmcblk0p2/fagelmatare/core.tsdb"
+#endif
+#ifndef SAMPLER_PERIOD_MS
+#define SAMPLER_PERIOD_MS 5000
+#endif
+
+/* PIR edges closer than this to the previous edge are chatter, and at most
+   PIR_MAX_EDGES are handled per PIR_RATE_WINDOW_MS. 0 disables either */
+#ifndef PIR_MIN_PULSE_MS
+#define PIR_MIN_PULSE_MS 50
+#endif
+#ifndef PIR_MAX_EDGES
+#define PIR_MAX_EDGES 20
+#endif
+#ifndef PIR_RATE_WINDOW_MS
+#define PIR_RATE_WINDOW_MS 1000
+#endif
+
+/* How PIR zones combine into starting a recording, see zones.h. A zone
+   counts as active for ZONE_HOLD_MS after its PIR goes low, so motion
+   passing from one zone to the next can win a vote */
+#ifndef ZONE_POLICY
+#define ZONE_POLICY ZONE_POLICY_ANY
+#endif
+#ifndef ZONE_VOTE_K
+#define ZONE_VOTE_K 2
+#endif
+#ifndef ZONE_START_PRIORITY
+#define ZONE_START_PRIORITY 1
+#endif
+#ifndef ZONE_HOLD_MS
+#define ZONE_HOLD_MS 3000
+#endif
+
+/* Bounds of the recording hold time after the last motion, the default is
+   used until enough PIR activity has been seen at that hour. A restart is
+   weighed as this much idle footage (milliseconds) */
+#ifndef HOLDTIME_MIN_MS
+#define HOLDTIME_MIN_MS 2000
+#endif
+#ifndef HOLDTIME_MAX_MS
+#define HOLDTIME_MAX_MS 30000
+#endif
+#ifndef HOLDTIME_DEFAULT_MS
+#define HOLDTIME_DEFAULT_MS 5000
+#endif
+#ifndef HOLDTIME_RESTART_COST_MS
+#define HOLDTIME_RESTART_COST_MS 10000
+#endif
+
+/* After the hold time a stop is deferred this long (milliseconds) and
+   dropped if motion resumes, merging close visits into one recording. 0
+   stops right away */
+#ifndef COALESCE_GRACE_MS
+#define COALESCE_GRACE_MS 10000
+#endif
+
+/* Real-time profile. picam encodes on the other cores. Stacks of threads
+   core creates are RT_STACK_SIZE so locking them stays cheap, threads from
+   libraries pre-fault RT_STACK_PREFAULT bytes of theirs (bytes) */
+#ifndef RT_MOTION_CPU
+#define RT_MOTION_CPU 3
+#endif
+#ifndef RT_MOTION_PRIORITY
+#define RT_MOTION_PRIORITY 50
+#endif
+#ifndef RT_STACK_SIZE
+#define RT_STACK_SIZE (256 * 1024)
+#endif
+#ifndef RT_STACK_PREFAULT
+#define RT_STACK_PREFAULT (64 * 1024)
+#endif
+#ifndef RT_PROBE_PERIOD_MS
+#define RT_PROBE_PERIOD_MS 10
+#endif
+
+/* How long picam gets to acknowledge a hook through its state dir before
+   the hook is fired again (milliseconds), and how many times. A camera
+   that never answers is taken as idle after that */
+#ifndef RECORD_ACK_TIMEOUT_MS
+#define RECORD_ACK_TIMEOUT_MS 3000
+#endif
+#ifndef RECORD_HOOK_RETRIES
+#define RECORD_HOOK_RETRIES 2
+#endif
+
+/* The GPIO backend is selected with GPIO_BACKEND in the Makefile, default
+   to wiringPi when building without it */
+#if !defined (GPIO_BACKEND_WIRINGPI) && !defined (GPIO_BACKEND_CDEV) &&\
+    !defined (GPIO_BACKEND_SIM)
+#define GPIO_BACKEND_WIRINGPI
+#endif
 
 /* String containing name the program is called with.
    To be initialized by main(). */
 extern const char *__progname;
 
+/* Latest value of each sensor in the registry (see sensors.c) */
 struct SensorData {
-    float intemp;
-    float outtemp;
-    float cputemp;
-    float pressure;
-    float humidity;
+    float    intemp;
+    float    outtemp;
+    float    cputemp;
+    float    pressure;
+    float    humidity;
+    uint32_t present; /* Bit per registry entry that has a value */
+};
+
+/* SensorData published as a versioned snapshot. A writer changes a copy of
+   the latest version and swaps it in whole, readers copy it under the
+   seqlock and never wait for the writer (see sensors.h) */
+struct sensor_store {
+    pthread_mutex_t   write_mutex; /* Serializes writers, not readers */
+    struct seqlock    lock;
+    struct SensorData data;
 };
 
 /* Common data structure used by threads */
 struct thread_data {
-    int                   pir_pin;    
     int                   timerfd;
     int                   timerpipe[2];
     int                   record_eventfd;
+    int                   metrics_fd;
     atomic_bool           fake_isr;
-    atomic_bool           is_recording;
+    atomic_bool           in_grace;
+    atomic_uint_fast64_t  last_stop_ns;
+    atomic_uint_fast64_t  merged_recordings;
+    atomic_uint_fast64_t  split_recordings;
     pthread_t             timer_t;
     pthread_t             picam_t;
     pthread_t             events_t;
+    pthread_t             gpio_t;
+    pthread_t             sampler_t;
+    pthread_t             metrics_t;
+    pthread_t             vclock_t;
+    pthread_t             probe_t;
     pthread_attr_t        attr;
-    pthread_mutex_t       record_mutex;
-    pthread_mutex_t       wiring_mutex;
-    pthread_mutex_t       sensor_mutex;
+    struct zones          zones;
     struct fg_events_data etdata;
-    struct SensorData     sensor_data;
+    struct sensor_store   sensors;
+    struct history        *history;
+    struct status         *status;
+    struct tsdb           tsdb;
+    struct sampler        sampler;
+    struct holdtime       holdtime;
+    struct recording      recording;
+    struct cameras        cameras;
+    struct cmdq           picam_cmds;
+    struct trace          trace;
 };
 
 #endif /* _COMMON_H_ */
\ No newline at end of file
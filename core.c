@@ -2,7 +2,7 @@
  *  fagelmatare-core
  *    Communicates with picam when a motion event is risen and logs statistics
  *  core.c
- *    Initialize wiring pi and create threads for each asynchrounous function 
+ *    Initialize GPIO and create threads for each asynchrounous function 
  *****************************************************************************
  *  This file is part of Fågelmataren, an embedded project created to learn
  *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
@@ -27,8 +27,8 @@
 #include <semaphore.h>
 #include <stdatomic.h>
 #include <pthread.h>
-#include <sys/timerfd.h>
 #include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -38,35 +38,132 @@
 #include <string.h>
 #include <errno.h>
 
-#include <wiringPi/wiringPi.h>
-
 #include "picam_state.h"
 #include "motion.h"
 #include "timeout.h"
 #include "network.h"
+#include "reactor.h"
+#include "history.h"
+#include "status.h"
+#include "sensors.h"
 #include "common.h"
 #include "log.h"
 #include "core.h"
 
-/* The PIR sensor is wired to the physical pin 31 (wiringPi pin 21) */
-#define PIR_PIN 21
+/* One row per PIR sensor, pin numbering depends on the backend. The tray
+   sensor is wired to the physical pin 31 (wiringPi pin 21). The sim
+   backend has a zone per zone field of its source, see gpio_sim.c */
+#if defined (GPIO_BACKEND_CDEV)
+#define PIR_BACKEND gpio_cdev_backend
+static const struct zone_config pir_zones[] = {
+    /* name      pin  min pulse         hold          priority */
+    { "tray",     5,  PIR_MIN_PULSE_MS, ZONE_HOLD_MS, 1 },
+};
+#elif defined (GPIO_BACKEND_SIM)
+#define PIR_BACKEND gpio_sim_backend
+static const struct zone_config pir_zones[] = {
+    { "tray",     0,  PIR_MIN_PULSE_MS, ZONE_HOLD_MS, 1 },
+    { "perch",    1,  PIR_MIN_PULSE_MS, ZONE_HOLD_MS, 1 },
+    { "approach", 2,  PIR_MIN_PULSE_MS, ZONE_HOLD_MS, 0 },
+};
+#else
+#define PIR_BACKEND gpio_wiringpi_backend
+static const struct zone_config pir_zones[] = {
+    { "tray",     21, PIR_MIN_PULSE_MS, ZONE_HOLD_MS, 1 },
+};
+#endif
+
+/* Cameras started by motion, each a picam instance with its own state and
+   hooks dirs. zones is a mask of the pir_zones entries that start it */
+#ifdef PICAM_HOOK_FIFO
+#define CAMERA_HOOK_FIFO PICAM_HOOK_FIFO
+#else
+#define CAMERA_HOOK_FIFO NULL
+#endif
+static const struct camera_config picam_cameras[] = {
+    /* name    state dir        hooks dir        hook fifo         zones */
+    { "feeder", PICAM_STATE_DIR, PICAM_HOOKS_DIR, CAMERA_HOOK_FIFO,
+      CAMERA_ALL_ZONES },
+};
+
+/* Scheduling of each thread, see rt.h. The motion path shares one CPU at
+   real-time priority, edges first so a burst can't starve them */
+#ifdef RT_PROFILE
+static const struct rt_config rt_threads[RT_NTHREADS] = {
+    /*                   name          cpu            policy       priority */
+    [RT_THREAD_MAIN]    = { "fg-core",    RT_MOTION_CPU, SCHED_FIFO,
+                            RT_MOTION_PRIORITY },
+    [RT_THREAD_TIMER]   = { "fg-timer",   RT_MOTION_CPU, SCHED_FIFO,
+                            RT_MOTION_PRIORITY },
+    [RT_THREAD_GPIO]    = { "fg-gpio",    RT_MOTION_CPU, SCHED_FIFO,
+                            RT_MOTION_PRIORITY + 1 },
+    [RT_THREAD_PICAM]   = { "fg-picam",   RT_MOTION_CPU, SCHED_FIFO,
+                            RT_MOTION_PRIORITY },
+    [RT_THREAD_EVENTS]  = { "fg-events",  -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_SAMPLER] = { "fg-sampler", -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_METRICS] = { "fg-metrics", -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_PROBE]   = { "fg-probe",   RT_MOTION_CPU, SCHED_FIFO,
+                            RT_MOTION_PRIORITY },
+};
+#else
+static const struct rt_config rt_threads[RT_NTHREADS] = {
+    [RT_THREAD_MAIN]    = { "fg-core",    -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_TIMER]   = { "fg-timer",   -1,            SCHED_FIFO,  1 },
+    [RT_THREAD_GPIO]    = { "fg-gpio",    -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_PICAM]   = { "fg-picam",   -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_EVENTS]  = { "fg-events",  -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_SAMPLER] = { "fg-sampler", -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_METRICS] = { "fg-metrics", -1,            SCHED_OTHER, 0 },
+    [RT_THREAD_PROBE]   = { "fg-probe",   -1,            SCHED_OTHER, 0 },
+};
+#endif
+
+/* Virtual time for simulation, see clock_virtual.c */
+#ifdef CLOCK_VIRTUAL
+#define CORE_CLOCK clock_virtual_backend
+#else
+#define CORE_CLOCK clock_real_backend
+#endif
 
 /* Forward declarations used in this file. */
 static void do_cleanup (struct thread_data *tdata);
 
 static int setup_thread_attr (struct thread_data *);
 static int create_timer_thread (struct thread_data *);
-static int setup_wiringPi (struct thread_data *);
+static int setup_gpio (struct thread_data *);
 
 static void join_or_cancel_thread (pthread_t, struct timespec *);
 
+static int run_reactor (struct thread_data *);
+
+#ifdef _REACTOR
+static const bool use_reactor = true;
+#else
+static const bool use_reactor = false;
+#endif
+
+/* Lateness is meaningless on a virtual clock */
+#if defined (RT_PROFILE) && !defined (CLOCK_VIRTUAL)
+static const bool use_probe = true;
+#else
+static const bool use_probe = false;
+#endif
+
+/* Signals we exit on, SIGTSTP is used to raise a fake interrupt and
+   SIGUSR1 to log the recording state */
+static const int handled_signals[] = { SIGINT, SIGHUP, SIGTERM, SIGTSTP,
+                                       SIGUSR1 };
+
 /* Non-zero means we should exit the program as soon as possible */
 static sem_t keep_going;
 
 /* Used for faking interrupts */
 static volatile int raise_fake_isr = 0;
 
-/* Signal handler for SIGTSTP, SIGINT, SIGHUP and SIGTERM */
+/* Used for asking the picam thread for a snapshot */
+static volatile int raise_snapshot = 0;
+
+/* Signal handler for SIGTSTP, SIGUSR1, SIGINT, SIGHUP and SIGTERM */
 static void
 handle_sig (int signum)
 {
@@ -74,6 +171,8 @@ handle_sig (int signum)
 
     if (signum == SIGTSTP)
         raise_fake_isr = 1;
+    else if (signum == SIGUSR1)
+        raise_snapshot = 1;
     sem_post (&keep_going);
 
     new_action.sa_handler = handle_sig;
@@ -88,10 +187,27 @@ static void
 handle_signals ()
 {
     struct sigaction new_action, old_action;
+    sigset_t mask;
 
     /* Turn off buffering on stdout to directly write to log file */
     setvbuf (stdout, NULL, _IONBF, 0);
 
+    /* In reactor mode signals are read from a signalfd, so block them here
+       before any thread is created to make every thread inherit the mask */
+    if (use_reactor)
+      {
+        sigemptyset (&mask);
+        for (size_t i = 0; i < sizeof (handled_signals) / sizeof (int); i++)
+          {
+            sigaction (handled_signals[i], NULL, &old_action);
+            if (old_action.sa_handler != SIG_IGN)
+                sigaddset (&mask, handled_signals[i]);
+          }
+        if (pthread_sigmask (SIG_BLOCK, &mask, NULL) != 0)
+            log_error ("error in pthread_sigmask");
+        return;
+      }
+
     /* Set up the structure to specify the new action. */
     new_action.sa_handler = handle_sig;
     sigemptyset (&new_action.sa_mask);
@@ -111,6 +227,22 @@ handle_signals ()
     sigaction (SIGTSTP, NULL, &old_action);
     if (old_action.sa_handler != SIG_IGN)
         sigaction (SIGTSTP, &new_action, NULL); 
+    sigaction (SIGUSR1, NULL, &old_action);
+    if (old_action.sa_handler != SIG_IGN)
+        sigaction (SIGUSR1, &new_action, NULL);
+}
+
+/* Ask the picam thread to log the recording state */
+static void
+request_snapshot (struct thread_data *tdata)
+{
+    struct cmd cmd;
+
+    memset (&cmd, 0, sizeof (cmd));
+    cmd.type = CMD_SNAPSHOT;
+    cmd.source = CMD_SOURCE_SIGNAL;
+    cmd.trigger_ns = clock_now_ns ();
+    picam_send (tdata, &cmd);
 }
 
 /* Helper function to attempt joining a thread, if a timeout runs out it shall
@@ -135,15 +267,7 @@ setup_thread_attr (struct thread_data *tdata)
 {
     ssize_t s;
 
-    s = pthread_mutex_init (&tdata->sensor_mutex, NULL);
-    if (s != 0)
-      {
-        log_error_en (s, "error in pthread_mutex_init");
-        do_cleanup (tdata);
-        return s;   
-      }
-
-    s = pthread_mutex_init (&tdata->record_mutex, NULL);
+    s = sensors_store_init (&tdata->sensors);
     if (s != 0)
       {
         log_error_en (s, "error in pthread_mutex_init");
@@ -176,8 +300,19 @@ setup_thread_attr (struct thread_data *tdata)
       {
         log_error_en (s, "error in pthread_attr_setdetachstate");
         do_cleanup (tdata);     
+        return s;
       }
 
+#ifdef RT_PROFILE
+    /* Locked memory covers every thread stack, keep them small */
+    s = pthread_attr_setstacksize (&tdata->attr, RT_STACK_SIZE);
+    if (s != 0)
+      {
+        log_error_en (s, "error in pthread_attr_setstacksize");
+        do_cleanup (tdata);
+      }
+#endif
+
     return s;
 }
 
@@ -185,78 +320,163 @@ setup_thread_attr (struct thread_data *tdata)
 static int
 create_timer_thread (struct thread_data *tdata)
 {
-    struct sched_param param;
     ssize_t s;
 
-    tdata->is_recording = ATOMIC_VAR_INIT (false);
     s = pthread_create (&tdata->timer_t, &tdata->attr, &thread_timeout_start,
                         tdata);
     if (s != 0)
       {
         log_error_en (s, "error creating timeout thread");
         do_cleanup (tdata);
+        return s;
       }
 
-    memset (&param, 0, sizeof (struct sched_param));
-    param.sched_priority = 1;
+    /* Runs without real-time priority rather than not at all */
+    rt_apply (tdata->timer_t, RT_THREAD_TIMER);
 
-    s = pthread_setschedparam (tdata->timer_t, SCHED_FIFO, &param);
+    return 0;
+}
+
+static int
+create_picam_thread (struct thread_data *tdata)
+{
+    ssize_t s;
+
+    s = pthread_create (&tdata->picam_t, &tdata->attr, &thread_picam_start,
+                        tdata);
+    if (s != 0)
+      {
+        log_error_en (s, "error creating picam thread");
+        do_cleanup (tdata);
+        return s;
+      }
+    rt_apply (tdata->picam_t, RT_THREAD_PICAM);
+
+    return 0;
+}
+
+/* Helper function to open the PIR zones and register the motion handler */
+static int
+setup_gpio (struct thread_data *tdata)
+{
+    ssize_t s;
+    struct gpio_filter filter;
+
+    memset (&filter, 0, sizeof (filter));
+    filter.max_edges = PIR_MAX_EDGES;
+    filter.window_ns = (uint64_t) PIR_RATE_WINDOW_MS * 1000000;
+
+    s = zones_open (&tdata->zones, &PIR_BACKEND, pir_zones,
+                    sizeof (pir_zones) / sizeof (pir_zones[0]), &filter,
+                    ZONE_POLICY, ZONE_VOTE_K, ZONE_START_PRIORITY,
+                    &tdata->holdtime, &on_zones_motion, tdata);
     if (s != 0)
       {
-        log_error_en (s, "error in pthread_setschedparam");
         do_cleanup (tdata);
       }
+
     return s;
 }
 
+/* Helper function to start serving metrics scrapes */
 static int
-create_picam_thread (struct thread_data *tdata)
+create_metrics_thread (struct thread_data *tdata)
 {
     ssize_t s;
 
-    s = pthread_create (&tdata->picam_t, &tdata->attr, &thread_picam_start,
+    s = pthread_create (&tdata->metrics_t, &tdata->attr,
+                        &thread_metrics_start, tdata);
+    if (s != 0)
+      {
+        log_error_en (s, "error creating metrics thread");
+        do_cleanup (tdata);
+        return s;
+      }
+    rt_apply (tdata->metrics_t, RT_THREAD_METRICS);
+
+    return 0;
+}
+
+/* Helper function to start advancing virtual time, in both thread and
+   reactor mode */
+static int
+create_clock_thread (struct thread_data *tdata)
+{
+    ssize_t s;
+
+    if (!clock_is_virtual ())
+        return 0;
+
+    s = pthread_create (&tdata->vclock_t, &tdata->attr, &thread_clock_start,
                         tdata);
     if (s != 0)
       {
-        log_error_en (s, "error creating picam thread");
+        log_error_en (s, "error creating clock thread");
         do_cleanup (tdata);
       }
-    return s;   
+    return s;
 }
 
-/* Helper function to setup wiringPi and register an interrupt handler */
+/* Helper function to start measuring scheduling jitter of the motion path
+   with the real-time profile */
 static int
-setup_wiringPi (struct thread_data *tdata)
+create_probe_thread (struct thread_data *tdata)
 {
     ssize_t s;
 
-    s = pthread_mutex_init (&tdata->wiring_mutex, NULL);
+    if (!use_probe)
+        return 0;
+
+    s = pthread_create (&tdata->probe_t, &tdata->attr, &thread_rt_probe_start,
+                        tdata);
     if (s != 0)
       {
-        log_error_en (s, "error in pthread_mutex_init");
+        log_error_en (s, "error creating probe thread");
         do_cleanup (tdata);
-        return s;   
+        return s;
       }
+    rt_apply (tdata->probe_t, RT_THREAD_PROBE);
 
-    /* Initialize wiringPi with default pin numbering scheme */
-    s = wiringPiSetup ();
-    if (s < 0)
+    return 0;
+}
+
+/* Helper function to start sampling thermal zones in the background */
+static int
+create_sampler_thread (struct thread_data *tdata)
+{
+    ssize_t s;
+
+    s = pthread_create (&tdata->sampler_t, &tdata->attr,
+                        &thread_sampler_start, tdata);
+    if (s != 0)
       {
-        log_error ("error in wiringPiSetup");
+        log_error_en (s, "error creating sampler thread");
         do_cleanup (tdata);
         return s;
       }
+    rt_apply (tdata->sampler_t, RT_THREAD_SAMPLER);
 
-    /* Register a interrupt handler on the pin numbered as PIR_PIN */
-    tdata->pir_pin = PIR_PIN;
-    s = wiringPiISR (tdata->pir_pin, INT_EDGE_BOTH, &on_motion_detect, tdata);
-    if (s < 0)
+    return 0;
+}
+
+/* The zones thread polls the inputs of backends that report edges through
+   an fd, unless the reactor does */
+static int
+create_gpio_thread (struct thread_data *tdata)
+{
+    ssize_t s;
+
+    s = pthread_create (&tdata->gpio_t, &tdata->attr, &thread_zones_start,
+                        tdata);
+    if (s != 0)
       {
-        log_error ("error in wiringPiISR");
+        log_error_en (s, "error creating gpio thread");
         do_cleanup (tdata);
+        return s;
       }
+    rt_apply (tdata->gpio_t, RT_THREAD_GPIO);
 
-    return s;
+    return 0;
 }
 
 int
@@ -274,17 +494,58 @@ main (void)
 
     handle_signals ();
 
-    s = setup_wiringPi (&tdata);
-    if (s < 0)
+    s = log_init ();
+    if (s != 0)
+        log_error ("logging directly, without writer thread");
+
+    /* Everything below reads the time through the clock backend */
+    s = clock_init (&CORE_CLOCK);
+    if (s != 0)
+      {
+        log_error ("error initializing clock");
+        do_cleanup (&tdata);
+        return 1;
+      }
+
+    /* Before anything big is allocated so all of it gets locked */
+#ifdef RT_PROFILE
+    s = rt_init (rt_threads, true);
+#else
+    s = rt_init (rt_threads, false);
+#endif
+    if (s != 0)
+        log_error ("running without the real-time profile");
+
+    trace_init (&tdata.trace);
+
+    /* Before gpio, a wiringPi interrupt may queue a start right away */
+    record_init (&tdata.recording);
+    cmdq_init (&tdata.picam_cmds);
+
+    /* Edges are fed to the hold time controller as soon as gpio is set up */
+    holdtime_init (&tdata.holdtime, HOLDTIME_MIN_MS, HOLDTIME_MAX_MS,
+                   HOLDTIME_DEFAULT_MS, HOLDTIME_RESTART_COST_MS);
+
+    /* Optional like the history, and before gpio for the same reason */
+    tdata.status = status_open (STATUS_SHM_NAME);
+
+    /* The first edge looks the cameras up to start them */
+    cameras_open (&tdata.cameras, picam_cameras,
+                  sizeof (picam_cameras) / sizeof (picam_cameras[0]));
+
+    s = setup_gpio (&tdata);
+    if (s != 0)
       {
         return 1;
       }
 
-    /* Initialize timer used for timeout on video recording */
-    tdata.timerfd = timerfd_create (CLOCK_REALTIME, 0);
+    /* Initialize timer used for timeout on video recording. The timer may be
+       re-armed by the interrupt handler between poll and read, so the clock
+       backend never lets the read block. It runs on the monotonic clock so
+       a time step by NTP can't stretch or cut short a recording */
+    tdata.timerfd = clock_timer_create ();
     if (tdata.timerfd  < 0)
       {
-        log_error ("error in timerfd_create");
         do_cleanup (&tdata);
         return 1;
       }
@@ -304,13 +565,69 @@ main (void)
         return 1;
       }
 
-    s = create_timer_thread (&tdata);
+    sensors_init ();
+
+    /* Sensor history is optional, without it history queries are ignored */
+    tdata.history = history_create ();
+
+    /* Likewise nothing is persisted if the time series file can't be opened,
+       appends to it are then no-ops */
+    s = tsdb_open (&tdata.tsdb, TSDB_PATH);
+    if (s != 0)
+        log_error ("readings and events will not be persisted");
+
+    s = sampler_init (&tdata.sampler, SAMPLER_PERIOD_MS);
+    if (s != 0)
+        log_error ("cpu temperature will not be updated");
+
+    /* Metrics are still counted without the socket, just not served */
+    tdata.metrics_fd = metrics_listen (METRICS_SOCKET_PATH);
+
+    if (!use_reactor)
+      {
+        s = create_timer_thread (&tdata);
+        if (s != 0)
+          {
+            return 1;
+          }
+
+        s = create_picam_thread (&tdata);
+        if (s != 0)
+          {
+            return 1;
+          }
+
+        s = create_gpio_thread (&tdata);
+        if (s != 0)
+          {
+            return 1;
+          }
+      }
+
+    /* Also in reactor mode, the status page is refreshed from there */
+    s = create_sampler_thread (&tdata);
+    if (s != 0)
+      {
+        return 1;
+      }
+
+    /* Likewise scrapes are rendered off the reactor thread */
+    if (tdata.metrics_fd >= 0)
+      {
+        s = create_metrics_thread (&tdata);
+        if (s != 0)
+          {
+            return 1;
+          }
+      }
+
+    s = create_clock_thread (&tdata);
     if (s != 0)
       {
         return 1;
       }
 
-    s = create_picam_thread (&tdata);
+    s = create_probe_thread (&tdata);
     if (s != 0)
       {
         return 1;
@@ -325,18 +642,37 @@ main (void)
         return 1;
       }
 
-    while (1)
+    /* Only now, threads created by main would inherit its scheduling */
+    rt_apply (pthread_self (), RT_THREAD_MAIN);
+
+    if (use_reactor)
+      {
+        /* The main thread owns timer, picam and signals until shutdown */
+        s = run_reactor (&tdata);
+        if (s != 0)
+            log_error ("reactor exited with error");
+      }
+    else
       {
-        sem_wait (&keep_going);
-        if (raise_fake_isr)
+        while (1)
           {
-            atomic_store (&tdata.fake_isr, true);
-            on_motion_detect ((void *) &tdata);
-            raise_fake_isr = 0;         
-            continue;       
-          }
-        break;
-      } 
+            sem_wait (&keep_going);
+            if (raise_fake_isr)
+              {
+                atomic_store (&tdata.fake_isr, true);
+                on_motion_detect ((void *) &tdata);
+                raise_fake_isr = 0;         
+                continue;       
+              }
+            if (raise_snapshot)
+              {
+                request_snapshot (&tdata);
+                raise_snapshot = 0;
+                continue;
+              }
+            break;
+          } 
+      }
 
     /* **************************************************************** */
     /*                                                                  */
@@ -359,33 +695,88 @@ main (void)
     if (s < 0)
       {
         log_error ("error in clock_gettime");
-        s = pthread_cancel (tdata.timer_t);
-        if (s != 0)
-            log_error ("error in pthread_cancel");
-        s = pthread_cancel (tdata.picam_t);
+        if (!use_reactor)
+          {
+            s = pthread_cancel (tdata.timer_t);
+            if (s != 0)
+                log_error ("error in pthread_cancel");
+            s = pthread_cancel (tdata.picam_t);
+            if (s != 0)
+                log_error ("error in pthread_cancel");
+            s = pthread_cancel (tdata.gpio_t);
+            if (s != 0)
+                log_error ("error in pthread_cancel");
+          }
+        s = pthread_cancel (tdata.sampler_t);
         if (s != 0)
             log_error ("error in pthread_cancel");
+        if (tdata.metrics_fd >= 0)
+          {
+            s = pthread_cancel (tdata.metrics_t);
+            if (s != 0)
+                log_error ("error in pthread_cancel");
+          }
+        if (clock_is_virtual ())
+          {
+            s = pthread_cancel (tdata.vclock_t);
+            if (s != 0)
+                log_error ("error in pthread_cancel");
+          }
+        if (use_probe)
+          {
+            s = pthread_cancel (tdata.probe_t);
+            if (s != 0)
+                log_error ("error in pthread_cancel");
+          }
       }         
     else
       {
         ts.tv_sec += 5;
-        join_or_cancel_thread (tdata.timer_t, &ts);
-        join_or_cancel_thread (tdata.picam_t, &ts);
+        if (!use_reactor)
+          {
+            join_or_cancel_thread (tdata.timer_t, &ts);
+            join_or_cancel_thread (tdata.picam_t, &ts);
+            join_or_cancel_thread (tdata.gpio_t, &ts);
+          }
+        join_or_cancel_thread (tdata.sampler_t, &ts);
+        if (tdata.metrics_fd >= 0)
+            join_or_cancel_thread (tdata.metrics_t, &ts);
+        if (clock_is_virtual ())
+            join_or_cancel_thread (tdata.vclock_t, &ts);
+        if (use_probe)
+            join_or_cancel_thread (tdata.probe_t, &ts);
       }
 
+    zones_close (&tdata.zones);
+
+    metrics_close (tdata.metrics_fd, METRICS_SOCKET_PATH);
+
     fg_events_server_shutdown (&tdata.etdata);
 
-    s = pthread_mutex_destroy (&tdata.sensor_mutex);
-    if (s != 0)
-        log_error_en (s, "error in pthread_mutex_destroy");
+    history_destroy (tdata.history);
 
-    s = pthread_mutex_destroy (&tdata.record_mutex);
-    if (s != 0)
-        log_error_en (s, "error in pthread_mutex_destroy");
+    status_close (tdata.status);
 
-    s = pthread_mutex_destroy (&tdata.wiring_mutex);
-    if (s != 0)
-        log_error_en (s, "error in pthread_mutex_destroy");
+    tsdb_close (&tdata.tsdb);
+
+    sampler_close (&tdata.sampler);
+
+    _log_debug ("recordings merged by grace window: %" PRIuFAST64
+                ", restarted within it: %" PRIuFAST64 "\n",
+                atomic_load (&tdata.merged_recordings),
+                atomic_load (&tdata.split_recordings));
+
+    cameras_close (&tdata.cameras);
+
+    trace_dump (&tdata.trace);
+
+    record_dump (&tdata.recording);
+
+    rt_dump ();
+
+    holdtime_destroy (&tdata.holdtime);
+
+    sensors_store_destroy (&tdata.sensors);
 
     s = close (tdata.record_eventfd);
     if (s < 0)
@@ -403,44 +794,198 @@ main (void)
     if (s != 0)
         log_error_en (s, "error in pthread_attr_destroy");
 
+    log_shutdown ();
+
     return 0;
 }
 
 static void
-do_cleanup (struct thread_data *tdata)
+do_cleanup (__attribute__ ((unused)) struct thread_data *tdata)
+{
+    /* Flush queued messages, anything logged after this is written
+       directly */
+    log_shutdown ();
+}
+
+/* Used by the reactor callbacks below to reach shared state */
+struct reactor_ctx {
+    int                sigfd;
+    struct reactor     r;
+    struct picam_data  pdata;
+    struct thread_data *tdata;
+};
+
+static void
+on_timerfd_ready (void *arg,
+                  __attribute__ ((unused)) uint32_t events)
+{
+    struct reactor_ctx *ctx = arg;
+
+    timeout_handle_expiration (ctx->tdata);
+}
+
+static void
+on_inotify_ready (void *arg,
+                  __attribute__ ((unused)) uint32_t events)
+{
+    struct reactor_ctx *ctx = arg;
+
+    picam_handle_inotify (&ctx->pdata);
+}
+
+static void
+on_record_eventfd_ready (void *arg,
+                         __attribute__ ((unused)) uint32_t events)
+{
+    struct reactor_ctx *ctx = arg;
+
+    picam_handle_record_eventfd (&ctx->pdata);
+}
+
+static void
+on_ack_timer_ready (void *arg,
+                    __attribute__ ((unused)) uint32_t events)
+{
+    struct reactor_ctx *ctx = arg;
+
+    picam_handle_ack_timer (&ctx->pdata);
+}
+
+/* Registered once per zone with the zone's gpio_dev as arg */
+static void
+on_gpio_ready (void *arg,
+               __attribute__ ((unused)) uint32_t events)
+{
+    gpio_dispatch (arg);
+}
+
+static void
+on_gpio_pulse_ready (void *arg,
+                     __attribute__ ((unused)) uint32_t events)
+{
+    gpio_handle_pulse (arg);
+}
+
+static void
+on_timerpipe_ready (void *arg,
+                    __attribute__ ((unused)) uint32_t events)
+{
+    struct reactor_ctx *ctx = arg;
+
+    reactor_stop (&ctx->r);
+}
+
+/* Drain all pending signals, SIGTSTP raises a fake interrupt, SIGUSR1 asks
+   for a snapshot and anything else begins the shutdown sequence */
+static void
+on_signalfd_ready (void *arg,
+                   __attribute__ ((unused)) uint32_t events)
+{
+    ssize_t s;
+    struct reactor_ctx *ctx = arg;
+    struct signalfd_siginfo si[4];
+
+    while ((s = read (ctx->sigfd, si, sizeof (si))) > 0)
+      {
+        for (size_t i = 0; i < s / sizeof (struct signalfd_siginfo); i++)
+          {
+            if (si[i].ssi_signo == SIGTSTP)
+              {
+                atomic_store (&ctx->tdata->fake_isr, true);
+                on_motion_detect ((void *) ctx->tdata);
+              }
+            else if (si[i].ssi_signo == SIGUSR1)
+                request_snapshot (ctx->tdata);
+            else
+                reactor_stop (&ctx->r);
+          }
+      }
+    if (s < 0 && errno != EAGAIN)
+        log_error ("read from signalfd failed");
+}
+
+/* Run timer, picam and signal handling in the calling thread using a single
+   epoll loop. Returns when a termination signal is received */
+static int
+run_reactor (struct thread_data *tdata)
 {
+    ssize_t s;
+    sigset_t mask;
+    struct reactor_ctx ctx;
+
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.tdata = tdata;
+
+    s = reactor_init (&ctx.r);
+    if (s != 0)
+        return 1;
+
+    /* The signals were blocked in handle_signals */
+    sigemptyset (&mask);
+    for (size_t i = 0; i < sizeof (handled_signals) / sizeof (int); i++)
+        sigaddset (&mask, handled_signals[i]);
+    ctx.sigfd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (ctx.sigfd < 0)
+      {
+        log_error ("error in signalfd");
+        reactor_destroy (&ctx.r);
+        return 1;
+      }
 
+    s = picam_state_init (&ctx.pdata, tdata);
+    if (s != 0)
+      {
+        log_error ("error initializing picam state");
+        picam_state_cleanup (&ctx.pdata);
+        close (ctx.sigfd);
+        reactor_destroy (&ctx.r);
+        return 1;
+      }
+
+    s = reactor_add (&ctx.r, ctx.sigfd, &on_signalfd_ready, &ctx);
+    s |= reactor_add (&ctx.r, tdata->timerpipe[0], &on_timerpipe_ready, &ctx);
+    s |= reactor_add (&ctx.r, tdata->timerfd, &on_timerfd_ready, &ctx);
+    s |= reactor_add (&ctx.r, tdata->record_eventfd, &on_record_eventfd_ready,
+                      &ctx);
+    if (ctx.pdata.inotify_fd >= 0)
+        s |= reactor_add (&ctx.r, ctx.pdata.inotify_fd, &on_inotify_ready,
+                          &ctx);
+    if (ctx.pdata.ack_timerfd >= 0)
+        s |= reactor_add (&ctx.r, ctx.pdata.ack_timerfd, &on_ack_timer_ready,
+                          &ctx);
+    for (int i = 0; i < tdata->zones.n; i++)
+      {
+        struct gpio_dev *dev = &tdata->zones.zone[i].dev;
+
+        if (dev->fd >= 0)
+            s |= reactor_add (&ctx.r, dev->fd, &on_gpio_ready, dev);
+        if (dev->pulse_fd >= 0)
+            s |= reactor_add (&ctx.r, dev->pulse_fd, &on_gpio_pulse_ready,
+                              dev);
+      }
+
+    if (s == 0)
+        s = reactor_run (&ctx.r);
+
+    picam_state_cleanup (&ctx.pdata);
+    close (ctx.sigfd);
+    reactor_destroy (&ctx.r);
+
+    return s;
 }
 
+/* Copy the CPU temperature cached by the sampler into sd, does no
+   syscalls */
 void
-read_cpu_temp (struct thread_data *tdata)
+read_cpu_temp (struct thread_data *tdata, struct SensorData *sd)
 {
-  int cpu_temp, fd, rc;
-  char buf[8];
-
-  fd = open ("/sys/class/thermal/thermal_zone0/temp", O_RDONLY);
-  if(fd >= 0)
-    {
-      if((rc = read(fd, buf, sizeof(buf))) > 0)
-        {
-          char *end;
-
-          strtok (buf, " \n");
-          cpu_temp = (int) strtol (buf, &end, 10);
-          if (!(*end || errno == ERANGE))
-            {
-              cpu_temp = (cpu_temp + 50) / 100;
-              tdata->sensor_data.cputemp = cpu_temp;
-            }
-        }
-      else if(rc < 0)
-        {
-          log_error ("error in read");
-        }
-      close (fd);
-    }
-  else
-    {
-      log_error ("error in open");
-    }
-}
\ No newline at end of file
+    struct sampler_snapshot snap;
+    const struct sensor_type *t = sensors_lookup (CPUTEMP);
+
+    sampler_read (&tdata->sampler, &snap);
+    if (snap.nzones > 0)
+      {
+        sd->cputemp = snap.zone_temp[0];
+        sd->present |= 1U << sensor_index (t);
+      }
+}
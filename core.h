@@ -26,7 +26,7 @@
 
 #include "common.h"
 
-/* Function to read CPU temperature from system */
-extern void read_cpu_temp (struct thread_data *);
+/* Function to copy the last sampled CPU temperature to a SensorData */
+extern void read_cpu_temp (struct thread_data *, struct SensorData *);
 
 #endif /* _CORE_H_ */
\ No newline at end of file
@@ -0,0 +1,318 @@
+/*
+ *  gpio.c
+ *    Dispatch edge events from the selected GPIO backend
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gpio.h"
+#include "metrics.h"
+#include "rt.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+void
+gpio_set_filter (struct gpio_dev *dev, uint64_t min_pulse_ns,
+                 uint32_t max_edges, uint64_t window_ns)
+{
+    dev->filter.min_pulse_ns = min_pulse_ns;
+    dev->filter.max_edges = max_edges;
+    dev->filter.window_ns = window_ns;
+}
+
+int
+gpio_open (struct gpio_dev *dev, const struct gpio_backend *backend, int pin,
+           gpio_edge_cb cb, void *arg)
+{
+    ssize_t s;
+    pthread_mutexattr_t attr;
+    struct gpio_filter filter = dev->filter;
+
+    /* Backends may deliver edges as soon as they are opened, so the filter
+       has to be set up before */
+    memset (dev, 0, sizeof (*dev));
+    gpio_set_filter (dev, filter.min_pulse_ns, filter.max_edges,
+                     filter.window_ns);
+    dev->backend = backend;
+    dev->pin = pin;
+    dev->fd = -1;
+    dev->pulse_fd = -1;
+    dev->cb = cb;
+    dev->cb_arg = arg;
+    atomic_init (&dev->level, 0);
+
+    /* A backend thread of higher priority may wait for the pulse timer */
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_setprotocol (&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init (&dev->lock, &attr);
+    pthread_mutexattr_destroy (&attr);
+
+    if (dev->filter.min_pulse_ns > 0)
+      {
+        dev->pulse_fd = clock_timer_create ();
+        if (dev->pulse_fd < 0)
+            log_error ("could not create pulse timer, edges are held until "
+                       "the next one");
+      }
+
+    s = backend->open (dev, pin);
+    if (s != 0)
+      {
+        log_error ("could not open gpio input");
+        if (dev->pulse_fd >= 0)
+            clock_timer_close (dev->pulse_fd);
+        dev->pulse_fd = -1;
+        pthread_mutex_destroy (&dev->lock);
+        dev->backend = NULL;
+        return s;
+      }
+
+    _log_debug ("using %s gpio backend on pin %d\n", backend->name, pin);
+
+    return 0;
+}
+
+int
+gpio_dispatch (struct gpio_dev *dev)
+{
+    if (dev->backend->dispatch == NULL)
+        return 0;
+
+    return dev->backend->dispatch (dev);
+}
+
+void
+gpio_init_level (struct gpio_dev *dev, int level)
+{
+    dev->filter.level = level;
+    atomic_store_explicit (&dev->level, level, memory_order_release);
+}
+
+int
+gpio_read_level (struct gpio_dev *dev)
+{
+    return atomic_load_explicit (&dev->level, memory_order_acquire);
+}
+
+void
+gpio_close (struct gpio_dev *dev)
+{
+    if (dev->backend == NULL)
+        return;
+
+    _log_debug ("pin %d: %" PRIuFAST64 " edges accepted, %" PRIuFAST64
+                " suppressed, %" PRIuFAST64 " glitches\n", dev->pin,
+                atomic_load (&dev->filter.accepted),
+                atomic_load (&dev->filter.suppressed),
+                atomic_load (&dev->filter.glitches));
+    if (dev->backend->close)
+        dev->backend->close (dev);
+    dev->backend = NULL;
+
+    if (dev->pulse_fd >= 0)
+        clock_timer_close (dev->pulse_fd);
+    dev->pulse_fd = -1;
+    pthread_mutex_destroy (&dev->lock);
+}
+
+/* Returns true if edge passes the filter, only called with dev->lock
+   held */
+static bool
+filter_edge (struct gpio_filter *f, const struct gpio_edge *edge)
+{
+    uint64_t ts = edge->timestamp_ns;
+
+    /* The other half of a pulse that was suppressed, or an edge the
+       backend reported twice */
+    if (edge->level == f->level)
+      {
+        atomic_fetch_add_explicit (&f->suppressed, 1, memory_order_relaxed);
+        return false;
+      }
+
+    /* Only rising edges count against the limit, the falling edge of a
+       pulse that was passed on always follows it */
+    if (f->max_edges > 0 && edge->level)
+      {
+        if (ts - f->window_start_ns >= f->window_ns)
+          {
+            f->window_start_ns = ts;
+            f->window_edges = 0;
+          }
+        if (f->window_edges >= f->max_edges)
+          {
+            atomic_fetch_add_explicit (&f->suppressed, 1,
+                                       memory_order_relaxed);
+            return false;
+          }
+        f->window_edges++;
+      }
+
+    f->level = edge->level;
+    atomic_fetch_add_explicit (&f->accepted, 1, memory_order_relaxed);
+
+    return true;
+}
+
+/* Edges passed on, handed to the callback GPIO_EDGE_BATCH at a time */
+struct gpio_batch {
+    size_t           n;
+    struct gpio_edge edges[GPIO_EDGE_BATCH];
+};
+
+static void
+batch_flush (struct gpio_dev *dev, struct gpio_batch *b)
+{
+    if (b->n > 0)
+        dev->cb (dev->cb_arg, b->edges, b->n);
+    b->n = 0;
+}
+
+static void
+pass_on (struct gpio_dev *dev, struct gpio_batch *b,
+         const struct gpio_edge *edge)
+{
+    if (!filter_edge (&dev->filter, edge))
+        return;
+
+    b->edges[b->n++] = *edge;
+    if (b->n == GPIO_EDGE_BATCH)
+        batch_flush (dev, b);
+}
+
+/* Hold edge back until it has lasted the minimum pulse */
+static void
+hold (struct gpio_dev *dev, const struct gpio_edge *edge)
+{
+    struct gpio_filter *f = &dev->filter;
+
+    f->held = *edge;
+    f->pending = true;
+    if (dev->pulse_fd >= 0 &&
+        clock_timer_arm (dev->pulse_fd,
+                         edge->timestamp_ns + f->min_pulse_ns, 0) < 0)
+        log_error ("could not arm pulse timer");
+}
+
+/* Run edge through the filter, dev->lock held */
+static void
+filter_one (struct gpio_dev *dev, struct gpio_batch *b,
+            const struct gpio_edge *edge)
+{
+    struct gpio_filter *f = &dev->filter;
+
+    if (f->pending)
+      {
+        /* The backend reported the held edge twice */
+        if (edge->level == f->held.level)
+          {
+            atomic_fetch_add_explicit (&f->suppressed, 1,
+                                       memory_order_relaxed);
+            return;
+          }
+
+        f->pending = false;
+        if (edge->timestamp_ns - f->held.timestamp_ns < f->min_pulse_ns)
+          {
+            /* A short pulse is dropped whole, the timer finds nothing
+               held when it fires */
+            atomic_fetch_add_explicit (&f->glitches, 2,
+                                       memory_order_relaxed);
+            return;
+          }
+        pass_on (dev, b, &f->held);
+      }
+
+    if (f->min_pulse_ns > 0 && edge->level != f->level)
+        hold (dev, edge);
+    else
+        pass_on (dev, b, edge);
+}
+
+/* Publish the level after the last edge, then hand the edges that pass the
+   filter to the motion handler */
+void
+gpio_deliver (struct gpio_dev *dev, const struct gpio_edge *edges, size_t n)
+{
+    uint64_t now;
+    struct gpio_batch batch = { .n = 0 };
+
+    if (n == 0)
+        return;
+
+    atomic_store_explicit (&dev->level, edges[n - 1].level,
+                           memory_order_release);
+    metrics_add (METRIC_ISR, n);
+
+    /* How long edges waited for this thread to run */
+    now = gpio_now_ns ();
+    for (size_t i = 0; i < n; i++)
+        rt_jitter_record (RT_JITTER_DISPATCH,
+                          now > edges[i].timestamp_ns ?
+                          now - edges[i].timestamp_ns : 0);
+
+    pthread_mutex_lock (&dev->lock);
+    for (size_t i = 0; i < n; i++)
+        filter_one (dev, &batch, &edges[i]);
+    batch_flush (dev, &batch);
+    pthread_mutex_unlock (&dev->lock);
+}
+
+int
+gpio_handle_pulse (struct gpio_dev *dev)
+{
+    ssize_t s;
+    uint64_t u;
+    struct gpio_filter *f = &dev->filter;
+    struct gpio_batch batch = { .n = 0 };
+
+    s = read (dev->pulse_fd, &u, sizeof (uint64_t));
+    if (s < 0)
+      {
+        if (errno != EAGAIN)
+            log_error ("read failed");
+        return 0;
+      }
+
+    /* The edge ending the pulse may have come since the timer fired */
+    pthread_mutex_lock (&dev->lock);
+    if (f->pending &&
+        gpio_now_ns () >= f->held.timestamp_ns + f->min_pulse_ns)
+      {
+        f->pending = false;
+        pass_on (dev, &batch, &f->held);
+        batch_flush (dev, &batch);
+      }
+    pthread_mutex_unlock (&dev->lock);
+
+    return 0;
+}
+
+/* Timestamp for backends that cannot get one from the kernel */
+uint64_t
+gpio_now_ns (void)
+{
+    return clock_now_ns ();
+}
@@ -0,0 +1,141 @@
+/*
+ *  gpio.h
+ *    Backend independent interface for edge events on GPIO inputs
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _FG_GPIO_H_
+#define _FG_GPIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Maximum number of edges delivered to the callback in one batch */
+#define GPIO_EDGE_BATCH 16
+
+/* A single edge as reported by a backend */
+struct gpio_edge {
+    int      level;        /* Level after the edge, 1 means HIGH */
+    uint64_t timestamp_ns; /* Time the edge happened, see gpio_now_ns */
+};
+
+/* Called with a batch of edges in the order they happened */
+typedef void (*gpio_edge_cb) (void *, const struct gpio_edge *, size_t);
+
+struct gpio_dev;
+
+/* Filter applied to edges before they reach the callback. An edge that
+   changes the level is held back until the line has stayed at the new
+   level for min_pulse_ns, which the next edge or the pulse timer tells. A
+   pulse shorter than that is a glitch and both of its edges are dropped,
+   however the backend batches them. Of the rest at most max_edges rising
+   edges are passed on per window_ns, the others are suppressed. Zero
+   disables either check. An edge back to the level before a dropped one is
+   dropped with it, any other edge that changes the level passed on is
+   never dropped, so the callback always ends up seeing the level of the
+   line. The level returned by gpio_read_level always follows every edge */
+struct gpio_filter {
+    uint64_t             min_pulse_ns;
+    uint32_t             max_edges;
+    uint64_t             window_ns;
+    int                  level;        /* After the last edge passed on */
+    bool                 pending;      /* held is waiting out the minimum */
+    struct gpio_edge     held;
+    uint64_t             window_start_ns;
+    uint32_t             window_edges;
+    atomic_uint_fast64_t accepted;
+    atomic_uint_fast64_t suppressed;
+    atomic_uint_fast64_t glitches;
+};
+
+/* Operations implemented by each backend */
+struct gpio_backend {
+    const char *name;
+
+    /* Request the input numbered pin, returns non-zero on failure */
+    int  (*open) (struct gpio_dev *, int);
+
+    /* Read and deliver pending edges when dev->fd is readable */
+    int  (*dispatch) (struct gpio_dev *);
+
+    /* Release everything acquired in open */
+    void (*close) (struct gpio_dev *);
+};
+
+struct gpio_dev {
+    const struct gpio_backend *backend;
+    int                       pin;
+    int                       fd;       /* Readable when edges are
+                                           pending, -1 if the backend has
+                                           its own thread */
+    int                       pulse_fd; /* Clock timer for the held edge,
+                                           -1 without a minimum pulse */
+    atomic_int                level;    /* Level after the last edge */
+    gpio_edge_cb              cb;
+    void                      *cb_arg;
+    void                      *priv;    /* Backend specific state */
+    pthread_mutex_t           lock;     /* Filter and callback, taken by
+                                           the backend and the pulse
+                                           timer */
+    struct gpio_filter        filter;
+};
+
+/* Linux GPIO character device, edges carry kernel timestamps */
+extern const struct gpio_backend gpio_cdev_backend;
+
+/* Edges read from a file, FIFO or socket, see gpio_sim.c for the format */
+extern const struct gpio_backend gpio_sim_backend;
+
+/* wiringPi interrupt thread, only linked when GPIO_BACKEND is wiringpi */
+extern const struct gpio_backend gpio_wiringpi_backend;
+
+/* Set the edge filter, call before gpio_open which keeps it */
+extern void gpio_set_filter (struct gpio_dev *, uint64_t, uint32_t,
+                             uint64_t);
+
+/* Open pin using backend and deliver edges to cb */
+extern int gpio_open (struct gpio_dev *, const struct gpio_backend *, int,
+                      gpio_edge_cb, void *);
+
+/* Read pending edges, to be called when dev->fd is readable */
+extern int gpio_dispatch (struct gpio_dev *);
+
+/* Pass on the held edge once it has lasted the minimum pulse, to be called
+   when dev->pulse_fd is readable */
+extern int gpio_handle_pulse (struct gpio_dev *);
+
+/* Level after the most recent edge, never touches the hardware */
+extern int gpio_read_level (struct gpio_dev *);
+
+/* Release the input */
+extern void gpio_close (struct gpio_dev *);
+
+/* Helpers used by backends to publish edges. gpio_init_level sets the level
+   read when opening, before any edge is delivered. gpio_now_ns is
+   clock_now_ns, CLOCK_MONOTONIC unless the clock is virtual */
+extern void gpio_deliver (struct gpio_dev *, const struct gpio_edge *,
+                          size_t);
+extern void gpio_init_level (struct gpio_dev *, int);
+extern uint64_t gpio_now_ns (void);
+
+#endif /* _FG_GPIO_H_ */
@@ -0,0 +1,127 @@
+/*
+ *  gpio_cdev.c
+ *    GPIO backend using the Linux GPIO character device (uAPI v2)
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "gpio.h"
+#include "common.h"
+#include "log.h"
+
+/* Request pin as an input reporting both edges. The kernel timestamps each
+   edge in its interrupt handler and queues it on the line fd */
+static int
+cdev_open (struct gpio_dev *dev, int pin)
+{
+    ssize_t s;
+    int chipfd;
+    struct gpio_v2_line_request req;
+    struct gpio_v2_line_values values;
+
+    chipfd = open (GPIO_CHIP_PATH, O_RDONLY | O_CLOEXEC);
+    if (chipfd < 0)
+      {
+        log_error ("could not open gpio chip");
+        return 1;
+      }
+
+    memset (&req, 0, sizeof (req));
+    req.offsets[0] = pin;
+    req.num_lines = 1;
+    req.event_buffer_size = GPIO_EDGE_BATCH * 4;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+                       GPIO_V2_LINE_FLAG_EDGE_RISING |
+                       GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    strncpy (req.consumer, __progname, sizeof (req.consumer) - 1);
+
+    s = ioctl (chipfd, GPIO_V2_GET_LINE_IOCTL, &req);
+    close (chipfd);
+    if (s < 0)
+      {
+        log_error ("error in GPIO_V2_GET_LINE_IOCTL");
+        return 1;
+      }
+    dev->fd = req.fd;
+
+    s = fcntl (dev->fd, F_SETFL, fcntl (dev->fd, F_GETFL) | O_NONBLOCK);
+    if (s < 0)
+        log_error ("error in fcntl");
+
+    /* Read the initial level once, from here on it follows the edges */
+    memset (&values, 0, sizeof (values));
+    values.mask = 1;
+    s = ioctl (dev->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values);
+    if (s < 0)
+        log_error ("error in GPIO_V2_LINE_GET_VALUES_IOCTL");
+    else
+        gpio_init_level (dev, (int) (values.bits & 1));
+
+    return 0;
+}
+
+/* Drain queued edge events, each read returns as many as fit the buffer */
+static int
+cdev_dispatch (struct gpio_dev *dev)
+{
+    ssize_t nbytes;
+    size_t n;
+    struct gpio_v2_line_event events[GPIO_EDGE_BATCH];
+    struct gpio_edge edges[GPIO_EDGE_BATCH];
+
+    while ((nbytes = read (dev->fd, events, sizeof (events))) > 0)
+      {
+        n = nbytes / sizeof (struct gpio_v2_line_event);
+        for (size_t i = 0; i < n; i++)
+          {
+            edges[i].level = events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+            edges[i].timestamp_ns = events[i].timestamp_ns;
+          }
+        gpio_deliver (dev, edges, n);
+      }
+
+    if (nbytes < 0 && errno != EAGAIN)
+      {
+        log_error ("read from gpio line failed");
+        return 1;
+      }
+
+    return 0;
+}
+
+static void
+cdev_close (struct gpio_dev *dev)
+{
+    if (dev->fd >= 0)
+        close (dev->fd);
+    dev->fd = -1;
+}
+
+const struct gpio_backend gpio_cdev_backend = {
+    .name     = "cdev",
+    .open     = cdev_open,
+    .dispatch = cdev_dispatch,
+    .close    = cdev_close,
+};
@@ -0,0 +1,426 @@
+/*
+ *  gpio_sim.c
+ *    Simulated GPIO backend reading edges from a file, FIFO or socket
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+/*
+ * The source named by GPIO_SIM_SOURCE contains one edge per line:
+ *
+ *   <level>               edge happens now
+ *   <delay_ms> <level>    edge happens delay_ms after the previous one
+ *   @<ns> <level>         edge happens at time ns of gpio_now_ns
+ *
+ * followed by an optional z<pin> to put the edge on another pin than 0,
+ * e.g. "250 1 z2". Pin 0 reads the source and hands edges of the other
+ * pins to whichever gpio_dev opened them, so every PIR zone can be fed
+ * from one trace.
+ *
+ * Blank lines and lines starting with '#' are ignored. A regular file is
+ * replayed at the pace given by the delays using a clock timer, so with
+ * the virtual clock it replays as fast as core keeps up. A FIFO or unix
+ * socket is treated as a live stream and edges are delivered as they
+ * arrive, delays are ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "gpio.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+/* Longest line accepted from the source */
+#define SIM_LINE_MAX 64
+
+/* Pins a source can address with z<pin> */
+#define SIM_MAX_PINS 8
+
+struct sim_data {
+    bool             paced;
+    bool             have_pending;
+    int              src_fd;
+    FILE             *fp;
+    size_t           len;
+    uint64_t         last_ns;
+    int              pending_pin;
+    struct gpio_edge pending;
+    char             buf[SIM_LINE_MAX * GPIO_EDGE_BATCH];
+};
+
+/* Edges of one pin waiting to be delivered together */
+struct sim_batch {
+    int              pin;
+    size_t           n;
+    struct gpio_edge edges[GPIO_EDGE_BATCH];
+};
+
+/* Open pins, only touched by sim_open, sim_close and the thread
+   dispatching pin 0 */
+static struct gpio_dev *sim_pins[SIM_MAX_PINS];
+
+static void sim_close (struct gpio_dev *);
+
+static void
+batch_flush (struct sim_batch *b)
+{
+    if (b->n == 0)
+        return;
+
+    if (sim_pins[b->pin] != NULL)
+        gpio_deliver (sim_pins[b->pin], b->edges, b->n);
+    else
+        _log_debug ("gpio_sim: dropping %zu edges for pin %d\n", b->n,
+                    b->pin);
+    b->n = 0;
+}
+
+static void
+batch_add (struct sim_batch *b, int pin, const struct gpio_edge *edge)
+{
+    if (b->n > 0 && (pin != b->pin || b->n == GPIO_EDGE_BATCH))
+        batch_flush (b);
+    b->pin = pin;
+    b->edges[b->n++] = *edge;
+}
+
+/* Parse one line, returns 0 if an edge was parsed and 1 if it is skipped.
+   A negative delay means the timestamp is absolute */
+static int
+parse_line (const char *line, int *level, int64_t *delay_ms, uint64_t *ts,
+            int *pin)
+{
+    long a, b;
+    unsigned long long abs_ns;
+    const char *zone;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (*line == '\0' || *line == '\n' || *line == '#')
+        return 1;
+
+    *ts = 0;
+    *delay_ms = 0;
+    if (sscanf (line, "@%llu %ld", &abs_ns, &b) == 2)
+      {
+        *ts = abs_ns;
+        *delay_ms = -1;
+        *level = b != 0;
+      }
+    else if (sscanf (line, "%ld %ld", &a, &b) == 2)
+      {
+        *delay_ms = a;
+        *level = b != 0;
+      }
+    else if (sscanf (line, "%ld", &a) == 1)
+        *level = a != 0;
+    else
+      {
+        _log_debug ("gpio_sim: ignoring malformed line %s", line);
+        return 1;
+      }
+
+    *pin = 0;
+    zone = strchr (line, 'z');
+    if (zone != NULL && (sscanf (zone, "z%d", pin) != 1 || *pin < 0 ||
+                         *pin >= SIM_MAX_PINS))
+      {
+        _log_debug ("gpio_sim: ignoring edge on bad pin %s", line);
+        return 1;
+      }
+
+    return 0;
+}
+
+/* Connect to a unix socket at path */
+static int
+connect_socket (const char *path)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      {
+        log_error ("error in socket");
+        return -1;
+      }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+    if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+      {
+        log_error ("error in connect");
+        close (fd);
+        return -1;
+      }
+
+    return fd;
+}
+
+/* Read lines from the replay file until an edge is found and arm the timer
+   for it. Returns 1 at end of file */
+static int
+arm_next (struct gpio_dev *dev, struct sim_data *sim)
+{
+    int level, pin;
+    int64_t delay_ms;
+    uint64_t ts;
+    char line[SIM_LINE_MAX];
+
+    while (fgets (line, sizeof (line), sim->fp))
+      {
+        if (parse_line (line, &level, &delay_ms, &ts, &pin) != 0)
+            continue;
+
+        if (delay_ms >= 0)
+            ts = sim->last_ns + delay_ms * 1000000ULL;
+        sim->last_ns = ts;
+        sim->pending_pin = pin;
+        sim->pending.level = level;
+        sim->pending.timestamp_ns = ts;
+        sim->have_pending = true;
+
+        /* A deadline of zero disarms the timer, so never arm at time 0 */
+        if (clock_timer_arm (dev->fd, ts == 0 ? 1 : ts, 0) < 0)
+            return 1;
+        return 0;
+      }
+
+    sim->have_pending = false;
+    _log_debug ("gpio_sim: end of replay file\n");
+
+    return 1;
+}
+
+static int
+sim_open (struct gpio_dev *dev, int pin)
+{
+    struct stat st;
+    struct sim_data *sim;
+
+    if (pin < 0 || pin >= SIM_MAX_PINS || sim_pins[pin] != NULL)
+      {
+        log_error_en (EINVAL, "simulated pin not available");
+        return 1;
+      }
+
+    /* Edges of other pins come from the source pin 0 reads */
+    if (pin != 0)
+      {
+        sim_pins[pin] = dev;
+        return 0;
+      }
+
+    sim = calloc (1, sizeof (struct sim_data));
+    if (sim == NULL)
+      {
+        log_error ("calloc failed");
+        return 1;
+      }
+    dev->priv = sim;
+    sim_pins[0] = dev;
+
+    if (stat (GPIO_SIM_SOURCE, &st) < 0)
+      {
+        log_error ("could not stat simulated gpio source");
+        sim_close (dev);
+        return 1;
+      }
+
+    if (S_ISSOCK (st.st_mode))
+        sim->src_fd = connect_socket (GPIO_SIM_SOURCE);
+    else if (S_ISFIFO (st.st_mode))
+        /* Opening for writing too keeps us from seeing EOF when a writer
+           disconnects */
+        sim->src_fd = open (GPIO_SIM_SOURCE, O_RDWR | O_CLOEXEC);
+    else
+        sim->src_fd = open (GPIO_SIM_SOURCE, O_RDONLY | O_CLOEXEC);
+    if (sim->src_fd < 0)
+      {
+        log_error ("could not open simulated gpio source");
+        sim_close (dev);
+        return 1;
+      }
+
+    sim->paced = S_ISREG (st.st_mode);
+    if (!sim->paced)
+      {
+        fcntl (sim->src_fd, F_SETFL, fcntl (sim->src_fd, F_GETFL) |
+                                     O_NONBLOCK);
+        dev->fd = sim->src_fd;
+        return 0;
+      }
+
+    sim->fp = fdopen (sim->src_fd, "r");
+    if (sim->fp == NULL)
+      {
+        log_error ("error in fdopen");
+        sim_close (dev);
+        return 1;
+      }
+
+    dev->fd = clock_timer_create ();
+    if (dev->fd < 0)
+      {
+        sim_close (dev);
+        return 1;
+      }
+
+    sim->last_ns = gpio_now_ns ();
+    arm_next (dev, sim);
+
+    return 0;
+}
+
+/* Deliver every edge of the replay file that is due */
+static int
+sim_dispatch_paced (struct gpio_dev *dev, struct sim_data *sim)
+{
+    ssize_t s;
+    uint64_t u, now;
+    struct sim_batch batch = { .n = 0 };
+
+    s = read (dev->fd, &u, sizeof (uint64_t));
+    if (s < 0 && errno != EAGAIN)
+        log_error ("read failed");
+
+    now = gpio_now_ns ();
+    while (sim->have_pending && sim->pending.timestamp_ns <= now)
+      {
+        batch_add (&batch, sim->pending_pin, &sim->pending);
+        arm_next (dev, sim);
+      }
+    batch_flush (&batch);
+
+    return 0;
+}
+
+/* Read whatever the stream has and deliver complete lines */
+static int
+sim_dispatch_stream (struct sim_data *sim)
+{
+    ssize_t nbytes;
+    char *line, *nl;
+    int level, pin;
+    int64_t delay_ms;
+    uint64_t ts;
+    struct gpio_edge edge;
+    struct sim_batch batch = { .n = 0 };
+
+    while ((nbytes = read (sim->src_fd, sim->buf + sim->len,
+                           sizeof (sim->buf) - sim->len - 1)) > 0)
+      {
+        sim->len += nbytes;
+        sim->buf[sim->len] = '\0';
+
+        line = sim->buf;
+        while ((nl = strchr (line, '\n')) != NULL)
+          {
+            *nl = '\0';
+            if (parse_line (line, &level, &delay_ms, &ts, &pin) == 0)
+              {
+                edge.level = level;
+                edge.timestamp_ns = delay_ms < 0 ? ts : gpio_now_ns ();
+                batch_add (&batch, pin, &edge);
+              }
+            line = nl + 1;
+          }
+
+        /* Keep the partial line for the next read, drop it if a single
+           line does not fit the buffer */
+        sim->len -= line - sim->buf;
+        if (sim->len == sizeof (sim->buf) - 1)
+            sim->len = 0;
+        memmove (sim->buf, line, sim->len);
+      }
+    batch_flush (&batch);
+
+    if (nbytes == 0)
+      {
+        /* Peer closed the stream. Put a never signalled eventfd in place of
+           the source so pollers stop waking up and the fd stays valid */
+        int quiet = eventfd (0, EFD_CLOEXEC);
+        _log_debug ("gpio_sim: source closed\n");
+        if (quiet >= 0)
+          {
+            dup2 (quiet, sim->src_fd);
+            close (quiet);
+          }
+      }
+    else if (errno != EAGAIN)
+      {
+        log_error ("read from simulated gpio source failed");
+        return 1;
+      }
+
+    return 0;
+}
+
+static int
+sim_dispatch (struct gpio_dev *dev)
+{
+    struct sim_data *sim = dev->priv;
+
+    if (sim->paced)
+        return sim_dispatch_paced (dev, sim);
+
+    return sim_dispatch_stream (sim);
+}
+
+static void
+sim_close (struct gpio_dev *dev)
+{
+    struct sim_data *sim = dev->priv;
+
+    if (dev->pin >= 0 && dev->pin < SIM_MAX_PINS && sim_pins[dev->pin] == dev)
+        sim_pins[dev->pin] = NULL;
+
+    if (sim == NULL)
+        return;
+
+    if (sim->fp)
+        fclose (sim->fp);
+    else if (sim->src_fd > 0)
+        close (sim->src_fd);
+    if (sim->paced && dev->fd >= 0)
+        clock_timer_close (dev->fd);
+    dev->fd = -1;
+
+    free (sim);
+    dev->priv = NULL;
+}
+
+const struct gpio_backend gpio_sim_backend = {
+    .name     = "sim",
+    .open     = sim_open,
+    .dispatch = sim_dispatch,
+    .close    = sim_close,
+};
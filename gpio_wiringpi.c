@@ -0,0 +1,89 @@
+/*
+ *  gpio_wiringpi.c
+ *    GPIO backend using the interrupt thread created by wiringPiISR
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <pthread.h>
+
+#include <wiringPi/wiringPi.h>
+
+#include "gpio.h"
+#include "rt.h"
+#include "common.h"
+#include "log.h"
+
+/* wiringPi is not thread safe, serialize access to the pins */
+static pthread_mutex_t wiring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called by the wiringPi interrupt thread on every edge. wiringPi does not
+   tell which edge it was, so the level has to be read back */
+static void
+on_wiringpi_isr (void *arg)
+{
+    struct gpio_dev *dev = arg;
+    struct gpio_edge edge;
+
+    /* One thread per pin, created by wiringPi */
+    rt_enter (RT_THREAD_GPIO);
+
+    edge.timestamp_ns = gpio_now_ns ();
+
+    pthread_mutex_lock (&wiring_mutex);
+    edge.level = digitalRead (dev->pin) == HIGH;
+    pthread_mutex_unlock (&wiring_mutex);
+
+    gpio_deliver (dev, &edge, 1);
+}
+
+static int
+wiringpi_open (struct gpio_dev *dev, int pin)
+{
+    ssize_t s;
+
+    /* Initialize wiringPi with default pin numbering scheme */
+    s = wiringPiSetup ();
+    if (s < 0)
+      {
+        log_error ("error in wiringPiSetup");
+        return 1;
+      }
+
+    pthread_mutex_lock (&wiring_mutex);
+    gpio_init_level (dev, digitalRead (pin) == HIGH);
+    pthread_mutex_unlock (&wiring_mutex);
+
+    /* Register a interrupt handler on the pin */
+    s = wiringPiISR (pin, INT_EDGE_BOTH, &on_wiringpi_isr, dev);
+    if (s < 0)
+      {
+        log_error ("error in wiringPiISR");
+        return 1;
+      }
+
+    return 0;
+}
+
+const struct gpio_backend gpio_wiringpi_backend = {
+    .name     = "wiringpi",
+    .open     = wiringpi_open,
+    .dispatch = NULL,
+    .close    = NULL,
+};
@@ -0,0 +1,107 @@
+/*
+ *  hist.c
+ *    Log-linear latency histograms with fixed buckets
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include "hist.h"
+
+static int
+bucket_of (uint64_t v)
+{
+    int shift;
+
+    if (v >= (1ULL << 32))
+        return HIST_BUCKETS - 1;
+    if (v < HIST_SUB_COUNT)
+        return v;
+
+    /* Position of the highest bit beyond the sub-bucket bits */
+    shift = 63 - __builtin_clzll (v) - HIST_SUB_BITS;
+
+    return (shift + 1) * HIST_SUB_COUNT + (v >> shift) - HIST_SUB_COUNT;
+}
+
+/* Largest value that falls in bucket i */
+static uint64_t
+bucket_upper (int i)
+{
+    int shift;
+
+    if (i < HIST_SUB_COUNT)
+        return i;
+
+    shift = i / HIST_SUB_COUNT - 1;
+
+    return (((uint64_t) (i % HIST_SUB_COUNT + HIST_SUB_COUNT + 1)) << shift)
+           - 1;
+}
+
+void
+hist_init (struct histogram *h)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        atomic_init (&h->counts[i], 0);
+    atomic_init (&h->count, 0);
+    atomic_init (&h->sum, 0);
+    atomic_init (&h->max, 0);
+}
+
+void
+hist_record (struct histogram *h, uint64_t v)
+{
+    uint64_t max;
+
+    atomic_fetch_add_explicit (&h->counts[bucket_of (v)], 1,
+                               memory_order_relaxed);
+    atomic_fetch_add_explicit (&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&h->sum, v, memory_order_relaxed);
+
+    max = atomic_load_explicit (&h->max, memory_order_relaxed);
+    while (v > max &&
+           !atomic_compare_exchange_weak_explicit (&h->max, &max, v,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+        ;
+}
+
+uint64_t
+hist_percentile (struct histogram *h, double p)
+{
+    uint64_t count, rank, seen = 0;
+    uint64_t max = atomic_load_explicit (&h->max, memory_order_relaxed);
+
+    count = atomic_load_explicit (&h->count, memory_order_relaxed);
+    if (count == 0)
+        return 0;
+
+    rank = (uint64_t) (p / 100 * count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+      {
+        seen += atomic_load_explicit (&h->counts[i], memory_order_relaxed);
+        if (seen >= rank && i < HIST_BUCKETS - 1)
+            return bucket_upper (i) < max ? bucket_upper (i) : max;
+      }
+
+    return max;
+}
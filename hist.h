@@ -0,0 +1,54 @@
+/*
+ *  hist.h
+ *    Log-linear latency histograms with fixed buckets
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Values below 2^HIST_SUB_BITS get a bucket each, above that every power of
+   two is split into 2^HIST_SUB_BITS equal buckets, so a bucket is never
+   wider than 1/16 of its value. Values are in microseconds and anything
+   from 2^32 (about 70 minutes) up lands in the last bucket */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/* Recording is lock-free and may be done from any thread */
+struct histogram {
+    atomic_uint_fast64_t counts[HIST_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+};
+
+extern void hist_init (struct histogram *);
+
+extern void hist_record (struct histogram *, uint64_t);
+
+/* Upper bound of the bucket holding the pth (0-100) percentile, 0 when
+   empty */
+extern uint64_t hist_percentile (struct histogram *, double);
+
+#endif /* _HIST_H_ */
@@ -0,0 +1,222 @@
+/*
+ *  history.c
+ *    Ring of raw sensor samples and per minute, hour and day rollups
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "history.h"
+#include "sensors.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+/* A rollup bucket covering [start, start + period) */
+struct bucket {
+    time_t   start;
+    uint32_t count;
+    float    min;
+    float    max;
+    double   sum;
+};
+
+/* Buckets of one resolution are a ring indexed by (t / period) % nbuckets,
+   a bucket whose start does not match t is stale and gets reset */
+struct rollup {
+    time_t        period;
+    size_t        nbuckets;
+    struct bucket *buckets;
+};
+
+struct sample {
+    time_t t;
+    float  value;
+};
+
+struct series {
+    size_t        raw_next;
+    struct sample raw[HISTORY_RAW_MAX];
+    struct bucket minutes[HISTORY_MINUTES];
+    struct bucket hours[HISTORY_HOURS];
+    struct bucket days[HISTORY_DAYS];
+    struct rollup rollups[3];
+};
+
+struct history {
+    pthread_mutex_t mutex;
+    struct series   series[HISTORY_NSERIES];
+};
+
+/* Map a sensor type from the fgevents payload to a series index */
+static int
+history_series (int32_t type)
+{
+    const struct sensor_type *t = sensors_lookup (type);
+
+    return t ? sensor_index (t) : -1;
+}
+
+struct history *
+history_create (void)
+{
+    struct history *h;
+
+    h = calloc (1, sizeof (struct history));
+    if (h == NULL)
+      {
+        log_error ("calloc failed for sensor history");
+        return NULL;
+      }
+
+    pthread_mutex_init (&h->mutex, NULL);
+    for (int i = 0; i < HISTORY_NSERIES; i++)
+      {
+        struct series *sr = &h->series[i];
+
+        sr->rollups[0].period = 60;
+        sr->rollups[0].nbuckets = HISTORY_MINUTES;
+        sr->rollups[0].buckets = sr->minutes;
+        sr->rollups[1].period = 60 * 60;
+        sr->rollups[1].nbuckets = HISTORY_HOURS;
+        sr->rollups[1].buckets = sr->hours;
+        sr->rollups[2].period = 24 * 60 * 60;
+        sr->rollups[2].nbuckets = HISTORY_DAYS;
+        sr->rollups[2].buckets = sr->days;
+      }
+
+    return h;
+}
+
+void
+history_destroy (struct history *h)
+{
+    if (h == NULL)
+        return;
+
+    pthread_mutex_destroy (&h->mutex);
+    free (h);
+}
+
+/* Fold value into the bucket of rollup r that covers t */
+static void
+rollup_add (struct rollup *r, time_t t, float value)
+{
+    time_t start = t - t % r->period;
+    struct bucket *b = &r->buckets[(t / r->period) % r->nbuckets];
+
+    if (b->start != start || b->count == 0)
+      {
+        b->start = start;
+        b->count = 0;
+        b->min = value;
+        b->max = value;
+        b->sum = 0;
+      }
+
+    if (value < b->min)
+        b->min = value;
+    if (value > b->max)
+        b->max = value;
+    b->sum += value;
+    b->count++;
+}
+
+int
+history_add (struct history *h, int32_t type, time_t t, float value)
+{
+    int i;
+    struct series *sr;
+
+    i = history_series (type);
+    if (i < 0)
+        return 1;
+    sr = &h->series[i];
+
+    pthread_mutex_lock (&h->mutex);
+    sr->raw[sr->raw_next].t = t;
+    sr->raw[sr->raw_next].value = value;
+    sr->raw_next = (sr->raw_next + 1) % HISTORY_RAW_MAX;
+
+    for (int j = 0; j < 3; j++)
+        rollup_add (&sr->rollups[j], t, value);
+    pthread_mutex_unlock (&h->mutex);
+
+    return 0;
+}
+
+int
+history_query (struct history *h, int32_t type, time_t from, time_t to,
+               struct history_aggregate *agg)
+{
+    int i;
+    double sum = 0;
+    time_t now;
+    struct series *sr;
+    struct rollup *r;
+
+    memset (agg, 0, sizeof (*agg));
+
+    i = history_series (type);
+    if (i < 0)
+        return 1;
+    sr = &h->series[i];
+
+    /* Pick the finest resolution whose retention reaches back to from */
+    now = clock_wall_ms () / 1000;
+    r = &sr->rollups[2];
+    for (int j = 0; j < 3; j++)
+      {
+        time_t oldest = now - now % sr->rollups[j].period -
+                        (sr->rollups[j].nbuckets - 1) *
+                        sr->rollups[j].period;
+        if (from >= oldest)
+          {
+            r = &sr->rollups[j];
+            break;
+          }
+      }
+
+    /* Every bucket of that resolution overlapping the range counts, so the
+       range is effectively widened to whole buckets */
+    pthread_mutex_lock (&h->mutex);
+    for (size_t j = 0; j < r->nbuckets; j++)
+      {
+        struct bucket *b = &r->buckets[j];
+
+        if (b->count == 0 || b->start + r->period <= from || b->start > to)
+            continue;
+
+        if (agg->count == 0 || b->min < agg->min)
+            agg->min = b->min;
+        if (agg->count == 0 || b->max > agg->max)
+            agg->max = b->max;
+        sum += b->sum;
+        agg->count += b->count;
+      }
+    pthread_mutex_unlock (&h->mutex);
+
+    if (agg->count > 0)
+        agg->mean = sum / agg->count;
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ *  history.h
+ *    Fixed memory store of recent sensor readings with rollups
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "sensors.h"
+
+/* Raw samples kept per sensor, enough for one hour at one sample a second */
+#define HISTORY_RAW_MAX 3600
+
+/* Rollup resolutions and how many buckets of each are kept */
+#define HISTORY_MINUTES 60
+#define HISTORY_HOURS   48
+#define HISTORY_DAYS    90
+
+/* One series per entry in the sensor registry */
+#define HISTORY_NSERIES SENSOR_COUNT
+
+struct history_aggregate {
+    uint32_t count;
+    float    min;
+    float    max;
+    float    mean;
+};
+
+struct history;
+
+/* Allocate an empty store, returns NULL on failure */
+extern struct history *history_create (void);
+
+extern void history_destroy (struct history *);
+
+/* Add a reading of sensor type (OUTTEMP, INTEMP...) taken at time t */
+extern int history_add (struct history *, int32_t, time_t, float);
+
+/* Aggregate readings of sensor type between from and to (inclusive) using
+   the finest rollup that still covers from. Returns non-zero if the type is
+   unknown */
+extern int history_query (struct history *, int32_t, time_t, time_t,
+                          struct history_aggregate *);
+
+#endif /* _HISTORY_H_ */
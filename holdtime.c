@@ -0,0 +1,174 @@
+/*
+ *  holdtime.c
+ *    Per hour of day gap histograms and the hold time they suggest
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "holdtime.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+/* Upper edge of bucket i in milliseconds */
+static uint32_t
+bucket_upper_ms (int i)
+{
+    return HOLDTIME_BUCKET0_MS << i;
+}
+
+static int
+bucket_of (uint64_t gap_ms)
+{
+    int i = 0;
+
+    while (i < HOLDTIME_NBUCKETS - 1 && gap_ms > bucket_upper_ms (i))
+        i++;
+
+    return i;
+}
+
+static int
+current_hour (void)
+{
+    time_t now = clock_wall_ms () / 1000;
+    struct tm tm;
+
+    localtime_r (&now, &tm);
+
+    return tm.tm_hour;
+}
+
+/* Expected cost of holding for hold_ms given the gaps of one hour. A gap is
+   taken to be the middle of its bucket */
+static float
+hold_cost (const struct holdtime *ht, const float *hist, uint32_t hold_ms)
+{
+    float cost = 0;
+
+    for (int i = 0; i < HOLDTIME_NBUCKETS; i++)
+      {
+        float lower = i == 0 ? 0 : bucket_upper_ms (i - 1);
+        float gap = (lower + bucket_upper_ms (i)) / 2;
+
+        if (gap <= hold_ms)
+            cost += hist[i] * gap;
+        else
+            cost += hist[i] * ((float) hold_ms + ht->restart_cost_ms);
+      }
+
+    return cost;
+}
+
+/* Pick the cheapest hold time among the bounds and the bucket edges in
+   between. Called with the mutex held */
+static void
+update_hour (struct holdtime *ht, int hour)
+{
+    uint32_t best_ms = ht->min_ms;
+    float best = hold_cost (ht, ht->hist[hour], ht->min_ms);
+
+    for (int i = 0; i <= HOLDTIME_NBUCKETS; i++)
+      {
+        uint32_t c = i < HOLDTIME_NBUCKETS ? bucket_upper_ms (i) : ht->max_ms;
+        float cost;
+
+        if (c <= ht->min_ms || c > ht->max_ms)
+            continue;
+
+        cost = hold_cost (ht, ht->hist[hour], c);
+        if (cost < best)
+          {
+            best = cost;
+            best_ms = c;
+          }
+      }
+
+    if (best_ms != atomic_load (&ht->hold_ms[hour]))
+        _log_debug ("hold time for hour %d is now %" PRIu32 " ms\n", hour,
+                    best_ms);
+    atomic_store (&ht->hold_ms[hour], best_ms);
+}
+
+void
+holdtime_init (struct holdtime *ht, uint32_t min_ms, uint32_t max_ms,
+               uint32_t default_ms, uint32_t restart_cost_ms)
+{
+    memset (ht, 0, sizeof (*ht));
+    pthread_mutex_init (&ht->mutex, NULL);
+
+    if (max_ms < min_ms)
+        max_ms = min_ms;
+    if (default_ms < min_ms)
+        default_ms = min_ms;
+    if (default_ms > max_ms)
+        default_ms = max_ms;
+
+    ht->min_ms = min_ms;
+    ht->max_ms = max_ms;
+    ht->default_ms = default_ms;
+    ht->restart_cost_ms = restart_cost_ms;
+    for (int h = 0; h < 24; h++)
+        atomic_init (&ht->hold_ms[h], default_ms);
+}
+
+void
+holdtime_edge (struct holdtime *ht, int level, uint64_t timestamp_ns)
+{
+    int hour;
+    uint64_t gap_ms;
+
+    pthread_mutex_lock (&ht->mutex);
+    if (!level)
+      {
+        ht->low = true;
+        ht->low_since_ns = timestamp_ns;
+      }
+    else if (ht->low && timestamp_ns >= ht->low_since_ns)
+      {
+        ht->low = false;
+        gap_ms = (timestamp_ns - ht->low_since_ns) / 1000000;
+        hour = current_hour ();
+
+        for (int i = 0; i < HOLDTIME_NBUCKETS; i++)
+            ht->hist[hour][i] *= HOLDTIME_DECAY;
+        ht->total[hour] = ht->total[hour] * HOLDTIME_DECAY + 1;
+        ht->hist[hour][bucket_of (gap_ms)] += 1;
+
+        if (ht->total[hour] >= HOLDTIME_MIN_SAMPLES)
+            update_hour (ht, hour);
+      }
+    pthread_mutex_unlock (&ht->mutex);
+}
+
+uint32_t
+holdtime_get_ms (struct holdtime *ht)
+{
+    return atomic_load_explicit (&ht->hold_ms[current_hour ()],
+                                 memory_order_relaxed);
+}
+
+void
+holdtime_destroy (struct holdtime *ht)
+{
+    pthread_mutex_destroy (&ht->mutex);
+}
@@ -0,0 +1,77 @@
+/*
+ *  holdtime.h
+ *    Recording hold time learned from gaps between PIR activity
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _HOLDTIME_H_
+#define _HOLDTIME_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Gaps are binned in buckets doubling from HOLDTIME_BUCKET0_MS, the last
+   bucket also holds every longer gap */
+#define HOLDTIME_NBUCKETS 12
+#define HOLDTIME_BUCKET0_MS 250
+
+/* Weight kept by old gaps of an hour each time a new one is added there,
+   so roughly the last 1 / (1 - decay) gaps count */
+#define HOLDTIME_DECAY 0.97f
+
+/* Weighted gaps needed in an hour before its hold time is learned */
+#define HOLDTIME_MIN_SAMPLES 10.0f
+
+/* A gap is the time from the PIR going low until it goes high again. A hold
+   time longer than the gap keeps one recording going, a shorter one stops
+   and restarts it. Per hour of day the hold time minimising
+     sum over gaps of (gap if gap <= hold else hold + restart_cost)
+   is picked, i.e. footage recorded while idle traded against the cost of
+   a restart */
+struct holdtime {
+    pthread_mutex_t mutex;
+    uint32_t        min_ms;
+    uint32_t        max_ms;
+    uint32_t        default_ms;
+    uint32_t        restart_cost_ms;
+    bool            low;
+    uint64_t        low_since_ns;
+    float           hist[24][HOLDTIME_NBUCKETS];
+    float           total[24];
+    atomic_uint     hold_ms[24];
+};
+
+/* Hold times are kept within [min_ms, max_ms], default_ms is used for hours
+   without enough gaps. restart_cost_ms is how much idle footage one
+   stop/start is considered to be worth */
+extern void holdtime_init (struct holdtime *, uint32_t, uint32_t, uint32_t,
+                           uint32_t);
+
+/* Feed a PIR edge, timestamps are on the gpio_edge timeline */
+extern void holdtime_edge (struct holdtime *, int, uint64_t);
+
+/* Hold time for the current hour in milliseconds */
+extern uint32_t holdtime_get_ms (struct holdtime *);
+
+extern void holdtime_destroy (struct holdtime *);
+
+#endif /* _HOLDTIME_H_ */
@@ -0,0 +1,177 @@
+/*
+ *  hooks.c
+ *    Create picam hook files relative to a pre-opened directory
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "hooks.h"
+#include "touch.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+/* File names picam looks for in its hooks directory */
+static const char *const hook_names[HOOK_COUNT] = {
+    "start_record",
+    "stop_record"
+};
+
+/* Lines written to the FIFO */
+static const char *const hook_lines[HOOK_COUNT] = {
+    "start_record\n",
+    "stop_record\n"
+};
+
+void
+hooks_open (struct hooks *h, const char *dir, const char *fifo_path)
+{
+    memset (h, 0, sizeof (*h));
+    h->fifo_fd = -1;
+    h->fifo_path = fifo_path;
+
+    for (int i = 0; i < HOOK_COUNT; i++)
+        snprintf (h->paths[i], PATH_MAX, "%s/%s", dir, hook_names[i]);
+
+    h->dirfd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (h->dirfd < 0)
+        log_error ("could not open hooks dir, falling back to touch");
+
+    /* A write to a FIFO picam has closed must fail with EPIPE instead of
+       killing us */
+    if (fifo_path)
+        signal (SIGPIPE, SIG_IGN);
+}
+
+/* Write the hook line to the FIFO, opening it if picam has started reading
+   it since the last attempt. Returns non-zero if the FIFO can't be used */
+static int
+fire_fifo (struct hooks *h, enum hook hook)
+{
+    ssize_t s;
+    size_t len = strlen (hook_lines[hook]);
+
+    if (h->fifo_fd < 0)
+      {
+        /* Fails with ENXIO while nobody has it open for reading */
+        h->fifo_fd = open (h->fifo_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (h->fifo_fd < 0)
+            return 1;
+      }
+
+    /* Writes this small are atomic on a pipe */
+    s = write (h->fifo_fd, hook_lines[hook], len);
+    if (s != (ssize_t) len)
+      {
+        if (errno != EPIPE && errno != EAGAIN)
+            log_error ("write to hook fifo failed");
+        close (h->fifo_fd);
+        h->fifo_fd = -1;
+        return 1;
+      }
+
+    return 0;
+}
+
+/* Picam watches for the file being closed after a write, so an open that
+   creates it or truncates a stale one and a close is all it takes */
+static int
+fire_file (struct hooks *h, enum hook hook)
+{
+    int fd;
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+    if (h->dirfd >= 0)
+      {
+        fd = openat (h->dirfd, hook_names[hook],
+                     O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_NOCTTY |
+                     O_CLOEXEC, mode);
+        if (fd >= 0)
+          {
+            close (fd);
+            return 0;
+          }
+        log_error ("openat failed for hook, falling back to touch");
+      }
+
+    return touch (h->paths[hook]) != 0;
+}
+
+int
+hooks_fire (struct hooks *h, enum hook hook)
+{
+    int s = 1;
+    uint64_t start, elapsed, max;
+    struct hook_stats *st = &h->stats[hook];
+
+    start = clock_now_ns ();
+    if (h->fifo_path)
+        s = fire_fifo (h, hook);
+    if (s != 0)
+        s = fire_file (h, hook);
+    elapsed = clock_now_ns () - start;
+
+    if (s != 0)
+      {
+        atomic_fetch_add_explicit (&st->failures, 1, memory_order_relaxed);
+        return s;
+      }
+
+    atomic_fetch_add_explicit (&st->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&st->total_ns, elapsed, memory_order_relaxed);
+    atomic_store_explicit (&st->last_ns, elapsed, memory_order_relaxed);
+    max = atomic_load_explicit (&st->max_ns, memory_order_relaxed);
+    while (elapsed > max &&
+           !atomic_compare_exchange_weak_explicit (&st->max_ns, &max, elapsed,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+        ;
+
+    return 0;
+}
+
+void
+hooks_close (struct hooks *h)
+{
+    for (int i = 0; i < HOOK_COUNT; i++)
+      {
+        struct hook_stats *st = &h->stats[i];
+        uint64_t count = atomic_load (&st->count);
+
+        _log_debug ("%s hook: %" PRIuFAST64 " delivered, %" PRIuFAST64
+                    " failed, mean %" PRIu64 " ns, max %" PRIuFAST64 " ns\n",
+                    hook_names[i], count, atomic_load (&st->failures),
+                    count ? (uint64_t) atomic_load (&st->total_ns) / count :
+                            0,
+                    atomic_load (&st->max_ns));
+      }
+
+    if (h->fifo_fd >= 0)
+        close (h->fifo_fd);
+    if (h->dirfd >= 0)
+        close (h->dirfd);
+    h->fifo_fd = -1;
+    h->dirfd = -1;
+}
@@ -0,0 +1,68 @@
+/*
+ *  hooks.h
+ *    Delivery of start and stop requests to picam
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _HOOKS_H_
+#define _HOOKS_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+enum hook {
+    HOOK_START,
+    HOOK_STOP,
+    HOOK_COUNT
+};
+
+/* Time spent delivering each hook, from before the first syscall until the
+   hook is visible to picam */
+struct hook_stats {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t failures;
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t last_ns;
+};
+
+/* A hook is delivered through the first channel that works: a line on the
+   FIFO if one is configured and picam has it open, a file created relative
+   to the hooks directory, or touch () on the full path */
+struct hooks {
+    int               dirfd;
+    int               fifo_fd;
+    const char        *fifo_path;
+    char              paths[HOOK_COUNT][PATH_MAX];
+    struct hook_stats stats[HOOK_COUNT];
+};
+
+/* Open the hooks directory, fifo_path may be NULL. Never fails, hooks fall
+   back to touch () when the directory can't be opened */
+extern void hooks_open (struct hooks *, const char *, const char *);
+
+/* Deliver hook, returns non-zero on failure */
+extern int hooks_fire (struct hooks *, enum hook);
+
+/* Log statistics and close everything */
+extern void hooks_close (struct hooks *);
+
+#endif /* _HOOKS_H_ */
@@ -24,22 +24,372 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "log.h"
 
-/* This function is prints a debug message with timestamp */
+/* A message waiting to be written, formatted by the producer but without
+   timestamp or location which the writer adds */
+struct log_record {
+    enum log_level  level;
+    int             save_errno;
+    int             line;
+    const char      *file;
+    struct timespec ts;
+    char            msg[LOG_MSG_MAX];
+};
+
+/* Single producer single consumer ring owned by one thread. head is only
+   written by the owner and tail only by the writer thread */
+struct log_ring {
+    atomic_bool       in_use;
+    atomic_bool       released;
+    atomic_uint       head;
+    atomic_uint       tail;
+    atomic_ulong      dropped;
+    struct log_record records[LOG_RING_SIZE];
+} __attribute__ ((aligned (64)));
+
+static struct log_ring rings[LOG_MAX_THREADS];
+
+/* Ring of the calling thread, NULL until it logs for the first time */
+static __thread struct log_ring *my_ring;
+
+static pthread_key_t ring_key;
+static pthread_t writer_t;
+static atomic_bool writer_running;
+
+/* The writer blocks on doorbell while idle. Only the first message after it
+   went to sleep rings it, the rest of a burst costs no syscall */
+static int doorbell = -1;
+static atomic_bool writer_asleep;
+
+/* Forward declarations used in this file. */
+static void release_ring (void *);
+
+/* Format seconds since epoch the same way asctime does, without newline */
+static void
+format_timestamp (time_t ltime, char *buf)
+{
+    struct tm result;
+    char *p;
+
+    localtime_r (&ltime, &result);
+    asctime_r (&result, buf);
+
+    p = strchr (buf, '\n');
+    if (p != NULL)
+        *p = '\0';
+}
+
+/* Write a record the way the old synchronous macros did */
+static void
+write_record (FILE *fp, const struct log_record *rec)
+{
+    char timestamp[TIMESTAMP_MAX_LENGTH];
+    char errbuf[64];
+
+    format_timestamp (rec->ts.tv_sec, timestamp);
+    if (rec->level == LOG_LEVEL_DEBUG)
+        fprintf (fp, "[DEBUG: %s] %s", timestamp, rec->msg);
+    else
+        fprintf (fp, "[%s] %s: %s: %d: %s: %s\n", timestamp, __progname,
+                 rec->file, rec->line, rec->msg,
+                 strerror_r (rec->save_errno, errbuf, sizeof (errbuf)));
+}
+
+/* Claim a free ring for the calling thread */
+static struct log_ring *
+claim_ring (void)
+{
+    for (int i = 0; i < LOG_MAX_THREADS; i++)
+      {
+        _Bool expected = false;
+        if (atomic_compare_exchange_strong (&rings[i].in_use, &expected,
+                                            true))
+          {
+            my_ring = &rings[i];
+            pthread_setspecific (ring_key, my_ring);
+            return my_ring;
+          }
+      }
+
+    return NULL;
+}
+
+/* Called when a thread with a ring exits, the writer frees the ring once it
+   is drained */
+static void
+release_ring (void *arg)
+{
+    struct log_ring *ring = arg;
+
+    atomic_store (&ring->released, true);
+}
+
+/* Write every pending record in timestamp order. Returns number written */
+static size_t
+drain_rings (FILE *out, FILE *err)
+{
+    size_t written = 0;
+
+    while (1)
+      {
+        struct log_ring *next = NULL;
+        struct log_record *rec = NULL;
+
+        for (int i = 0; i < LOG_MAX_THREADS; i++)
+          {
+            struct log_ring *ring = &rings[i];
+            unsigned int tail, head;
+
+            if (!atomic_load_explicit (&ring->in_use, memory_order_relaxed))
+                continue;
+
+            tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+            head = atomic_load_explicit (&ring->head, memory_order_acquire);
+            if (head == tail)
+              {
+                if (atomic_load (&ring->released))
+                  {
+                    atomic_store (&ring->released, false);
+                    atomic_store (&ring->in_use, false);
+                  }
+                continue;
+              }
+
+            struct log_record *r = &ring->records[tail % LOG_RING_SIZE];
+            if (rec == NULL || r->ts.tv_sec < rec->ts.tv_sec ||
+                (r->ts.tv_sec == rec->ts.tv_sec &&
+                 r->ts.tv_nsec < rec->ts.tv_nsec))
+              {
+                rec = r;
+                next = ring;
+              }
+          }
+
+        if (next == NULL)
+            break;
+
+        write_record (rec->level == LOG_LEVEL_DEBUG ? out : err, rec);
+        atomic_fetch_add_explicit (&next->tail, 1, memory_order_release);
+        written++;
+      }
+
+    for (int i = 0; i < LOG_MAX_THREADS; i++)
+      {
+        unsigned long dropped = atomic_exchange (&rings[i].dropped, 0);
+        if (dropped > 0)
+            fprintf (err, "%s: log: dropped %lu messages\n", __progname,
+                     dropped);
+      }
+
+    return written;
+}
+
+/* Wake the writer if it is asleep, or let it go */
+static void
+ring_doorbell (void)
+{
+    uint64_t u = 1;
+
+    /* Pairs with the fence in thread_log_start, either the writer sees the
+       record or this sees it asleep */
+    atomic_thread_fence (memory_order_seq_cst);
+    if (atomic_load_explicit (&writer_asleep, memory_order_relaxed) &&
+        atomic_exchange (&writer_asleep, false))
+      {
+        if (write (doorbell, &u, sizeof (uint64_t)) < 0)
+            log_error_no_timestamp ("write to log doorbell failed");
+      }
+}
+
+/* Start routine for the writer thread */
+static void *
+thread_log_start (__attribute__ ((unused)) void *arg)
+{
+    uint64_t u;
+    struct timespec delay;
+    struct pollfd pfd = { .fd = doorbell, .events = POLLIN };
+    char outbuf[BUFSIZ], errbuf[BUFSIZ];
+    FILE *out, *err;
+
+    delay.tv_sec = 0;
+    delay.tv_nsec = LOG_FLUSH_MS * 1000000L;
+
+    /* Format a whole batch in memory and hand it to the kernel in one write
+       per stream */
+    out = fdopen (dup (fileno (stdout)), "w");
+    err = fdopen (dup (fileno (stderr)), "w");
+    if (out == NULL || err == NULL)
+      {
+        log_error_no_timestamp ("fdopen failed for log writer");
+        if (out)
+            fclose (out);
+        if (err)
+            fclose (err);
+        out = stdout;
+        err = stderr;
+      }
+    else
+      {
+        setvbuf (out, outbuf, _IOFBF, sizeof (outbuf));
+        setvbuf (err, errbuf, _IOFBF, sizeof (errbuf));
+      }
+
+    while (atomic_load (&writer_running))
+      {
+        /* Records pushed before the flag was seen rang no bell, so look
+           once more before sleeping */
+        atomic_store (&writer_asleep, true);
+        atomic_thread_fence (memory_order_seq_cst);
+        if (drain_rings (out, err) == 0)
+          {
+            if (poll (&pfd, 1, -1) > 0 &&
+                read (doorbell, &u, sizeof (uint64_t)) < 0)
+                log_error_no_timestamp ("read from log doorbell failed");
+          }
+        atomic_store (&writer_asleep, false);
+
+        /* Let the rest of the burst come in and write it in one go */
+        nanosleep (&delay, NULL);
+        drain_rings (out, err);
+        fflush (out);
+        fflush (err);
+      }
+
+    drain_rings (out, err);
+    if (out != stdout)
+      {
+        fclose (out);
+        fclose (err);
+      }
+
+    return NULL;
+}
+
+int
+log_init (void)
+{
+    ssize_t s;
+
+    s = pthread_key_create (&ring_key, &release_ring);
+    if (s != 0)
+      {
+        log_error_en (s, "error in pthread_key_create");
+        return s;
+      }
+
+    doorbell = eventfd (0, EFD_CLOEXEC);
+    if (doorbell < 0)
+      {
+        log_error ("error creating log doorbell");
+        return 1;
+      }
+
+    atomic_store (&writer_running, true);
+    s = pthread_create (&writer_t, NULL, &thread_log_start, NULL);
+    if (s != 0)
+      {
+        atomic_store (&writer_running, false);
+        log_error_en (s, "error creating log writer thread");
+        close (doorbell);
+        doorbell = -1;
+      }
+
+    return s;
+}
+
 void
-log_debug (const char *format, ...)
+log_shutdown (void)
 {
-	char *timestamp = fetch_timestamp ();
-    if (timestamp)
+    uint64_t u = 1;
+
+    if (!atomic_exchange (&writer_running, false))
+        return;
+
+    if (write (doorbell, &u, sizeof (uint64_t)) < 0)
+        log_error_no_timestamp ("write to log doorbell failed");
+    pthread_join (writer_t, NULL);
+    close (doorbell);
+    doorbell = -1;
+}
+
+/* Format a record into the calling thread's ring, or write it directly
+   when there is no writer or no free ring */
+static void
+log_vmsg (enum log_level level, const char *file, int line, int save_errno,
+          const char *format, va_list args)
+{
+    struct log_ring *ring;
+    struct log_record *rec, direct;
+    unsigned int head = 0, tail;
+    int n;
+
+    ring = my_ring;
+    if (ring == NULL && atomic_load (&writer_running))
+        ring = claim_ring ();
+
+    if (ring == NULL || !atomic_load_explicit (&writer_running,
+                                               memory_order_relaxed))
+        rec = &direct;
+    else
       {
-		    fprintf (stdout, "[DEBUG: %s] ", timestamp);		
-        free (timestamp);
+        head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+        tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+        if (head - tail >= LOG_RING_SIZE)
+          {
+            atomic_fetch_add_explicit (&ring->dropped, 1,
+                                       memory_order_relaxed);
+            return;
+          }
+        rec = &ring->records[head % LOG_RING_SIZE];
       }
 
+    rec->level = level;
+    rec->file = file;
+    rec->line = line;
+    rec->save_errno = save_errno;
+    clock_gettime (CLOCK_REALTIME, &rec->ts);
+    n = vsnprintf (rec->msg, sizeof (rec->msg), format, args);
+
+    /* Debug messages carry their own newline, keep it when cut short */
+    if (n >= (int) sizeof (rec->msg) && level == LOG_LEVEL_DEBUG)
+        rec->msg[sizeof (rec->msg) - 2] = '\n';
+
+    if (rec == &direct)
+      {
+        write_record (level == LOG_LEVEL_DEBUG ? stdout : stderr, rec);
+        return;
+      }
+
+    atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+    ring_doorbell ();
+}
+
+void
+log_msg (enum log_level level, const char *file, int line, int save_errno,
+         const char *format, ...)
+{
     va_list args;
-    va_start (args, format);		
-    vfprintf (stdout, format, args);
+
+    va_start (args, format);
+    log_vmsg (level, file, line, save_errno, format, args);
+    va_end (args);
+}
+
+/* This function is prints a debug message with timestamp */
+void
+log_debug (const char *format, ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    log_vmsg (LOG_LEVEL_DEBUG, NULL, 0, 0, format, args);
     va_end (args);
-}
\ No newline at end of file
+}
@@ -31,7 +31,36 @@
 
 #include "common.h"
 
-extern void log_debug (const char *, ...);
+/* Number of threads that can log without falling back to writing directly,
+   each gets a ring of LOG_RING_SIZE records */
+#define LOG_MAX_THREADS 16
+#define LOG_RING_SIZE 32
+
+/* Messages longer than this are truncated */
+#define LOG_MSG_MAX 128
+
+/* How long the writer thread waits after being woken before it drains the
+   rings, so that a burst is written at once (milliseconds) */
+#define LOG_FLUSH_MS 20
+
+enum log_level {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_ERROR
+};
+
+/* Start the background writer, until then messages are written directly */
+extern int log_init (void);
+
+/* Stop the writer thread and flush what is left in the rings */
+extern void log_shutdown (void);
+
+/* Push a record on the calling thread's ring. Never blocks or allocates,
+   the record is dropped if the ring is full */
+extern void log_msg (enum log_level, const char *, int, int, const char *,
+                     ...) __attribute__ ((format (printf, 5, 6)));
+
+extern void log_debug (const char *, ...)
+            __attribute__ ((format (printf, 1, 2)));
 
 /* If _DEBUG is not defined, we simply replace all _log_debug with nothing */
 #ifndef _DEBUG
@@ -51,46 +80,12 @@ extern void log_debug (const char *, ...);
 #define log_error(msg)\
         do\
           {\
-            char *timestamp = fetch_timestamp ();\
-            if (timestamp)\
-              {\
-                fprintf (stderr, "[%s] %s: %s: %d: %s: %s\n", timestamp,\
-                         __progname, __FILE__, __LINE__, msg,\
-                         strerror (errno));\
-                free (timestamp);\
-              }\
-            else\
-                log_error_no_timestamp (msg);\
+            log_msg (LOG_LEVEL_ERROR, __FILE__, __LINE__, errno, "%s",\
+                     msg);\
           } while(0)
 
 /* Extension of macro above */
 #define log_error_en(en, msg)\
         do { errno = en;log_error (msg); } while(0)
 
-/* Helper function to get current time for logging messages */
-static inline char *
-fetch_timestamp ()
-{    
-    struct tm result;
-    char *stime;
-
-    stime = malloc (TIMESTAMP_MAX_LENGTH);
-    if (stime == NULL)
-        log_error_no_timestamp ("malloc failed for timestamp");
-    else
-      {
-        time_t ltime;
-        char *p;
-
-        ltime = time (NULL);
-        localtime_r (&ltime, &result);
-        asctime_r (&result, stime);
-
-        p = strchr (stime, '\n');
-		    if (p != NULL)
-			      *p = '\0';
-      }
-    return stime;
-}
-
-#endif /* _LOG_H_ */
\ No newline at end of file
+#endif /* _LOG_H_ */
@@ -0,0 +1,621 @@
+/*
+ *  metrics.c
+ *    Per thread counters summed on scrape and written to a unix socket
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "sensors.h"
+#include "sampler.h"
+#include "rt.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+/* The scrape buffer starts at SCRAPE_INITIAL and doubles as needed up to
+   SCRAPE_MAX, output past that is dropped whole */
+#define SCRAPE_INITIAL 16384
+#define SCRAPE_MAX (1 << 20)
+
+/* The extra slot is shared by threads that found no free one */
+static struct metrics_slot slots[METRICS_MAX_THREADS + 1];
+
+__thread struct metrics_slot *metrics_my_slot;
+
+static pthread_key_t slot_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+/* Counts stay in the slot when its thread exits, the next owner adds to
+   them */
+static void
+release_slot (void *arg)
+{
+    struct metrics_slot *slot = arg;
+
+    atomic_store (&slot->in_use, false);
+}
+
+static void
+create_key (void)
+{
+    pthread_key_create (&slot_key, &release_slot);
+}
+
+struct metrics_slot *
+metrics_claim_slot (void)
+{
+    pthread_once (&key_once, &create_key);
+
+    for (int i = 0; i < METRICS_MAX_THREADS; i++)
+      {
+        _Bool expected = false;
+        if (atomic_compare_exchange_strong (&slots[i].in_use, &expected,
+                                            true))
+          {
+            metrics_my_slot = &slots[i];
+            pthread_setspecific (slot_key, metrics_my_slot);
+            return metrics_my_slot;
+          }
+      }
+
+    metrics_my_slot = &slots[METRICS_MAX_THREADS];
+
+    return metrics_my_slot;
+}
+
+uint64_t
+metrics_read (enum metric m)
+{
+    uint64_t sum = 0;
+
+    for (int i = 0; i <= METRICS_MAX_THREADS; i++)
+        sum += atomic_load_explicit (&slots[i].counters[m],
+                                     memory_order_relaxed);
+
+    return sum;
+}
+
+int
+metrics_listen (const char *path)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      {
+        log_error ("socket failed");
+        return -1;
+      }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+
+    /* A socket left by a previous run would make bind fail */
+    unlink (path);
+    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+        listen (fd, 4) < 0)
+      {
+        log_error ("could not listen on metrics socket");
+        close (fd);
+        return -1;
+      }
+
+    return fd;
+}
+
+struct scrape {
+    char   *buf;
+    size_t len;
+    size_t size;
+    size_t dropped; /* Bytes of output that did not fit */
+};
+
+/* Only the metrics thread scrapes, the buffer is kept from one scrape to
+   the next and only grows */
+static struct scrape scrape;
+
+/* Make room for n more bytes and the terminating null. Returns non-zero if
+   the buffer can't grow that far */
+static int
+reserve (struct scrape *sc, size_t n)
+{
+    size_t size = sc->size;
+    char *buf;
+
+    while (size < sc->len + n + 1)
+        size *= 2;
+    if (size == sc->size)
+        return 0;
+    if (size > SCRAPE_MAX)
+        return 1;
+
+    buf = realloc (sc->buf, size);
+    if (buf == NULL)
+        return 1;
+    sc->buf = buf;
+    sc->size = size;
+
+    return 0;
+}
+
+/* Append formatted output, which is always whole lines. If it does not fit
+   none of it is kept, so a series is never cut in half */
+__attribute__ ((format (printf, 2, 3)))
+static void
+emit (struct scrape *sc, const char *fmt, ...)
+{
+    int n;
+    va_list ap;
+
+    va_start (ap, fmt);
+    n = vsnprintf (sc->buf + sc->len, sc->size - sc->len, fmt, ap);
+    va_end (ap);
+    if (n < 0)
+        return;
+
+    if ((size_t) n >= sc->size - sc->len)
+      {
+        if (reserve (sc, n) != 0)
+          {
+            sc->buf[sc->len] = '\0';
+            sc->dropped += n;
+            return;
+          }
+        va_start (ap, fmt);
+        vsnprintf (sc->buf + sc->len, sc->size - sc->len, fmt, ap);
+        va_end (ap);
+      }
+    sc->len += n;
+}
+
+static void
+emit_value (struct scrape *sc, const char *name, const char *type,
+            const char *help, uint64_t v)
+{
+    emit (sc, "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n", name, help,
+          name, type, name, v);
+}
+
+/* Filter counts and state machine statistics of every PIR zone */
+static void
+render_zones (struct scrape *sc, struct zones *zs)
+{
+    static const struct {
+        const char *name;
+        const char *help;
+    } families[] = {
+        { "fg_edges_accepted_total", "PIR edges passed to the zone" },
+        { "fg_edges_suppressed_total", "PIR edges over the rate limit or "
+                                       "repeating the level" },
+        { "fg_edges_glitch_total", "PIR edges shorter than the minimum "
+                                   "pulse" },
+        { "fg_zone_activations_total", "Times a zone went from idle to "
+                                       "high" },
+        { "fg_zone_triggers_total", "Motion accepted by the policy with "
+                                    "the zone active" },
+    };
+
+    for (size_t f = 0; f < sizeof (families) / sizeof (families[0]); f++)
+      {
+        emit (sc, "# HELP %s %s\n# TYPE %s counter\n", families[f].name,
+              families[f].help, families[f].name);
+        for (int i = 0; i < zs->n; i++)
+          {
+            struct zone *z = &zs->zone[i];
+            atomic_uint_fast64_t *v[] = {
+                &z->dev.filter.accepted,
+                &z->dev.filter.suppressed,
+                &z->dev.filter.glitches,
+                &z->stats.activations,
+                &z->stats.triggers,
+            };
+
+            emit (sc, "%s{zone=\"%s\"} %" PRIuFAST64 "\n", families[f].name,
+                  z->cfg->name, atomic_load (v[f]));
+          }
+      }
+
+    emit (sc, "# HELP fg_zone_active_seconds_total Time zones were high or "
+              "holding\n# TYPE fg_zone_active_seconds_total counter\n");
+    for (int i = 0; i < zs->n; i++)
+        emit (sc, "fg_zone_active_seconds_total{zone=\"%s\"} %.3f\n",
+              zs->zone[i].cfg->name,
+              zone_active_ns (&zs->zone[i], clock_now_ns ()) / 1E9);
+}
+
+static void
+render_cameras (struct scrape *sc, struct cameras *cams)
+{
+    static const char *const hook_names[HOOK_COUNT] = { "start", "stop" };
+
+    emit (sc, "# HELP fg_camera_recording 1 while picam reports recording\n"
+              "# TYPE fg_camera_recording gauge\n");
+    for (int i = 0; i < cams->n; i++)
+        emit (sc, "fg_camera_recording{camera=\"%s\"} %d\n",
+              cams->camera[i].cfg->name,
+              atomic_load (&cams->camera[i].state) == RECORD_RECORDING);
+
+    emit (sc, "# HELP fg_camera_hook_retries_total Hooks fired again for "
+              "want of an acknowledgement\n"
+              "# TYPE fg_camera_hook_retries_total counter\n");
+    for (int i = 0; i < cams->n; i++)
+        emit (sc, "fg_camera_hook_retries_total{camera=\"%s\"} %"
+                  PRIuFAST64 "\n", cams->camera[i].cfg->name,
+              atomic_load (&cams->camera[i].stats.retries));
+
+    emit (sc, "# HELP fg_camera_ack_timeouts_total Hooks given up on "
+              "without an acknowledgement\n"
+              "# TYPE fg_camera_ack_timeouts_total counter\n");
+    for (int i = 0; i < cams->n; i++)
+        emit (sc, "fg_camera_ack_timeouts_total{camera=\"%s\"} %"
+                  PRIuFAST64 "\n", cams->camera[i].cfg->name,
+              atomic_load (&cams->camera[i].stats.ack_timeouts));
+
+    emit (sc, "# HELP fg_camera_recording_seconds Length of recordings per "
+              "camera\n# TYPE fg_camera_recording_seconds summary\n");
+    for (int i = 0; i < cams->n; i++)
+      {
+        struct camera *cam = &cams->camera[i];
+
+        emit (sc, "fg_camera_recording_seconds_sum{camera=\"%s\"} %.3f\n"
+                  "fg_camera_recording_seconds_count{camera=\"%s\"} %"
+                  PRIuFAST64 "\n", cam->cfg->name,
+              atomic_load (&cam->stats.recorded_ms) / 1E3, cam->cfg->name,
+              atomic_load (&cam->stats.recordings));
+      }
+
+    emit (sc, "# HELP fg_camera_longest_recording_seconds Longest recording "
+              "per camera\n"
+              "# TYPE fg_camera_longest_recording_seconds gauge\n");
+    for (int i = 0; i < cams->n; i++)
+        emit (sc, "fg_camera_longest_recording_seconds{camera=\"%s\"} "
+                  "%.3f\n", cams->camera[i].cfg->name,
+              atomic_load (&cams->camera[i].stats.longest_ms) / 1E3);
+
+    emit (sc, "# HELP fg_hook_delivery_seconds Time to deliver a hook\n"
+              "# TYPE fg_hook_delivery_seconds summary\n");
+    for (int i = 0; i < cams->n; i++)
+        for (int j = 0; j < HOOK_COUNT; j++)
+          {
+            struct camera *cam = &cams->camera[i];
+            struct hook_stats *st = &cam->hooks.stats[j];
+
+            emit (sc, "fg_hook_delivery_seconds_sum{camera=\"%s\","
+                      "hook=\"%s\"} %.9f\n"
+                      "fg_hook_delivery_seconds_count{camera=\"%s\","
+                      "hook=\"%s\"} %" PRIuFAST64 "\n",
+                  cam->cfg->name, hook_names[j],
+                  atomic_load (&st->total_ns) / 1E9,
+                  cam->cfg->name, hook_names[j], atomic_load (&st->count));
+          }
+}
+
+static void
+render_recording (struct scrape *sc, struct recording *r)
+{
+    emit (sc, "# HELP fg_record_state 1 for the state the recording is in\n"
+              "# TYPE fg_record_state gauge\n");
+    for (int i = 0; i < RECORD_NSTATES; i++)
+        emit (sc, "fg_record_state{state=\"%s\"} %d\n",
+              record_state_name (i), (int) record_get_state (r) == i);
+
+    emit (sc, "# HELP fg_record_transition_seconds Time spent in a state "
+              "before leaving it\n"
+              "# TYPE fg_record_transition_seconds summary\n");
+    for (int i = 0; i < RECORD_NSTATES; i++)
+        for (int j = 0; j < RECORD_NSTATES; j++)
+          {
+            struct record_transition *t = &r->transitions[i][j];
+            uint_fast64_t count = atomic_load (&t->count);
+
+            if (count == 0)
+                continue;
+            emit (sc, "fg_record_transition_seconds_sum{from=\"%s\","
+                      "to=\"%s\"} %.6f\n"
+                      "fg_record_transition_seconds_count{from=\"%s\","
+                      "to=\"%s\"} %" PRIuFAST64 "\n",
+                  record_state_name (i), record_state_name (j),
+                  atomic_load (&t->total_ns) / 1E9,
+                  record_state_name (i), record_state_name (j), count);
+          }
+}
+
+/* Latest value of every sensor that has one */
+static void
+render_sensors (struct scrape *sc, struct sensor_store *store)
+{
+    struct SensorData sd;
+
+    sensors_read (store, &sd);
+
+    emit (sc, "# HELP fg_sensor Latest reading of a sensor\n"
+              "# TYPE fg_sensor gauge\n");
+    for (int i = 0; i < SENSOR_COUNT; i++)
+      {
+        const struct sensor_type *t = &sensor_types[i];
+
+        if (sd.present & (1U << i))
+            emit (sc, "fg_sensor{sensor=\"%s\"} %g\n", t->name,
+                  *sensor_slot (&sd, t));
+      }
+}
+
+/* Every thermal zone and the CPU frequency from the last sample */
+static void
+render_sampler (struct scrape *sc, struct sampler *sp)
+{
+    struct sampler_snapshot snap;
+
+    sampler_read (sp, &snap);
+
+    emit (sc, "# HELP fg_thermal_zone_celsius Temperature of a thermal "
+              "zone\n# TYPE fg_thermal_zone_celsius gauge\n");
+    for (int i = 0; i < snap.nzones; i++)
+        emit (sc, "fg_thermal_zone_celsius{thermal_zone=\"%d\"} %.1f\n", i,
+              snap.zone_temp[i] / 10.0);
+
+    if (snap.cpu_freq_khz != 0)
+        emit_value (sc, "fg_cpu_frequency_hertz", "gauge",
+                    "Current frequency of cpu0",
+                    snap.cpu_freq_khz * 1000ULL);
+}
+
+static void
+render (struct scrape *sc, struct thread_data *tdata)
+{
+    emit_value (sc, "fg_isr_total", "counter",
+                "Edges reported by the gpio backend",
+                metrics_read (METRIC_ISR));
+    emit_value (sc, "fg_fake_isr_total", "counter",
+                "Interrupts faked with SIGTSTP",
+                metrics_read (METRIC_FAKE_ISR));
+    emit_value (sc, "fg_timer_expirations_total", "counter",
+                "Hold timer expirations",
+                metrics_read (METRIC_TIMER_EXPIRATIONS));
+    emit_value (sc, "fg_recordings_started_total", "counter",
+                "Start hooks delivered",
+                metrics_read (METRIC_RECORDINGS_STARTED));
+    emit_value (sc, "fg_recordings_stopped_total", "counter",
+                "Stop hooks delivered",
+                metrics_read (METRIC_RECORDINGS_STOPPED));
+    emit (sc, "# HELP fg_recording_duration_seconds Length of recordings\n"
+              "# TYPE fg_recording_duration_seconds summary\n"
+              "fg_recording_duration_seconds_sum %.3f\n"
+              "fg_recording_duration_seconds_count %" PRIu64 "\n",
+          metrics_read (METRIC_RECORDING_MS_SUM) / 1000.0,
+          metrics_read (METRIC_RECORDING_COUNT));
+    emit_value (sc, "fg_inotify_events_total", "counter",
+                "State file events from picam",
+                metrics_read (METRIC_INOTIFY_EVENTS));
+    emit_value (sc, "fg_unlink_failures_total", "counter",
+                "State files that could not be removed",
+                metrics_read (METRIC_UNLINK_FAILURES));
+    emit_value (sc, "fg_state_files_gone_total", "counter",
+                "State file events finding the file already consumed",
+                metrics_read (METRIC_STATE_FILES_GONE));
+    emit_value (sc, "fg_inotify_overflows_total", "counter",
+                "Times the inotify queue overflowed",
+                metrics_read (METRIC_INOTIFY_OVERFLOWS));
+    emit_value (sc, "fg_state_dir_scans_total", "counter",
+                "State dirs read in full instead of through inotify",
+                metrics_read (METRIC_STATE_DIR_SCANS));
+    emit_value (sc, "fg_sensor_requests_total", "counter",
+                "Sensor data events handled",
+                metrics_read (METRIC_SENSOR_REQUESTS));
+    emit_value (sc, "fg_tsdb_points_dropped_total", "counter",
+                "Time series points lost to a full stage",
+                atomic_load (&tdata->tsdb.dropped));
+    emit_value (sc, "fg_poll_errors_total", "counter",
+                "Failed poll and epoll_wait calls",
+                metrics_read (METRIC_POLL_ERRORS));
+
+    render_zones (sc, &tdata->zones);
+    emit_value (sc, "fg_recordings_merged_total", "counter",
+                "Stops cancelled by motion in the grace window",
+                atomic_load (&tdata->merged_recordings));
+    emit_value (sc, "fg_recordings_split_total", "counter",
+                "Starts within the grace window after a stop",
+                atomic_load (&tdata->split_recordings));
+    emit_value (sc, "fg_picam_commands_total", "counter",
+                "Commands queued for the picam thread",
+                atomic_load (&tdata->picam_cmds.pushed));
+    emit_value (sc, "fg_picam_commands_dropped_total", "counter",
+                "Commands lost to a full queue",
+                atomic_load (&tdata->picam_cmds.dropped));
+    emit_value (sc, "fg_picam_command_queue_high_water", "gauge",
+                "Most commands waiting at once",
+                atomic_load (&tdata->picam_cmds.high_water));
+
+    emit_value (sc, "fg_recording", "gauge",
+                "1 while a recording is starting or running",
+                record_active (&tdata->recording));
+    emit_value (sc, "fg_hold_time_ms", "gauge",
+                "Hold time for the current hour",
+                holdtime_get_ms (&tdata->holdtime));
+
+    if (clock_is_virtual ())
+      {
+        emit (sc, "# HELP fg_clock_virtual_seconds Virtual time elapsed\n"
+                  "# TYPE fg_clock_virtual_seconds gauge\n"
+                  "fg_clock_virtual_seconds %.3f\n",
+              clock_virtual_elapsed_ns () / 1E9);
+        emit_value (sc, "fg_clock_idle", "gauge",
+                    "1 once no timer is left that moves virtual time",
+                    clock_virtual_idle ());
+      }
+
+    render_recording (sc, &tdata->recording);
+    render_cameras (sc, &tdata->cameras);
+    render_sensors (sc, &tdata->sensors);
+    render_sampler (sc, &tdata->sampler);
+
+    emit (sc, "# HELP fg_rt_jitter_seconds Timer lateness and edge dispatch "
+              "delay\n# TYPE fg_rt_jitter_seconds summary\n");
+    for (int i = 0; i < RT_NJITTER; i++)
+      {
+        struct histogram *h = rt_jitter_histogram (i);
+        const char *probe = rt_jitter_name (i);
+
+        emit (sc, "fg_rt_jitter_seconds{probe=\"%s\",quantile=\"0.5\"} "
+                  "%.6f\n", probe, hist_percentile (h, 50) / 1E6);
+        emit (sc, "fg_rt_jitter_seconds{probe=\"%s\",quantile=\"0.99\"} "
+                  "%.6f\n", probe, hist_percentile (h, 99) / 1E6);
+        emit (sc, "fg_rt_jitter_seconds{probe=\"%s\",quantile=\"1\"} "
+                  "%.6f\n", probe, atomic_load (&h->max) / 1E6);
+        emit (sc, "fg_rt_jitter_seconds_sum{probe=\"%s\"} %.6f\n", probe,
+              atomic_load (&h->sum) / 1E6);
+        emit (sc, "fg_rt_jitter_seconds_count{probe=\"%s\"} %" PRIuFAST64
+                  "\n", probe, atomic_load (&h->count));
+      }
+    emit_value (sc, "fg_rt_probe_overruns_total", "counter",
+                "Probe timer expirations missed entirely",
+                rt_jitter_overruns ());
+
+    emit (sc, "# HELP fg_motion_latency_seconds Motion to recording "
+              "latency per stage\n"
+              "# TYPE fg_motion_latency_seconds summary\n");
+    for (int i = 0; i < TRACE_NSTAGES; i++)
+      {
+        struct histogram *h = &tdata->trace.stages[i];
+        const char *stage = trace_stage_name (i);
+
+        emit (sc, "fg_motion_latency_seconds{stage=\"%s\",quantile=\"0.5\"}"
+                  " %.6f\n", stage, hist_percentile (h, 50) / 1E6);
+        emit (sc, "fg_motion_latency_seconds{stage=\"%s\",quantile=\"0.99\"}"
+                  " %.6f\n", stage, hist_percentile (h, 99) / 1E6);
+        emit (sc, "fg_motion_latency_seconds_sum{stage=\"%s\"} %.6f\n",
+              stage, atomic_load (&h->sum) / 1E6);
+        emit (sc, "fg_motion_latency_seconds_count{stage=\"%s\"} %"
+                  PRIuFAST64 "\n", stage, atomic_load (&h->count));
+      }
+}
+
+void
+metrics_handle_listen (int fd, void *arg)
+{
+    int client;
+    ssize_t s;
+    size_t off;
+    struct scrape *sc = &scrape;
+
+    if (sc->buf == NULL)
+      {
+        sc->buf = malloc (SCRAPE_INITIAL);
+        if (sc->buf == NULL)
+          {
+            log_error ("malloc failed for scrape");
+            return;
+          }
+        sc->size = SCRAPE_INITIAL;
+      }
+
+    /* Clients are served one at a time on this thread, which never runs
+       on the motion path */
+    while ((client = accept4 (fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+      {
+        sc->len = 0;
+        sc->dropped = 0;
+        render (sc, arg);
+        if (sc->dropped > 0)
+          {
+            log_error_en (ENOBUFS, "scrape too large, series dropped");
+            _log_debug ("%zu bytes did not fit in %d\n", sc->dropped,
+                        SCRAPE_MAX);
+          }
+
+        for (off = 0; off < sc->len; off += s)
+          {
+            s = write (client, sc->buf + off, sc->len - off);
+            if (s < 0)
+              {
+                log_error ("write to metrics client failed");
+                break;
+              }
+          }
+        close (client);
+      }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_error ("accept4 failed");
+}
+
+void
+metrics_close (int fd, const char *path)
+{
+    if (fd < 0)
+        return;
+
+    close (fd);
+    unlink (path);
+    free (scrape.buf);
+    scrape.buf = NULL;
+}
+
+/* Start routine for metrics thread */
+void *
+thread_metrics_start (void *arg)
+{
+    ssize_t s, events;
+    struct thread_data *tdata = arg;
+    struct pollfd poll_fds[2];
+
+    memset (&poll_fds, 0, sizeof (poll_fds));
+
+    poll_fds[0].fd = tdata->metrics_fd;
+    poll_fds[0].events = events = POLLIN | POLLPRI;
+
+    poll_fds[1] = poll_fds[0];
+    poll_fds[1].fd = tdata->timerpipe[0];
+
+    while (1)
+      {
+        /* Passing -1 to poll as third argument means to block (INFTIM) */
+        s = poll (poll_fds, 2, -1);
+
+        if (s < 0)
+          {
+            log_error ("poll failed");
+            metrics_inc (METRIC_POLL_ERRORS);
+          }
+        else if (s > 0)
+          {
+            /* If there is data to read on timerpipe, we shall exit */
+            if (poll_fds[1].revents & events)
+                break;
+
+            if (poll_fds[0].revents & events)
+                metrics_handle_listen (tdata->metrics_fd, tdata);
+          }
+      }
+
+    return NULL;
+}
@@ -0,0 +1,96 @@
+/*
+ *  metrics.h
+ *    Counters kept per thread and served in Prometheus text format
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Threads that get a slot of their own, any more share one extra slot */
+#define METRICS_MAX_THREADS 16
+
+enum metric {
+    METRIC_ISR,                 /* Edges reported by the gpio backend */
+    METRIC_FAKE_ISR,
+    METRIC_TIMER_EXPIRATIONS,
+    METRIC_RECORDINGS_STARTED,
+    METRIC_RECORDINGS_STOPPED,
+    METRIC_RECORDING_MS_SUM,    /* Length of recordings picam reported */
+    METRIC_RECORDING_COUNT,
+    METRIC_INOTIFY_EVENTS,
+    METRIC_UNLINK_FAILURES,
+    METRIC_STATE_FILES_GONE,    /* Events for a file already consumed */
+    METRIC_INOTIFY_OVERFLOWS,
+    METRIC_STATE_DIR_SCANS,     /* Startup, overflow and recreated dir */
+    METRIC_SENSOR_REQUESTS,
+    METRIC_POLL_ERRORS,
+    METRIC_COUNT
+};
+
+/* Counters of one thread, written only by it except for the shared slot.
+   Aligned so that no two threads write the same cache line */
+struct metrics_slot {
+    atomic_bool          in_use;
+    atomic_uint_fast64_t counters[METRIC_COUNT];
+} __attribute__ ((aligned (64)));
+
+extern __thread struct metrics_slot *metrics_my_slot;
+
+/* Claim a slot for the calling thread, never returns NULL */
+extern struct metrics_slot *metrics_claim_slot (void);
+
+/* Add n to metric m, a relaxed add to a line only this thread writes */
+static inline void
+metrics_add (enum metric m, uint64_t n)
+{
+    struct metrics_slot *slot = metrics_my_slot;
+
+    if (slot == NULL)
+        slot = metrics_claim_slot ();
+    atomic_fetch_add_explicit (&slot->counters[m], n, memory_order_relaxed);
+}
+
+static inline void
+metrics_inc (enum metric m)
+{
+    metrics_add (m, 1);
+}
+
+/* Sum of m over every slot */
+extern uint64_t metrics_read (enum metric);
+
+/* Listen on a unix socket at path, returns the fd or -1 */
+extern int metrics_listen (const char *);
+
+/* Accept pending clients on the listening fd and write each a scrape,
+   argument is struct thread_data for the gauges. Only called from the
+   metrics thread */
+extern void metrics_handle_listen (int, void *);
+
+extern void metrics_close (int, const char *);
+
+/* Start routine for the thread serving scrapes, also in reactor mode */
+extern void *thread_metrics_start (void *);
+
+#endif /* _METRICS_H_ */
@@ -23,59 +23,153 @@
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/timerfd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
 
-#include <wiringPi/wiringPi.h>
-
 #include "motion.h"
+#include "picam_state.h"
+#include "holdtime.h"
+#include "zones.h"
+#include "metrics.h"
+#include "status.h"
+#include "clock.h"
 #include "common.h"
 #include "log.h"
 
 /* Forward declarations used in this file. */
-static int reset_timer (struct thread_data *, const int, const int);
+static int reset_timer (struct thread_data *, uint32_t);
+static void handle_motion (struct thread_data *, int, enum cmd_source,
+                           uint32_t, uint64_t);
+
+/* Callback for a batch of edges in one of the PIR zones (see zones.c).
+   trigger means the zone policy accepts the motion as a reason to record,
+   any other edge keeps an ongoing recording alive. The cameras mapped to
+   the active zones are the ones started */
+void
+on_zones_motion (void *arg, bool trigger, uint32_t active, uint64_t edge_ns)
+{
+    struct thread_data *tdata = arg;
 
-/* Callback function for interrupts on pin numbered as PIR_PIN (see core.c) */
+    handle_motion (tdata, trigger, CMD_SOURCE_ZONES, active, edge_ns);
+}
+
+/* Used to fake an interrupt, see handle_sig in core.c */
 void
 on_motion_detect (void *arg)
 {
-    int b;
-    ssize_t s;
-    uint64_t u;
     struct thread_data *tdata = arg;
 
-    pthread_mutex_lock (&tdata->wiring_mutex);
-    b = digitalRead (tdata->pir_pin) == HIGH;
-    pthread_mutex_unlock (&tdata->wiring_mutex);
+    _log_debug ("isr %s\n", atomic_load (&tdata->fake_isr) ? "fake" : "none");
+    metrics_inc (METRIC_FAKE_ISR);
+    handle_motion (tdata, 0, CMD_SOURCE_FAKE_ISR, CAMERA_ALL_ZONES,
+                   gpio_now_ns ());
+}
+
+/* Motion during a grace window keeps the recording going, count it as a
+   merged recording */
+static void
+end_grace_window (struct thread_data *tdata)
+{
+    if (atomic_compare_exchange_strong (&tdata->in_grace, (_Bool[])
+        { true }, false))
+      {
+        atomic_fetch_add_explicit (&tdata->merged_recordings, 1,
+                                   memory_order_relaxed);
+        _log_debug ("motion during grace window, recording continues\n");
+      }
+}
+
+/* Start recording the cameras of zones on motion, otherwise keep an
+   ongoing recording alive. edge_ns is when the motion was seen, the start
+   of the latency trace. Nothing here blocks, the picam thread does the
+   rest from its command queue */
+static void
+handle_motion (struct thread_data *tdata, int b, enum cmd_source source,
+               uint32_t zones, uint64_t edge_ns)
+{
+    ssize_t s;
+    struct cmd cmd;
+
+    memset (&cmd, 0, sizeof (cmd));
+    cmd.source = source;
+    cmd.zones = zones;
+    cmd.cameras = cameras_for_zones (&tdata->cameras, zones);
+    cmd.trigger_ns = edge_ns;
 
-    _log_debug ("isr %s\n", atomic_load (&tdata->fake_isr) ? "fake" : b ?
-                                                                  "rising" :
-                                                                  "falling");
-    if (b || atomic_compare_exchange_weak (&tdata->fake_isr, (_Bool[])
-             { true }, false))
+    /* Motion only in zones no camera is mapped to starts nothing */
+    if ((b && cmd.cameras != 0) ||
+        atomic_compare_exchange_weak (&tdata->fake_isr, (_Bool[])
+            { true }, false))
       {
-        reset_timer (tdata, 5, 0);
-        if (atomic_compare_exchange_weak (&tdata->is_recording, (_Bool[])
-            { false }, true))
+        end_grace_window (tdata);
+        reset_timer (tdata, holdtime_get_ms (&tdata->holdtime));
+        if (record_get_state (&tdata->recording) == RECORD_IDLE &&
+            atomic_compare_exchange_strong (&tdata->recording.start_queued,
+                                            (_Bool[]) { false }, true))
           {
+            /* A start soon after a stop is a visit the grace window did not
+               cover */
+            if (COALESCE_GRACE_MS > 0 &&
+                gpio_now_ns () - atomic_load (&tdata->last_stop_ns) <=
+                (uint64_t) COALESCE_GRACE_MS * 1000000)
+                atomic_fetch_add_explicit (&tdata->split_recordings, 1,
+                                           memory_order_relaxed);
+
             /* Send start recording event */
-            pthread_mutex_lock (&tdata->record_mutex);        
-            u = 1;
-            s = write (tdata->record_eventfd, &u, sizeof (uint64_t));
-            if (s < 0)
-              {
-                log_error ("write failed");
-                atomic_store (&tdata->is_recording, false);
-              }
-            pthread_mutex_unlock (&tdata->record_mutex);
+            trace_begin (&tdata->trace, edge_ns);
+            cmd.type = CMD_START;
+            s = picam_send (tdata, &cmd);
+            if (s != 0)
+                atomic_store (&tdata->recording.start_queued, false);
+            else
+                trace_mark (&tdata->trace, TRACE_SIGNALLED);
+          }
+        else
+          {
+            /* Cameras of zones that had no motion yet join the recording,
+               which then stops for all of them together. Until the picam
+               thread has seen the start this may ask again, which it
+               ignores */
+            cmd.cameras &= ~atomic_load (&tdata->recording.cameras);
+            cmd.type = CMD_EXTEND;
+            if (cmd.cameras != 0)
+                picam_send (tdata, &cmd);
           }
       }
-    else if (atomic_load (&tdata->is_recording))
-        reset_timer (tdata, 5, 0);
+    else if (record_active (&tdata->recording))
+      {
+        end_grace_window (tdata);
+        reset_timer (tdata, holdtime_get_ms (&tdata->holdtime));
+      }
+
+    /* Off the path to the start hook */
+    if (b)
+        status_motion (tdata->status, zones);
+}
+
+/* Called when the hold timer expires with PIR low. The first expiry opens
+   a grace window of COALESCE_GRACE_MS instead of stopping, motion within
+   it cancels the stop. Returns 1 if the stop is deferred, 0 if recording
+   should stop now */
+int
+motion_defer_stop (struct thread_data *tdata)
+{
+    if (COALESCE_GRACE_MS > 0 &&
+        !atomic_compare_exchange_strong (&tdata->in_grace, (_Bool[])
+            { true }, false))
+      {
+        atomic_store (&tdata->in_grace, true);
+        _log_debug ("deferring stop for %d ms\n", COALESCE_GRACE_MS);
+        reset_timer (tdata, COALESCE_GRACE_MS);
+        return 1;
+      }
+
+    atomic_store (&tdata->last_stop_ns, gpio_now_ns ());
+
+    return 0;
 }
 
 /* Function to reset timer if PIR sensor is still HIGH */
@@ -84,38 +178,22 @@ check_sensor_active (struct thread_data *tdata)
 {
     int b;
 
-    pthread_mutex_lock (&tdata->wiring_mutex);
-    b = digitalRead (tdata->pir_pin) == HIGH;
-    pthread_mutex_unlock (&tdata->wiring_mutex);
+    b = zones_high (&tdata->zones);
     if (b != 0)
-        reset_timer (tdata, 5, 0);
+      {
+        end_grace_window (tdata);
+        reset_timer (tdata, holdtime_get_ms (&tdata->holdtime));
+      }
 
     return b;
 }
 
-/* Helper function to set timerfd to a specified timer value */
+/* Helper function to set timerfd to expire once after ms milliseconds */
 static int
-reset_timer(struct thread_data *tdata, const int secs, const int isecs)
+reset_timer(struct thread_data *tdata, uint32_t ms)
 {
-  ssize_t s;
-  struct itimerspec timer_value;
-
-  _log_debug ("resetting timer (is_recording = %s)\n",
-              atomic_load (&tdata->is_recording) ? "true" : "false");
-
-  /*
-   * Set timer_value to a delay of secs seconds, if isecs is set to a
-   * value > 0 this timer will be recurring
-   */
-  memset (&timer_value, 0, sizeof(timer_value));
-  timer_value.it_value.tv_sec = secs;
-  timer_value.it_value.tv_nsec = 0;
-  timer_value.it_interval.tv_sec = isecs;
-  timer_value.it_interval.tv_nsec = 0;
-  
-  s = timerfd_settime (tdata->timerfd, 0, &timer_value, NULL);
-  if (s < 0)
-    log_error ("timerfd_settime failed");    
-
-  return s;
-}
\ No newline at end of file
+  _log_debug ("resetting timer to %" PRIu32 " ms (recording is %s)\n", ms,
+              record_state_name (record_get_state (&tdata->recording)));
+
+  return clock_timer_arm_ms (tdata->timerfd, ms);
+}
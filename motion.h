@@ -26,10 +26,16 @@
 
 #include "common.h"
 
-/* This function is invoked by core as the timer thread is created */
+/* Callback registered with the PIR zones, see zones_cb */
+extern void on_zones_motion (void *, bool, uint32_t, uint64_t);
+
+/* Used to raise a fake interrupt when SIGTSTP is received */
 extern void on_motion_detect (void *);
 
-/* This function is used to reset timerfd if PIR sensor is still HIGH */
+/* Returns 1 if a stop is deferred to a grace window, 0 to stop now */
+extern int motion_defer_stop (struct thread_data *);
+
+/* This function is used to reset timerfd if a PIR sensor is still HIGH */
 extern int check_sensor_active (struct thread_data *tdata);
 
 #endif /* _MOTION_H_ */
\ No newline at end of file
@@ -22,68 +22,154 @@
  */
 
 #include <stdint.h>
+#include <time.h>
 
 #include "network.h"
+#include "history.h"
+#include "sensors.h"
+#include "metrics.h"
+#include "rt.h"
 #include "common.h"
 #include "log.h"
 #include "core.h"
 
+/* Decode readings through the sensor registry and answer with the values
+   just received plus those measured by core */
 static void
 handle_sensor_event (struct thread_data *tdata, struct fgevent *fgev,
                      struct fgevent *ansev)
 {
+    uint32_t mask;
+    int64_t now_ms;
+    struct SensorData sd;
+
+    metrics_inc (METRIC_SENSOR_REQUESTS);
+
     ansev->id = FG_SENSOR_DATA;
     ansev->receiver = FG_DATALOGGER;
     ansev->writeback = 0;
-    ansev->length = 10;
+    ansev->length = 0;
+
+    ansev->payload = malloc (sizeof (int32_t) * SENSOR_COUNT * 2);
+    if (ansev->payload == NULL)
+      {
+        log_error ("malloc failed for sensor answer");
+        return;
+      }
+
+    /* Readers of the store never wait for the version published here */
+    sensors_write_begin (&tdata->sensors, &sd);
+    read_cpu_temp (tdata, &sd);
+    mask = sensors_decode (&sd, fgev->payload, fgev->length);
+    sensors_write_end (&tdata->sensors, &sd);
+
+    /* Read the answer back through the seqlock. It retries until it copies
+       one whole published version, ours or a newer one from another
+       connection, never a mix of the two */
+    sensors_read (&tdata->sensors, &sd);
+    mask |= sensors_local_mask ();
+    ansev->length = sensors_encode (&sd, mask, ansev->payload);
+
+    /* Every pair of the answer is a new reading */
+    now_ms = tsdb_now_ms ();
+    for (int i = 0; i < ansev->length; i += 2)
+      {
+        const struct sensor_type *t = sensors_lookup (ansev->payload[i]);
+
+        if (tdata->history)
+            history_add (tdata->history, t->id, now_ms / 1000,
+                         ansev->payload[i + 1]);
+        tsdb_append (&tdata->tsdb, t->series, now_ms,
+                     ansev->payload[i + 1]);
+      }
+}         
+
+/* Answer aggregates over a time range from the sensor history. The request
+   payload holds triples of sensor type, from and to (seconds since epoch),
+   the answer holds type, count, min, max and mean for each triple */
+static int
+handle_history_event (struct thread_data *tdata, struct fgevent *fgev,
+                      struct fgevent *ansev)
+{
+    int n;
+    struct history_aggregate agg;
+
+    if (tdata->history == NULL || fgev->length < 3)
+        return 0;
+
+    n = fgev->length / 3;
+
+    ansev->id = FG_SENSOR_HISTORY;
+    ansev->receiver = FG_DATALOGGER;
+    ansev->writeback = 0;
+    ansev->length = n * 5;
 
     ansev->payload = malloc (sizeof (int32_t) * ansev->length);
+    if (ansev->payload == NULL)
+      {
+        log_error ("malloc failed for history answer");
+        return 0;
+      }
+
+    for (int i = 0; i < n; i++)
+      {
+        int32_t *q = &fgev->payload[i * 3];
+        int32_t *a = &ansev->payload[i * 5];
 
-    memset (ansev->payload, 0, sizeof (int32_t) * ansev->length);
+        history_query (tdata->history, q[0], q[1], q[2], &agg);
+        a[0] = q[0];
+        a[1] = agg.count;
+        a[2] = (int32_t) agg.min;
+        a[3] = (int32_t) agg.max;
+        a[4] = (int32_t) agg.mean;
+      }
 
-    read_cpu_temp (tdata);
+    return 1;
+}
 
-    pthread_mutex_lock (&tdata->sensor_mutex);
-    if (fgev->length > 0)
+/* Answer the motion to recording latency histograms. The answer holds
+   stage, count, p50, p90, p99 and max in microseconds for each stage in
+   the order of struct trace, the last stage being the total */
+static int
+handle_latency_event (struct thread_data *tdata, struct fgevent *ansev)
+{
+    ansev->id = FG_LATENCY;
+    ansev->receiver = FG_DATALOGGER;
+    ansev->writeback = 0;
+    ansev->length = TRACE_NSTAGES * 6;
+
+    ansev->payload = malloc (sizeof (int32_t) * ansev->length);
+    if (ansev->payload == NULL)
       {
-        if (fgev->payload[0] == OUTTEMP)
-          {
-            tdata->sensor_data.outtemp = fgev->payload[1];
-            ansev->payload[0] = OUTTEMP;
-            ansev->payload[1] = fgev->payload[1];
-          }
-        if (fgev->payload[2] == INTEMP)
-          {
-            tdata->sensor_data.intemp = fgev->payload[3];
-            ansev->payload[2] = INTEMP;
-            ansev->payload[3] = fgev->payload[3];
-          }
-        if (fgev->payload[4] == PRESSURE)
-          {
-            tdata->sensor_data.pressure = fgev->payload[5];
-            ansev->payload[4] = PRESSURE;
-            ansev->payload[5] = fgev->payload[5];
-          }
-        if (fgev->payload[6] == HUMIDITY)
-          {
-            tdata->sensor_data.humidity = fgev->payload[7];
-            ansev->payload[6] = HUMIDITY;
-            ansev->payload[7] = fgev->payload[7];
-          }
+        log_error ("malloc failed for latency answer");
+        return 0;
       }
 
-    ansev->payload[8] = CPUTEMP;
-    ansev->payload[9] = (int32_t) tdata->sensor_data.cputemp;
-    pthread_mutex_unlock (&tdata->sensor_mutex);
-}         
+    for (int i = 0; i < TRACE_NSTAGES; i++)
+      {
+        struct histogram *h = &tdata->trace.stages[i];
+        int32_t *a = &ansev->payload[i * 6];
+
+        a[0] = i;
+        a[1] = (int32_t) atomic_load (&h->count);
+        a[2] = (int32_t) hist_percentile (h, 50);
+        a[3] = (int32_t) hist_percentile (h, 90);
+        a[4] = (int32_t) hist_percentile (h, 99);
+        a[5] = (int32_t) atomic_load (&h->max);
+      }
+
+    return 1;
+}
 
 /* Returns 1 on should writeback; 0 if not*/
 int
 fg_handle_event (void *arg, struct fgevent *fgev, struct fgevent *ansev)
 {
-    int i;
     struct thread_data *tdata = arg;
 
+    /* fgevents creates the thread calling us */
+    rt_enter (RT_THREAD_EVENTS);
+
     /* Handle error in fgevent */
     if (fgev == NULL)
       {
@@ -93,10 +179,14 @@ fg_handle_event (void *arg, struct fgevent *fgev, struct fgevent *ansev)
 
     switch (fgev->id)
       {
-        case FG_SENSOR_DATA: /* TODO: consider creating a translation system for this event */
+        case FG_SENSOR_DATA:
           handle_sensor_event (tdata, fgev, ansev);
           return 1;          
           break;
+        case FG_SENSOR_HISTORY:
+          return handle_history_event (tdata, fgev, ansev);
+        case FG_LATENCY:
+          return handle_latency_event (tdata, ansev);
         default:
           _log_debug ("eventid: %d\n", fgev->id);
           break;                                                          
@@ -28,6 +28,10 @@
 
 #include <serializer.h>
 
+/* Events handled by core that are not part of fgevents yet */
+#define FG_SENSOR_HISTORY 100
+#define FG_LATENCY 101
+
 /* Implements fg_handle_event_cb from fgevents */
 extern int fg_handle_event (void *, struct fgevent *, struct fgevent *);
 
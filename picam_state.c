@@ -29,115 +29,107 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdatomic.h>
 #include <sys/inotify.h>
 #include <poll.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <limits.h>
 
 #include "picam_state.h"
-#include "touch.h"
+#include "hooks.h"
+#include "metrics.h"
+#include "status.h"
+#include "clock.h"
 #include "common.h"
 #include "log.h"
 
-/* Read for inotify fd requires a buffer, we approximate the size */
-#define BUF_LEN (10 * (sizeof (struct inotify_event) + 32 + 1))
-
-/* Used internally by thread to store allocated resources  */
-struct internal_t_data {    
-    _Bool       watch_state_enabled;
-    char        *dir;
-    char        *path;
-    char        *content;
-    int         wd;
-    FILE        *fp;
-    atomic_bool *is_recording;
-    int         inotify_fd;
-    size_t      dir_strlen;
-    int         poll_fds_len;
-    char        *picam_start_hook;
-    char        *picam_stop_hook;
-    uint32_t    inotify_mask;
-    struct      timespec start;
-    struct      timespec end;
-    struct      stat st;
-    struct      pollfd poll_fds[3];
-};
+/* Enough for a few hundred events with picam's short state file names */
+#define INOTIFY_BUF_LEN 8192
+
+/* State files hold a single word such as "true" or "false" */
+#define STATE_FILE_MAX 64
 
 /* Forward declarations used in this file. */
 static void cleanup_handler (void *);
 
-static void handle_state_file_created (struct internal_t_data *);
-static void handle_state_file (struct internal_t_data *, const char *,
-                               const char *);
-static void handle_record_event (struct internal_t_data *, const uint64_t);
+static void handle_state_file_created (struct picam_data *);
+static void handle_state_file (struct picam_data *, struct camera *,
+                               const char *, const char *);
+static void handle_cmd (struct picam_data *, const struct cmd *);
+static void start_cameras (struct picam_data *, uint32_t);
+static void stop_cameras (struct picam_data *, uint32_t);
+static void update_state (struct picam_data *);
+static int fire_hook (struct camera *, enum hook);
 
-static int setup_inotify (struct internal_t_data *);
+static int setup_watch (struct picam_data *, struct camera *);
+static int setup_parent_watch (struct picam_data *, struct camera *);
+static void drop_watch (struct picam_data *, struct camera *);
+static void scan_state_dir (struct picam_data *, struct camera *);
 
 /* Start routine for picam thread */
 void *
 thread_picam_start (void *arg)
 {
     ssize_t s, events;
-    uint64_t u;
     struct thread_data *tdata = arg;
-    struct internal_t_data itdata;
+    struct picam_data itdata;
+    struct pollfd poll_fds[4];
 
     pthread_setcanceltype (PTHREAD_CANCEL_DEFERRED, NULL);
     pthread_cleanup_push (&cleanup_handler, &itdata);
 
-    memset (&itdata, 0, sizeof (itdata));
-
-    /* TODO: add these values to a config file */
-    asprintf (&itdata.dir, PICAM_STATE_DIR);
-    asprintf (&itdata.picam_start_hook, PICAM_START_HOOK);
-    asprintf (&itdata.picam_stop_hook, PICAM_STOP_HOOK);
-    itdata.dir_strlen = strlen(itdata.dir);
+    /* Hooks still fire without inotify, only picam's answers are lost */
+    s = picam_state_init (&itdata, tdata);
+    if (s != 0)
+        log_error ("picam state will not be seen");
 
-    itdata.is_recording = &tdata->is_recording;
-    s = setup_inotify (&itdata);
-    itdata.watch_state_enabled = (_Bool) s >= 0;
+    memset (&poll_fds, 0, sizeof (poll_fds));
 
-    memset (&itdata.poll_fds, 0, sizeof (itdata.poll_fds));
+    poll_fds[0].fd = itdata.inotify_fd;
+    poll_fds[0].revents = 0;
+    poll_fds[0].events = events = POLLIN | POLLPRI;
 
-    itdata.poll_fds[itdata.poll_fds_len].fd = itdata.inotify_fd;
-    itdata.poll_fds[itdata.poll_fds_len].revents = 0;
-    itdata.poll_fds[itdata.poll_fds_len++].events = events = POLLIN | POLLPRI;
+    poll_fds[1] = poll_fds[0];
+    poll_fds[1].fd = tdata->timerpipe[0];
 
-    itdata.poll_fds[itdata.poll_fds_len] = itdata.poll_fds[0];
-    itdata.poll_fds[itdata.poll_fds_len++].fd = tdata->timerpipe[0];
+    poll_fds[2] = poll_fds[0];
+    poll_fds[2].fd = tdata->record_eventfd;
 
-    itdata.poll_fds[itdata.poll_fds_len] = itdata.poll_fds[0];
-    itdata.poll_fds[itdata.poll_fds_len++].fd = tdata->record_eventfd;
+    poll_fds[3] = poll_fds[0];
+    poll_fds[3].fd = itdata.ack_timerfd;
 
     while (1)
       {
         /* Passing -1 to poll as third argument means to block (INFTIM) */
-        s = poll (itdata.poll_fds, 3, -1);
+        s = poll (poll_fds, 4, -1);
 
         if (s < 0)
+          {
             log_error ("poll failed");
+            metrics_inc (METRIC_POLL_ERRORS);
+          }
         else if (s > 0)
           {
-            if (itdata.poll_fds[1].revents & events)
+            if (poll_fds[1].revents & events)
               {
                 break;
               }
             else
               {
-                if (itdata.poll_fds[0].revents & events)
+                if (poll_fds[0].revents & events)
                   {
-                    handle_state_file_created (&itdata);                
+                    picam_handle_inotify (&itdata);
                   }
-                if (itdata.poll_fds[2].revents & events)
+                if (poll_fds[2].revents & events)
                   {
-                    pthread_mutex_lock (&tdata->record_mutex);
-                    s = read (itdata.poll_fds[2].fd, &u, sizeof (uint64_t));
-                    if (s < 0)
-                        log_error ("read failed");
-                    pthread_mutex_unlock (&tdata->record_mutex);
-                    handle_record_event (&itdata, u);
-                  }                
+                    picam_handle_record_eventfd (&itdata);
+                  }
+                if (poll_fds[3].revents & events)
+                  {
+                    picam_handle_ack_timer (&itdata);
+                  }
               }
           }
       }
@@ -148,201 +140,793 @@ thread_picam_start (void *arg)
     return NULL;
 }
 
-/* When there is a inotify event to be read */
-static void
-handle_state_file_created (struct internal_t_data *itdata)
+/* Setup the inotify watches on the state dir of every camera */
+int
+picam_state_init (struct picam_data *itdata, struct thread_data *tdata)
 {
-    ssize_t s, nbytes;
-    char buf[BUF_LEN] __attribute__ ((aligned(8)));
-    
-    nbytes = read (itdata->inotify_fd, buf, BUF_LEN);
-    if (nbytes < 0)
+    ssize_t s;
+
+    memset (itdata, 0, sizeof (*itdata));
+    itdata->tdata = tdata;
+    itdata->cameras = &tdata->cameras;
+    itdata->inotify_mask = IN_CLOSE_WRITE;
+
+    /* Without it hooks are never retried, which is all that is lost */
+    itdata->ack_timerfd = clock_timer_create ();
+    if (itdata->ack_timerfd < 0)
+        log_error ("could not create ack timer");
+
+    s = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (s < 0)
+      {
+        log_error ("inotify_init1 failed");
+        itdata->inotify_fd = -1;
+        return 1;
+      }
+    itdata->inotify_fd = (int) s;
+
+    /* A camera without a watch still gets its hooks. Files picam wrote
+       before the watch existed are picked up by the scan, so core knows
+       if it is already recording */
+    for (int i = 0; i < itdata->cameras->n; i++)
+      {
+        struct camera *cam = &itdata->cameras->camera[i];
+
+        setup_parent_watch (itdata, cam);
+        if (setup_watch (itdata, cam) == 0)
+          {
+            itdata->watch_state_enabled = true;
+            scan_state_dir (itdata, cam);
+          }
+      }
+
+    /* Not an error, the parent watch sees the dirs created later */
+    if (!itdata->watch_state_enabled)
+        _log_debug ("no state dir watched yet\n");
+
+    return 0;
+}
+
+/* Called when the inotify fd is readable */
+void
+picam_handle_inotify (struct picam_data *itdata)
+{
+    handle_state_file_created (itdata);
+}
+
+/* Called when record_eventfd is readable. The eventfd is only a doorbell,
+   every command queued before the producer rang it is handled here */
+void
+picam_handle_record_eventfd (struct picam_data *itdata)
+{
+    ssize_t s;
+    uint64_t u;
+    struct cmd cmd;
+    struct thread_data *tdata = itdata->tdata;
+
+    s = read (tdata->record_eventfd, &u, sizeof (uint64_t));
+    if (s < 0 && errno != EAGAIN)
         log_error ("read failed");
-    else if (nbytes == 0)
+
+    while (cmdq_pop (&tdata->picam_cmds, &cmd))
+        handle_cmd (itdata, &cmd);
+}
+
+/* Called when ack_timerfd expires. A camera starting or stopping past its
+   deadline gets its hook again, up to RECORD_HOOK_RETRIES times, and is
+   then taken for idle */
+void
+picam_handle_ack_timer (struct picam_data *itdata)
+{
+    ssize_t s;
+    uint64_t u, now;
+    struct recording *r = &itdata->tdata->recording;
+
+    s = read (itdata->ack_timerfd, &u, sizeof (uint64_t));
+    if (s < 0)
       {
-        log_error ("read from inotify fd returned 0");
+        /* EAGAIN means the timer was re-armed after it expired */
+        if (errno != EAGAIN)
+            log_error ("read failed");
         return;
       }
-    for (char *p = buf; p < buf + nbytes;)
+
+    itdata->ack_armed_ns = 0;
+    now = clock_now_ns ();
+    for (int i = 0; i < itdata->cameras->n; i++)
       {
-        struct inotify_event *event = (struct inotify_event *) p;
-        if (event->len && event->mask & itdata->inotify_mask &&
-            !(event->mask & IN_ISDIR)) /* Ignore all directories */
+        struct camera *cam = &itdata->cameras->camera[i];
+        enum record_state state = atomic_load (&cam->state);
+
+        if ((state != RECORD_STARTING && state != RECORD_STOPPING) ||
+            cam->deadline_ns > now)
+            continue;
+
+        if (cam->attempts <= RECORD_HOOK_RETRIES)
           {
-            /* We add 2 bytes for the delimiter and nul-terminator */
-            int path_len = itdata->dir_strlen + strlen (event->name) + 2;
-            itdata->path = malloc (path_len);
-            if (itdata->path == NULL)
-              log_error ("malloc for file path failed");
-            else
+            _log_debug ("no acknowledgement from %s, %s hook again\n",
+                        cam->cfg->name,
+                        state == RECORD_STARTING ? "start" : "stop");
+            atomic_fetch_add_explicit (&cam->stats.retries, 1,
+                                       memory_order_relaxed);
+            s = fire_hook (cam, state == RECORD_STARTING ? HOOK_START :
+                                                           HOOK_STOP);
+            if (s == 0)
+                continue;
+          }
+
+        log_error_en (ETIMEDOUT, "picam did not acknowledge hook");
+        atomic_fetch_add_explicit (&cam->stats.ack_timeouts, 1,
+                                   memory_order_relaxed);
+        atomic_fetch_and (&r->cameras, ~(1U << i));
+        atomic_store (&cam->state, RECORD_IDLE);
+      }
+
+    update_state (itdata);
+}
+
+int
+picam_send (struct thread_data *tdata, const struct cmd *cmd)
+{
+    ssize_t s;
+    uint64_t u = 1;
+
+    s = cmdq_push (&tdata->picam_cmds, cmd);
+    if (s != 0)
+      {
+        log_error_en (ENOBUFS, "picam command queue full");
+        return 1;
+      }
+
+    /* Instead of using a pthread condition variable we use a eventfd
+       object to notify other threads because we can then poll on multiple
+       file descriptors. The command is queued either way and handled with
+       the next one if this fails */
+    s = write (tdata->record_eventfd, &u, sizeof (uint64_t));
+    if (s < 0)
+        log_error ("write failed");
+
+    return 0;
+}
+
+/* Release resources allocated by picam_state_init */
+void
+picam_state_cleanup (struct picam_data *itdata)
+{
+    cleanup_handler (itdata);
+}
+
+/* Read a state file relative to the camera's state dir into content, which
+   holds STATE_FILE_MAX bytes, and unlink it straight away so that the next
+   write from picam makes a new file and event. Returns NULL if it could not
+   be read */
+static const char *
+consume_state_file (struct camera *cam, const char *name, char *content)
+{
+    int fd;
+    ssize_t s, nbytes;
+
+    fd = openat (cam->dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      {
+        /* picam wrote it again before the file was read, which read the
+           newest state already */
+        if (errno == ENOENT)
+          {
+            _log_debug ("%s: state file %s already consumed\n",
+                        cam->cfg->name, name);
+            metrics_inc (METRIC_STATE_FILES_GONE);
+          }
+        else
+            log_error ("openat failed");
+        return NULL;
+      }
+
+    nbytes = read (fd, content, STATE_FILE_MAX - 1);
+    close (fd);
+
+    s = unlinkat (cam->dirfd, name, 0);
+    if (s < 0 && errno != ENOENT)
+      {
+        log_error ("unlinkat failed");
+        metrics_inc (METRIC_UNLINK_FAILURES);
+      }
+
+    if (nbytes < 0)
+      {
+        log_error ("read failed");
+        return NULL;
+      }
+    content[nbytes] = '\0';
+
+    return content;
+}
+
+/* When there is a inotify event to be read. Drains every queued event and
+   handles each state file as it is named */
+static void
+handle_state_file_created (struct picam_data *itdata)
+{
+    ssize_t nbytes;
+    bool overflow = false;
+    char buf[INOTIFY_BUF_LEN]
+      __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char content[STATE_FILE_MAX];
+
+    while (1)
+      {
+        nbytes = read (itdata->inotify_fd, buf, sizeof (buf));
+        if (nbytes < 0)
+          {
+            if (errno != EAGAIN)
+                log_error ("read failed");
+            break;
+          }
+        else if (nbytes == 0)
+          {
+            log_error ("read from inotify fd returned 0");
+            break;
+          }
+
+        for (char *p = buf; p < buf + nbytes;)
+          {
+            struct inotify_event *event = (struct inotify_event *) p;
+            struct camera *cam;
+
+            p += sizeof (struct inotify_event) + event->len;
+            metrics_inc (METRIC_INOTIFY_EVENTS);
+
+            /* Events were lost, the scan below finds what they said */
+            if (event->mask & IN_Q_OVERFLOW)
               {
-                s = snprintf (itdata->path, path_len, "%s/%s", itdata->dir,
-                              event->name);
+                overflow = true;
+                continue;
+              }
 
-                itdata->fp = fopen (itdata->path, "rb");
-                if (itdata->fp)
+            /* picam removed or moved its state dir, the parent watch sees
+               it made again when picam restarts */
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+              {
+                cam = cameras_by_wd (itdata->cameras, event->wd);
+                if (cam != NULL)
+                    drop_watch (itdata, cam);
+                continue;
+              }
+            if (event->mask & (IN_CREATE | IN_MOVED_TO) &&
+                event->mask & IN_ISDIR)
+              {
+                cam = cameras_by_parent (itdata->cameras, event->wd,
+                                         event->name);
+                if (cam == NULL)
+                    continue;
+                _log_debug ("state dir of %s created\n", cam->cfg->name);
+                drop_watch (itdata, cam);
+                if (setup_watch (itdata, cam) == 0)
                   {
-                    fseek (itdata->fp, 0, SEEK_END);
-                    long content_len = ftell (itdata->fp);
-                    fseek (itdata->fp, 0, SEEK_SET);
-
-                    itdata->content = malloc (content_len + 1);                                     
-                    if (itdata->content)
-                      {
-                        fread (itdata->content, 1, content_len, itdata->fp);                            
-                        itdata->content[content_len] = '\0';
-                      }
-                    else
-                        log_error ("malloc for file content failed");
-                    fclose (itdata->fp);
-                    itdata->fp = NULL;
+                    itdata->watch_state_enabled = true;
+                    scan_state_dir (itdata, cam);
                   }
-                else
-                    log_error ("fopen failed");
-                handle_state_file (itdata, event->name, itdata->content);
-                free (itdata->content);
-                itdata->content = NULL;
+                continue;
               }
-            s = unlink (itdata->path);
-            if (s < 0)
-                log_error ("unlink failed");
-            free (itdata->path);
-            itdata->path = NULL;
+
+            if (!event->len || !(event->mask & itdata->inotify_mask) ||
+                event->mask & IN_ISDIR) /* Ignore all directories */
+                continue;
+
+            cam = cameras_by_wd (itdata->cameras, event->wd);
+            if (cam == NULL)
+                continue;
+
+            /* The file holds the latest state no matter how many times it
+               was written since, later events for it find it gone */
+            handle_state_file (itdata, cam, event->name,
+                               consume_state_file (cam, event->name,
+                                                   content));
           }
-        p += sizeof (struct inotify_event) + event->len;
       }
+
+    if (overflow)
+      {
+        log_error_en (ENOBUFS, "inotify queue overflowed, rescanning");
+        metrics_inc (METRIC_INOTIFY_OVERFLOWS);
+        for (int i = 0; i < itdata->cameras->n; i++)
+            scan_state_dir (itdata, &itdata->cameras->camera[i]);
+      }
+}
+
+/* Apply every state file in the camera's state dir and remove it, for
+   when inotify could not say what picam wrote: before the watch existed
+   and after the queue overflowed. A file holds the newest state written
+   to it, so reading it once is enough however often it changed */
+static void
+scan_state_dir (struct picam_data *itdata, struct camera *cam)
+{
+    ssize_t s;
+    DIR *dir;
+    struct dirent *entry;
+    char content[STATE_FILE_MAX];
+
+    if (cam->dirfd < 0)
+        return;
+
+    /* closedir closes the fd it was opened with, so hand it a copy. The
+       copy shares the offset, which a previous scan left at the end */
+    s = fcntl (cam->dirfd, F_DUPFD_CLOEXEC, 0);
+    if (s < 0)
+      {
+        log_error ("fcntl failed");
+        return;
+      }
+    dir = fdopendir ((int) s);
+    if (dir == NULL)
+      {
+        log_error ("fdopendir failed");
+        close ((int) s);
+        return;
+      }
+    rewinddir (dir);
+
+    metrics_inc (METRIC_STATE_DIR_SCANS);
+    while ((entry = readdir (dir)) != NULL)
+      {
+        if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+            continue;
+
+        handle_state_file (itdata, cam, entry->d_name,
+                           consume_state_file (cam, entry->d_name, content));
+      }
+    closedir (dir);
+}
+
+static uint32_t
+camera_bit (struct picam_data *itdata, struct camera *cam)
+{
+    return 1U << (cam - itdata->cameras->camera);
+}
+
+/* Fire hook of cam and give picam until RECORD_ACK_TIMEOUT_MS from now to
+   acknowledge it in the state dir */
+static int
+fire_hook (struct camera *cam, enum hook hook)
+{
+    ssize_t s;
+
+    s = hooks_fire (&cam->hooks, hook);
+    if (s != 0)
+      {
+        log_error ("could not fire hook");
+        return 1;
+      }
+    cam->attempts++;
+    cam->deadline_ns = clock_now_ns () + RECORD_ACK_TIMEOUT_MS * 1000000ULL;
+
+    return 0;
+}
+
+/* Arm ack_timerfd for the earliest deadline of a camera waiting for picam,
+   or disarm it if none is */
+static void
+arm_ack_timer (struct picam_data *itdata)
+{
+    uint64_t deadline = 0;
+
+    for (int i = 0; i < itdata->cameras->n; i++)
+      {
+        struct camera *cam = &itdata->cameras->camera[i];
+        enum record_state state = atomic_load (&cam->state);
+
+        if (state != RECORD_STARTING && state != RECORD_STOPPING)
+            continue;
+        if (deadline == 0 || cam->deadline_ns < deadline)
+            deadline = cam->deadline_ns;
+      }
+
+    if (itdata->ack_timerfd >= 0 && deadline != itdata->ack_armed_ns)
+        clock_timer_arm (itdata->ack_timerfd, deadline, 0);
+    itdata->ack_armed_ns = deadline;
+}
+
+/* The recording is starting until a camera in it records and stopping
+   while a camera told to stop has not, see enum record_state */
+static void
+update_state (struct picam_data *itdata)
+{
+    uint32_t cams = atomic_load (&itdata->tdata->recording.cameras);
+    enum record_state state = RECORD_IDLE;
+
+    for (int i = 0; i < itdata->cameras->n; i++)
+      {
+        struct camera *cam = &itdata->cameras->camera[i];
+        enum record_state cs = atomic_load (&cam->state);
+
+        if (cams & (1U << i))
+            state = cs == RECORD_RECORDING || state == RECORD_RECORDING ?
+                    RECORD_RECORDING : RECORD_STARTING;
+        else if (cams == 0 && cs == RECORD_STOPPING)
+            state = RECORD_STOPPING;
+      }
+
+    /* However the recording ended, a grace window it had open is over, or
+       the next motion would be counted as merged into it */
+    if (state == RECORD_IDLE)
+        atomic_store (&itdata->tdata->in_grace, false);
+
+    arm_ack_timer (itdata);
+    record_set_state (&itdata->tdata->recording, state, clock_now_ns ());
+    status_recording (itdata->tdata->status, &itdata->tdata->recording);
+}
+
+/* Account the recording cam has stopped */
+static void
+camera_recording_done (struct picam_data *itdata, struct camera *cam)
+{
+    /* Monotonic so a time step by NTP doesn't change it */
+    uint64_t elapsed = clock_now_ns () - cam->start_ns;
+
+    _log_debug ("%s recorded video of length %lf seconds\n",
+                cam->cfg->name, elapsed / 1E9);
+    tsdb_append (&itdata->tdata->tsdb, TSDB_SERIES_RECORD_LENGTH,
+                 tsdb_now_ms (), elapsed / 1E9);
+    metrics_add (METRIC_RECORDING_MS_SUM, elapsed / 1000000);
+    metrics_inc (METRIC_RECORDING_COUNT);
+    camera_recorded (cam, elapsed);
 }
 
-/* Helper function for when a new state file is created */
+/* Helper function for when a new state file is created. picam writes
+   "true" and "false" to record as it starts and stops, which moves the
+   camera out of starting or stopping. A camera that stops by itself leaves
+   the recording so that motion starts it again, also when both were
+   written before the file was read and only "false" is seen */
 static void
-handle_state_file (struct internal_t_data *itdata, const char *filename,
-                   const char *content)
+handle_state_file (struct picam_data *itdata, struct camera *cam,
+                   const char *filename, const char *content)
 {
-  if (strcmp (filename, "record") == 0 && content != NULL)
+  struct recording *r = &itdata->tdata->recording;
+  enum record_state state;
+
+  if (strcmp (filename, "record") != 0 || content == NULL)
+      return;
+
+  state = atomic_load (&cam->state);
+  if (strcmp (content, "false") == 0)
+    {
+      if (state == RECORD_IDLE ||
+          (state == RECORD_STARTING && cam->stop_unacked))
+        {
+          /* Late acknowledgement of an earlier stop */
+          _log_debug ("%s stopped while %s\n", cam->cfg->name,
+                      record_state_name (state));
+          cam->stop_unacked = false;
+          return;
+        }
+      cam->stop_unacked = false;
+      if (state == RECORD_STARTING)
+        {
+          /* "true" was overwritten before it was read, picam started and
+             stopped by itself since the hook fired. When it started is not
+             known, so the trace is left open and the recording accounted
+             from the hook */
+          _log_debug ("%s started and stopped recording\n",
+                      cam->cfg->name);
+          cam->start_ns = cam->deadline_ns -
+                          RECORD_ACK_TIMEOUT_MS * 1000000ULL;
+        }
+      if (cam->start_ns != 0)
+          camera_recording_done (itdata, cam);
+      cam->start_ns = 0;
+      atomic_fetch_and (&r->cameras, ~camera_bit (itdata, cam));
+      atomic_store (&cam->state, RECORD_IDLE);
+    }
+  else if (strcmp (content, "true") == 0)
     {
-      if (strcmp (content, "false") == 0)
+      _log_debug ("%s started recording (was %s, recording is %s)\n",
+                  cam->cfg->name, record_state_name (state),
+                  record_state_name (record_get_state (r)));
+      /* picam recorded again, so it has seen any stop before */
+      cam->stop_unacked = false;
+      if (state == RECORD_STARTING)
         {
-          if (atomic_compare_exchange_weak (itdata->is_recording, (_Bool[])
-              { true }, false))
-            {
-              clock_gettime (CLOCK_REALTIME, &itdata->end);
-              double elapsed = (itdata->end.tv_sec - itdata->start.tv_sec) *
-                                1E9 + itdata->end.tv_nsec -
-                                itdata->start.tv_nsec;
-              _log_debug ("recorded video of length %lf seconds\n",
-                          elapsed / 1E9);               
-            }
+          cam->start_ns = clock_now_ns ();
+          atomic_store (&cam->state, RECORD_RECORDING);
+          trace_end (&itdata->tdata->trace, TRACE_RECORDING);
         }
-      else if (strcmp (content, "true") == 0)
+      else if (state == RECORD_IDLE)
         {
-          _log_debug ("started recording (is recording = %s)\n",
-                      atomic_load (itdata->is_recording) ? "true" :
-                                                           "false");
-          clock_gettime (CLOCK_REALTIME, &itdata->start);
+          /* Recording since before core started, or given up on. It joins
+             the recording, which the hold timer stops without motion */
+          if (!record_active (r))
+              clock_timer_arm_ms (itdata->tdata->timerfd,
+                                  holdtime_get_ms (&itdata->tdata->holdtime));
+          cam->start_ns = clock_now_ns ();
+          atomic_store (&cam->state, RECORD_RECORDING);
+          atomic_fetch_or (&r->cameras, camera_bit (itdata, cam));
         }
-      else
-          _log_debug ("record state changed to %s\n", content);
     }
+  else
+    {
+      _log_debug ("%s record state changed to %s\n", cam->cfg->name,
+                  content);
+      return;
+    }
+
+  update_state (itdata);
+}
+
+/* Fire the start hook of every camera in mask and add it to the
+   recording. A camera with a state dir is starting until picam says it
+   records, one without records as soon as the hook is out */
+static void
+start_cameras (struct picam_data *itdata, uint32_t mask)
+{
+    ssize_t s;
+    int started = 0;
+    struct thread_data *tdata = itdata->tdata;
+
+    for (int i = 0; i < itdata->cameras->n; i++)
+      {
+        struct camera *cam = &itdata->cameras->camera[i];
+        enum record_state state = atomic_load (&cam->state);
+
+        if (!(mask & (1U << i)))
+            continue;
+
+        /* Already on its way, the recording just takes it back */
+        if (state == RECORD_STARTING || state == RECORD_RECORDING)
+          {
+            atomic_fetch_or (&tdata->recording.cameras, 1U << i);
+            continue;
+          }
+
+        _log_debug ("informing %s to start recording\n", cam->cfg->name);
+        cam->attempts = 0;
+        s = fire_hook (cam, HOOK_START);
+        if (s != 0)
+            continue;
+        metrics_inc (METRIC_RECORDINGS_STARTED);
+        atomic_fetch_or (&tdata->recording.cameras, 1U << i);
+        started++;
+
+        /* Without the state dir the hook is the last point seen */
+        if (cam->dirfd >= 0)
+          {
+            atomic_store (&cam->state, RECORD_STARTING);
+            trace_mark (&tdata->trace, TRACE_HOOK);
+          }
+        else
+          {
+            cam->start_ns = clock_now_ns ();
+            atomic_store (&cam->state, RECORD_RECORDING);
+            trace_end (&tdata->trace, TRACE_HOOK);
+          }
+      }
+
+    /* Motion that started no camera is not an event of the series */
+    if (started > 0)
+        tsdb_append (&tdata->tsdb, TSDB_SERIES_MOTION, tsdb_now_ms (), 1);
+}
+
+/* Fire the stop hook of every camera in mask. A camera with a state dir is
+   stopping until picam says so, one without is idle and its recording
+   accounted as soon as the hook is out */
+static void
+stop_cameras (struct picam_data *itdata, uint32_t mask)
+{
+    ssize_t s;
+
+    for (int i = 0; i < itdata->cameras->n; i++)
+      {
+        struct camera *cam = &itdata->cameras->camera[i];
+        enum record_state state = atomic_load (&cam->state);
+
+        if (!(mask & (1U << i)) ||
+            (state != RECORD_STARTING && state != RECORD_RECORDING))
+            continue;
+
+        _log_debug ("informing %s to stop recording\n", cam->cfg->name);
+        cam->attempts = 0;
+        s = fire_hook (cam, HOOK_STOP);
+        if (s != 0)
+            continue;
+        metrics_inc (METRIC_RECORDINGS_STOPPED);
+
+        if (cam->dirfd >= 0)
+          {
+            cam->stop_unacked = true;
+            atomic_store (&cam->state, RECORD_STOPPING);
+          }
+        else
+          {
+            /* The hooks are all there is to account the recording by */
+            if (cam->start_ns != 0)
+                camera_recording_done (itdata, cam);
+            cam->start_ns = 0;
+            atomic_store (&cam->state, RECORD_IDLE);
+          }
+      }
 }
 
-/* Helper function to create picam hooks on record event */
+/* Log where the recording stands, for CMD_SNAPSHOT */
 static void
-handle_record_event (struct internal_t_data *itdata, const uint64_t u)
+log_snapshot (struct picam_data *itdata)
 {
-    ssize_t s;  
+    struct cmdq *q = &itdata->tdata->picam_cmds;
+    struct recording *r = &itdata->tdata->recording;
 
-    switch (u)
+    _log_debug ("recording %s, cameras 0x%x\n",
+                record_state_name (record_get_state (r)),
+                atomic_load (&r->cameras));
+    for (int i = 0; i < itdata->cameras->n; i++)
       {
-        case 1:
-            _log_debug ("informing picam to start recording\n");
-            s = touch (itdata->picam_start_hook);
+        struct camera *cam = &itdata->cameras->camera[i];
+
+        _log_debug ("camera %s: %s, %d hooks, %s\n", cam->cfg->name,
+                    record_state_name (atomic_load (&cam->state)),
+                    cam->attempts,
+                    cam->dirfd >= 0 ? "watched" : "not watched");
+      }
+    _log_debug ("commands: %" PRIuFAST64 " queued, %" PRIuFAST64
+                " dropped, at most %" PRIuFAST64 " waiting\n",
+                atomic_load (&q->pushed), atomic_load (&q->dropped),
+                atomic_load (&q->high_water));
+}
+
+/* Commands are handled in the order they were queued. Only this thread
+   changes the state of the recording and its cameras, producers only ask */
+static void
+handle_cmd (struct picam_data *itdata, const struct cmd *cmd)
+{
+    uint32_t cams;
+    struct thread_data *tdata = itdata->tdata;
+
+    _log_debug ("%s from %s (zones 0x%" PRIx32 ", cameras 0x%" PRIx32
+                ")\n", cmd_type_name (cmd->type),
+                cmd_source_name (cmd->source), cmd->zones, cmd->cameras);
+
+    switch (cmd->type)
+      {
+        case CMD_START:
+            trace_mark (&tdata->trace, TRACE_WAKEUP);
+            /* Fall through */
+        case CMD_EXTEND:
+            /* An extend queued just before the recording ended starts a
+               new one, the motion behind it has re-armed the hold timer */
+            cams = cmd->cameras & ~atomic_load (&tdata->recording.cameras);
+            if (cams != 0)
+                start_cameras (itdata, cams);
+            update_state (itdata);
+
+            /* Motion sees the new state before it may queue again */
+            if (cmd->type == CMD_START)
+                atomic_store (&tdata->recording.start_queued, false);
             break;
-        case 2:
-            _log_debug ("informing picam to stop recording\n");
-            s = touch (itdata->picam_stop_hook);
-            if (s == 0 && !itdata->watch_state_enabled)
-              {
-                atomic_store (itdata->is_recording, false);
-              }
+        case CMD_STOP:
+            cams = atomic_exchange (&tdata->recording.cameras, 0);
+            if (cams != 0)
+                stop_cameras (itdata, cams);
+            update_state (itdata);
             break;
-        default:
-            errno = EINVAL;
-            s = -1;
+        case CMD_SNAPSHOT:
+            log_snapshot (itdata);
             break;
       }
-
-    if (s < 0)
-        log_error ("could not handle record event");
 }
 
-/* Helper function to initialize inotify event */
+/* Helper function to watch the state dir of a camera */
 static int
-setup_inotify (struct internal_t_data *itdata)
+setup_watch (struct picam_data *itdata, struct camera *cam)
 {
-    ssize_t s;  
+    ssize_t s;
 
-    s = inotify_init ();
+    /* State files are opened and unlinked relative to this */
+    s = open (cam->cfg->state_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
     if (s < 0)
       {
-        log_error ("inotify_init failed");
+        if (errno == ENOENT)
+            log_error ("is picam running? state dir not available");
+        else if (errno == ENOTDIR)
+            log_error ("state path is not a directory");
+        else
+            log_error ("open failed");
         return 1;
       }
-    itdata->inotify_fd = (int) s;
+    cam->dirfd = (int) s;
 
-    s = stat (itdata->dir, &itdata->st);
-    if (s < 0)
+    cam->wd = inotify_add_watch (itdata->inotify_fd, cam->cfg->state_dir,
+                                 itdata->inotify_mask | IN_DELETE_SELF |
+                                 IN_MOVE_SELF);
+    if (cam->wd < 0)
       {
-        if (errno == ENOENT)
-          {
-            log_error ("is picam running? state dir not available");
-            return 1;
-          }
-        else
-          {
-            log_error ("stat failed");
-            return 1;
-          }
+        log_error ("inotify_add_watch failed");
+        close (cam->dirfd);
+        cam->dirfd = -1;
+        return 1;
       }
+
+    return 0;
+}
+
+/* Helper function to watch the dir holding the state dir of a camera for
+   the state dir being created. Several cameras may share the watch */
+static int
+setup_parent_watch (struct picam_data *itdata, struct camera *cam)
+{
+    char parent[PATH_MAX];
+    const char *dir = cam->cfg->state_dir;
+    const char *slash = strrchr (dir, '/');
+    size_t len;
+
+    if (slash == NULL)
+        strcpy (parent, ".");
     else
       {
-        if (!S_ISDIR (itdata->st.st_mode))
+        len = slash == dir ? 1 : (size_t) (slash - dir);
+        if (len >= sizeof (parent))
           {
-            log_error ("state path is not a directory");
+            log_error_en (ENAMETOOLONG, "state dir path too long");
             return 1;
           }
+        memcpy (parent, dir, len);
+        parent[len] = '\0';
       }
 
-    if (access (itdata->dir, R_OK) < 0)
+    cam->parent_wd = inotify_add_watch (itdata->inotify_fd, parent,
+                                        IN_CREATE | IN_MOVED_TO |
+                                        IN_ONLYDIR | IN_MASK_ADD);
+    if (cam->parent_wd < 0)
       {
-        log_error ("access failed");
+        log_error ("inotify_add_watch failed");
         return 1;
       }
 
-    itdata->inotify_mask = IN_CLOSE_WRITE;
-    itdata->wd = inotify_add_watch (itdata->inotify_fd, itdata->dir,
-                                    itdata->inotify_mask);
-
     return 0;
 }
 
+/* Forget the state dir of a camera that picam removed. Until it is
+   watched again its hooks are taken as done once fired */
+static void
+drop_watch (struct picam_data *itdata, struct camera *cam)
+{
+    if (cam->dirfd < 0)
+        return;
+
+    _log_debug ("state dir of %s went away\n", cam->cfg->name);
+
+    /* Fails if the kernel removed the watch along with the dir */
+    inotify_rm_watch (itdata->inotify_fd, cam->wd);
+    close (cam->dirfd);
+    cam->dirfd = -1;
+    cam->wd = -1;
+}
+
 /* This function is used to cleanup thread */
 static void
 cleanup_handler(void *arg)
 {
-    struct internal_t_data *itdata = arg;
+    struct picam_data *itdata = arg;
 
-    inotify_rm_watch (itdata->inotify_fd, itdata->wd);
-    close (itdata->inotify_fd);
-
-    free (itdata->dir);
-    free (itdata->picam_start_hook);
-    free (itdata->picam_stop_hook);
+    for (int i = 0; itdata->cameras && i < itdata->cameras->n; i++)
+      {
+        struct camera *cam = &itdata->cameras->camera[i];
+
+        /* Closing the inotify fd removes this one */
+        cam->parent_wd = -1;
+        if (cam->dirfd < 0)
+            continue;
+        if (itdata->inotify_fd >= 0)
+            inotify_rm_watch (itdata->inotify_fd, cam->wd);
+        close (cam->dirfd);
+        cam->dirfd = -1;
+      }
 
-    if (itdata->path)
-        free (itdata->path);
-    if (itdata->content)
-        free (itdata->content);
+    if (itdata->inotify_fd >= 0)
+      {
+        close (itdata->inotify_fd);
+        itdata->inotify_fd = -1;
+      }
 
-    if (itdata->fp)
-        fclose (itdata->fp);
-}
\ No newline at end of file
+    if (itdata->ack_timerfd >= 0)
+      {
+        clock_timer_close (itdata->ack_timerfd);
+        itdata->ack_timerfd = -1;
+      }
+}
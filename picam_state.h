@@ -24,7 +24,49 @@
 #ifndef _PICAM_H_
 #define _PICAM_H_
 
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "common.h"
+
+/* State owned by whichever thread watches picam, either the picam thread or
+   the reactor in the main thread. The state dirs of every camera are
+   watched through the one inotify fd, ack_timerfd expires at the earliest
+   deadline for picam to acknowledge a hook */
+struct picam_data {
+    _Bool              watch_state_enabled; /* At least one dir watched */
+    int                inotify_fd;
+    uint32_t           inotify_mask;
+    int                ack_timerfd;
+    uint64_t           ack_armed_ns; /* Deadline armed, 0 if none */
+    struct cameras     *cameras;
+    struct thread_data *tdata;
+};
+
 /* This function is invoked by core as the timer thread is created */
 extern void *thread_picam_start (void *);
 
+/* Setup inotify watches, returns non-zero if inotify is unavailable and
+   picam's state can never be seen. A state dir missing so far is watched
+   once picam creates it */
+extern int picam_state_init (struct picam_data *, struct thread_data *);
+
+/* Handle a readable inotify fd */
+extern void picam_handle_inotify (struct picam_data *);
+
+/* Handle a readable ack_timerfd */
+extern void picam_handle_ack_timer (struct picam_data *);
+
+/* Handle a readable record_eventfd */
+extern void picam_handle_record_eventfd (struct picam_data *);
+
+/* Queue cmd for the thread watching picam and ring record_eventfd. Safe
+   from any thread, never blocks. Returns non-zero if the queue is full */
+extern int picam_send (struct thread_data *, const struct cmd *);
+
+/* Release resources allocated by picam_state_init */
+extern void picam_state_cleanup (struct picam_data *);
+
 #endif /* _PICAM_H_ */
\ No newline at end of file
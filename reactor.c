@@ -0,0 +1,124 @@
+/*
+ *  reactor.c
+ *    Multiplex timer, picam state, record events and signals on one epoll fd
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "reactor.h"
+#include "metrics.h"
+#include "common.h"
+#include "log.h"
+
+int
+reactor_init (struct reactor *r)
+{
+    memset (r, 0, sizeof (*r));
+
+    r->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (r->epfd < 0)
+      {
+        log_error ("error in epoll_create1");
+        return 1;
+      }
+
+    return 0;
+}
+
+int
+reactor_add (struct reactor *r, int fd, reactor_handler handler, void *arg)
+{
+    ssize_t s;
+    struct epoll_event ev;
+    struct reactor_source *src;
+
+    if (r->nsources >= REACTOR_MAX_SOURCES)
+      {
+        log_error_en (ENOSPC, "too many reactor sources");
+        return 1;
+      }
+
+    src = &r->sources[r->nsources];
+    src->fd = fd;
+    src->handler = handler;
+    src->arg = arg;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN | EPOLLPRI;
+    ev.data.ptr = src;
+
+    s = epoll_ctl (r->epfd, EPOLL_CTL_ADD, fd, &ev);
+    if (s < 0)
+      {
+        log_error ("error in epoll_ctl");
+        return 1;
+      }
+    r->nsources++;
+
+    return 0;
+}
+
+int
+reactor_run (struct reactor *r)
+{
+    int n;
+    struct epoll_event events[REACTOR_MAX_SOURCES];
+
+    r->running = true;
+    while (r->running)
+      {
+        /* Passing -1 to epoll_wait as timeout means to block */
+        n = epoll_wait (r->epfd, events, REACTOR_MAX_SOURCES, -1);
+        if (n < 0)
+          {
+            if (errno == EINTR)
+                continue;
+            log_error ("epoll_wait failed");
+            metrics_inc (METRIC_POLL_ERRORS);
+            return 1;
+          }
+
+        for (int i = 0; i < n; i++)
+          {
+            struct reactor_source *src = events[i].data.ptr;
+            src->handler (src->arg, events[i].events);
+          }
+      }
+
+    return 0;
+}
+
+void
+reactor_stop (struct reactor *r)
+{
+    r->running = false;
+}
+
+void
+reactor_destroy (struct reactor *r)
+{
+    if (r->epfd > 0)
+        close (r->epfd);
+    r->epfd = -1;
+}
@@ -0,0 +1,64 @@
+/*
+ *  reactor.h
+ *    Single threaded epoll event loop used in reactor mode
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Maximum number of file descriptors a reactor can watch */
+#define REACTOR_MAX_SOURCES 24
+
+/* Callback invoked with the epoll events when fd becomes ready */
+typedef void (*reactor_handler) (void *, uint32_t);
+
+struct reactor_source {
+    int             fd;
+    reactor_handler handler;
+    void            *arg;
+};
+
+struct reactor {
+    int                   epfd;
+    int                   nsources;
+    bool                  running;
+    struct reactor_source sources[REACTOR_MAX_SOURCES];
+};
+
+/* Create the epoll instance, returns non-zero on failure */
+extern int reactor_init (struct reactor *);
+
+/* Register fd to have handler called when it is readable */
+extern int reactor_add (struct reactor *, int, reactor_handler, void *);
+
+/* Dispatch events until reactor_stop is called from a handler */
+extern int reactor_run (struct reactor *);
+
+/* Make reactor_run return after the current batch of events */
+extern void reactor_stop (struct reactor *);
+
+/* Close the epoll instance, registered fds are not closed */
+extern void reactor_destroy (struct reactor *);
+
+#endif /* _REACTOR_H_ */
@@ -0,0 +1,98 @@
+/*
+ *  record.c
+ *    Recording state names and transition accounting
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+
+#include "record.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+static const char *const state_names[RECORD_NSTATES] = {
+    "idle",
+    "starting",
+    "recording",
+    "stopping"
+};
+
+void
+record_init (struct recording *r)
+{
+    memset (r, 0, sizeof (*r));
+    atomic_init (&r->state, RECORD_IDLE);
+    atomic_init (&r->cameras, 0);
+    atomic_init (&r->start_queued, false);
+    r->since_ns = clock_now_ns ();
+}
+
+void
+record_set_state (struct recording *r, enum record_state state, uint64_t now)
+{
+    uint64_t elapsed, max;
+    enum record_state from = record_get_state (r);
+    struct record_transition *t;
+
+    if (state == from)
+        return;
+
+    elapsed = now - r->since_ns;
+    t = &r->transitions[from][state];
+    atomic_fetch_add_explicit (&t->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&t->total_ns, elapsed, memory_order_relaxed);
+    max = atomic_load_explicit (&t->max_ns, memory_order_relaxed);
+    while (elapsed > max &&
+           !atomic_compare_exchange_weak_explicit (&t->max_ns, &max, elapsed,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+        ;
+
+    _log_debug ("recording %s -> %s after %" PRIu64 " ms\n",
+                state_names[from], state_names[state], elapsed / 1000000);
+    r->since_ns = now;
+    atomic_store (&r->state, state);
+}
+
+const char *
+record_state_name (enum record_state state)
+{
+    return state_names[state];
+}
+
+void
+record_dump (struct recording *r)
+{
+    for (int i = 0; i < RECORD_NSTATES; i++)
+        for (int j = 0; j < RECORD_NSTATES; j++)
+          {
+            struct record_transition *t = &r->transitions[i][j];
+            uint64_t count = atomic_load (&t->count);
+
+            if (count == 0)
+                continue;
+            _log_debug ("%s -> %s: %" PRIu64 " times, mean %" PRIu64
+                        " ms, max %" PRIuFAST64 " ms\n", state_names[i],
+                        state_names[j], count,
+                        (uint64_t) atomic_load (&t->total_ns) / count /
+                        1000000, atomic_load (&t->max_ns) / 1000000);
+          }
+}
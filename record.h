@@ -0,0 +1,86 @@
+/*
+ *  record.h
+ *    States of a recording and the time spent between them
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Of the recording as a whole and of each camera in it. A camera is
+   starting or stopping from when its hook is fired until picam says so in
+   its state dir */
+enum record_state {
+    RECORD_IDLE,
+    RECORD_STARTING,
+    RECORD_RECORDING,
+    RECORD_STOPPING,
+    RECORD_NSTATES
+};
+
+struct record_transition {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total_ns; /* Time spent in the state left */
+    atomic_uint_fast64_t max_ns;
+};
+
+/* Only the thread watching picam changes state and cameras, the others
+   read them to decide what to ask for. start_queued keeps motion from
+   queueing more than one start while the first one waits */
+struct recording {
+    atomic_int               state;
+    atomic_uint              cameras;  /* Mask of cameras in the recording */
+    atomic_bool              start_queued;
+    uint64_t                 since_ns; /* Entered state, clock_now_ns () */
+    struct record_transition transitions[RECORD_NSTATES][RECORD_NSTATES];
+};
+
+extern void record_init (struct recording *);
+
+/* Move to state at now and account the transition, nothing if unchanged */
+extern void record_set_state (struct recording *, enum record_state,
+                              uint64_t);
+
+static inline enum record_state
+record_get_state (struct recording *r)
+{
+    return atomic_load (&r->state);
+}
+
+/* True while starting or recording, when motion keeps it going and the
+   hold timer may stop it */
+static inline bool
+record_active (struct recording *r)
+{
+    enum record_state state = record_get_state (r);
+
+    return state == RECORD_STARTING || state == RECORD_RECORDING;
+}
+
+extern const char *record_state_name (enum record_state);
+
+/* Log count and mean time of every transition seen */
+extern void record_dump (struct recording *);
+
+#endif /* _RECORD_H_ */
@@ -0,0 +1,252 @@
+/*
+ *  rt.c
+ *    Thread affinity and priority, memory locking and jitter histograms
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+
+#include "rt.h"
+#include "hist.h"
+#include "metrics.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+static const char *const jitter_names[RT_NJITTER] = {
+    "timer",
+    "dispatch"
+};
+
+static const struct rt_config *rt_table;
+static bool rt_locked;
+static struct histogram jitter[RT_NJITTER];
+static atomic_uint_fast64_t overruns;
+
+/* Touch size bytes of stack below the caller so growing into them later
+   doesn't fault. Locked memory stays resident once touched */
+static void __attribute__ ((noinline))
+prefault_stack (size_t size)
+{
+    volatile char stack[size];
+
+    memset ((char *) stack, 0, size);
+}
+
+int
+rt_init (const struct rt_config *table, bool lock)
+{
+    ssize_t s;
+
+    rt_table = table;
+    for (int i = 0; i < RT_NJITTER; i++)
+        hist_init (&jitter[i]);
+
+    if (!lock)
+        return 0;
+
+    /* Threads created from here on have their RT_STACK_SIZE stacks locked
+       and faulted in by the kernel when they are mapped */
+    s = mlockall (MCL_CURRENT | MCL_FUTURE);
+    if (s < 0)
+      {
+        log_error ("mlockall failed, memory may be paged");
+        return 1;
+      }
+    rt_locked = true;
+    prefault_stack (RT_STACK_PREFAULT);
+
+    return 0;
+}
+
+int
+rt_apply (pthread_t t, enum rt_thread role)
+{
+    int s, ret = 0;
+    cpu_set_t set;
+    struct sched_param param;
+    const struct rt_config *cfg;
+
+    if (rt_table == NULL)
+        return 0;
+    cfg = &rt_table[role];
+
+    pthread_setname_np (t, cfg->name);
+
+    if (cfg->cpu >= 0)
+      {
+        CPU_ZERO (&set);
+        CPU_SET (cfg->cpu, &set);
+        if (cfg->cpu >= get_nprocs ())
+          {
+            log_error_en (EINVAL, "no such cpu, thread left unpinned");
+            ret = EINVAL;
+          }
+        else if ((s = pthread_setaffinity_np (t, sizeof (set), &set)) != 0)
+          {
+            log_error_en (s, "error in pthread_setaffinity_np");
+            ret = s;
+          }
+      }
+
+    memset (&param, 0, sizeof (struct sched_param));
+    if (cfg->policy == SCHED_FIFO || cfg->policy == SCHED_RR)
+        param.sched_priority = cfg->priority;
+
+    s = pthread_setschedparam (t, cfg->policy, &param);
+    if (s != 0)
+      {
+        log_error_en (s, "error in pthread_setschedparam");
+        ret = s;
+      }
+
+    return ret;
+}
+
+void
+rt_enter (enum rt_thread role)
+{
+    static _Thread_local bool entered;
+
+    if (entered)
+        return;
+    entered = true;
+
+    rt_apply (pthread_self (), role);
+    if (rt_locked)
+        prefault_stack (RT_STACK_PREFAULT);
+}
+
+void
+rt_jitter_record (enum rt_jitter which, uint64_t ns)
+{
+    hist_record (&jitter[which], ns / 1000);
+}
+
+struct histogram *
+rt_jitter_histogram (enum rt_jitter which)
+{
+    return &jitter[which];
+}
+
+const char *
+rt_jitter_name (enum rt_jitter which)
+{
+    return jitter_names[which];
+}
+
+uint64_t
+rt_jitter_overruns (void)
+{
+    return atomic_load (&overruns);
+}
+
+void
+rt_dump (void)
+{
+    for (int i = 0; i < RT_NJITTER; i++)
+      {
+        struct histogram *h = &jitter[i];
+
+        _log_debug ("%s jitter: %" PRIuFAST64 " samples, p50 %" PRIu64
+                    " us, p99 %" PRIu64 " us, p99.9 %" PRIu64 " us, max %"
+                    PRIuFAST64 " us\n", jitter_names[i],
+                    atomic_load (&h->count), hist_percentile (h, 50),
+                    hist_percentile (h, 99), hist_percentile (h, 99.9),
+                    atomic_load (&h->max));
+      }
+    _log_debug ("probe timer overruns: %" PRIuFAST64 "\n",
+                atomic_load (&overruns));
+}
+
+/* Lateness of each expiry is measured against the deadline it was armed
+   for, expirations missed while the thread could not run are overruns */
+void *
+thread_rt_probe_start (void *arg)
+{
+    ssize_t s, events;
+    int fd;
+    uint64_t u, now, deadline;
+    const uint64_t period = (uint64_t) RT_PROBE_PERIOD_MS * 1000000;
+    struct thread_data *tdata = arg;
+    struct pollfd poll_fds[2];
+
+    fd = clock_timer_create ();
+    if (fd < 0)
+        return NULL;
+
+    deadline = clock_now_ns () + period;
+    s = clock_timer_arm (fd, deadline, period);
+    if (s != 0)
+      {
+        clock_timer_close (fd);
+        return NULL;
+      }
+
+    memset (&poll_fds, 0, sizeof (poll_fds));
+    poll_fds[0].fd = tdata->timerpipe[0];
+    poll_fds[0].events = events = POLLIN | POLLPRI;
+    poll_fds[1].fd = fd;
+    poll_fds[1].events = events;
+
+    while (1)
+      {
+        /* Passing -1 to poll as third argument means to block (INFTIM) */
+        s = poll (poll_fds, 2, -1);
+
+        if (s < 0)
+          {
+            log_error ("poll failed");
+            metrics_inc (METRIC_POLL_ERRORS);
+            continue;
+          }
+
+        /* If there is data to read on timerpipe, we shall exit */
+        if (poll_fds[0].revents & events)
+            break;
+        if (!(poll_fds[1].revents & events))
+            continue;
+
+        s = read (fd, &u, sizeof (uint64_t));
+        now = clock_now_ns ();
+        if (s < 0 || u == 0)
+            continue;
+
+        /* The latest expiry is the one that woke us */
+        deadline += (u - 1) * period;
+        if (u > 1)
+            atomic_fetch_add_explicit (&overruns, u - 1,
+                                       memory_order_relaxed);
+        rt_jitter_record (RT_JITTER_TIMER, now > deadline ? now - deadline :
+                                                            0);
+        deadline += period;
+      }
+
+    clock_timer_close (fd);
+
+    return NULL;
+}
@@ -0,0 +1,94 @@
+/*
+ *  rt.h
+ *    Real-time profile of core threads and the scheduling jitter probe
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _RT_H_
+#define _RT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "hist.h"
+
+/* Threads of core by role, each gets the settings of its row in the table
+   given to rt_init */
+enum rt_thread {
+    RT_THREAD_MAIN,    /* Signals, or everything in reactor mode */
+    RT_THREAD_TIMER,
+    RT_THREAD_GPIO,    /* Zones thread or the backend's interrupt threads */
+    RT_THREAD_PICAM,
+    RT_THREAD_EVENTS,  /* libevent thread of fgevents */
+    RT_THREAD_SAMPLER,
+    RT_THREAD_METRICS,
+    RT_THREAD_PROBE,
+    RT_NTHREADS
+};
+
+/* cpu -1 leaves the thread free to run anywhere, priority is ignored
+   unless policy is SCHED_FIFO or SCHED_RR */
+struct rt_config {
+    const char *name; /* At most 15 characters */
+    int        cpu;
+    int        policy;
+    int        priority;
+};
+
+/* What the jitter probe measures */
+enum rt_jitter {
+    RT_JITTER_TIMER,    /* Probe timerfd expiry to the probe running */
+    RT_JITTER_DISPATCH, /* Edge timestamp to gpio_deliver */
+    RT_NJITTER
+};
+
+/* Keep table (RT_NTHREADS rows) for rt_apply. With lock, all memory is
+   locked and the calling thread's stack pre-faulted so the motion path
+   never waits for a page. Returns non-zero if memory could not be locked,
+   core then runs as before */
+extern int rt_init (const struct rt_config *, bool);
+
+/* Name thread t and set its CPU and scheduling from its row. Returns
+   non-zero if any of it failed, usually for lack of CAP_SYS_NICE */
+extern int rt_apply (pthread_t, enum rt_thread);
+
+/* rt_apply to the calling thread the first time it gets here, for threads
+   created by libraries */
+extern void rt_enter (enum rt_thread);
+
+/* Record a delay in nanoseconds, lock-free */
+extern void rt_jitter_record (enum rt_jitter, uint64_t);
+
+extern struct histogram *rt_jitter_histogram (enum rt_jitter);
+
+extern const char *rt_jitter_name (enum rt_jitter);
+
+/* Timer expirations the probe missed entirely */
+extern uint64_t rt_jitter_overruns (void);
+
+/* Log count and percentiles of every histogram */
+extern void rt_dump (void);
+
+/* Start routine of the probe thread, which wakes every RT_PROBE_PERIOD_MS
+   on an absolute timer with the priority of the motion path */
+extern void *thread_rt_probe_start (void *);
+
+#endif /* _RT_H_ */
@@ -0,0 +1,221 @@
+/*
+ *  sampler.c
+ *    Read thermal zones and CPU frequency on a timer and cache the values
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include "sampler.h"
+#include "status.h"
+#include "metrics.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+#define THERMAL_ZONE_FMT "/sys/class/thermal/thermal_zone%d/temp"
+#define CPU_FREQ_PATH "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq"
+
+/* Read a decimal integer from the start of a sysfs file without closing
+   it, returns non-zero on failure */
+static int
+pread_long (int fd, long *value)
+{
+    ssize_t s;
+    char buf[16];
+    char *end;
+
+    s = pread (fd, buf, sizeof (buf) - 1, 0);
+    if (s <= 0)
+        return 1;
+    buf[s] = '\0';
+
+    errno = 0;
+    *value = strtol (buf, &end, 10);
+    if (end == buf || errno == ERANGE)
+        return 1;
+
+    return 0;
+}
+
+/* Read every open file and publish the result */
+static void
+take_sample (struct sampler *sp)
+{
+    long v;
+    struct sampler_snapshot snap;
+
+    memset (&snap, 0, sizeof (snap));
+    snap.nzones = sp->nzones;
+    for (int i = 0; i < sp->nzones; i++)
+      {
+        /* Millidegrees rounded to tenths of a degree */
+        if (pread_long (sp->zone_fds[i], &v) == 0)
+            snap.zone_temp[i] = (v + 50) / 100;
+        else
+            snap.zone_temp[i] = sp->snap.zone_temp[i];
+      }
+
+    if (sp->freq_fd >= 0 && pread_long (sp->freq_fd, &v) == 0)
+        snap.cpu_freq_khz = v;
+
+    snap.taken_ns = clock_now_ns ();
+
+    seqlock_write_begin (&sp->lock);
+    sp->snap = snap;
+    seqlock_write_end (&sp->lock);
+}
+
+int
+sampler_init (struct sampler *sp, long period_ms)
+{
+    ssize_t s;
+    char path[64];
+    uint64_t period_ns;
+
+    memset (sp, 0, sizeof (*sp));
+    seqlock_init (&sp->lock);
+    sp->timerfd = -1;
+
+    for (int i = 0; i < SAMPLER_MAX_ZONES; i++)
+      {
+        snprintf (path, sizeof (path), THERMAL_ZONE_FMT, i);
+        s = open (path, O_RDONLY | O_CLOEXEC);
+        if (s < 0)
+            break;
+        sp->zone_fds[sp->nzones++] = s;
+      }
+    if (sp->nzones == 0)
+        log_error ("no thermal zones found");
+
+    sp->freq_fd = open (CPU_FREQ_PATH, O_RDONLY | O_CLOEXEC);
+    if (sp->freq_fd < 0)
+        _log_debug ("sampler: cpu frequency not available\n");
+
+    take_sample (sp);
+
+    sp->timerfd = clock_timer_create ();
+    if (sp->timerfd < 0)
+        return 1;
+
+    period_ns = period_ms * 1000000ULL;
+    s = clock_timer_arm (sp->timerfd, clock_now_ns () + period_ns, period_ns);
+    if (s < 0)
+        return 1;
+
+    return 0;
+}
+
+void
+sampler_handle_timer (struct sampler *sp)
+{
+    ssize_t s;
+    uint64_t u;
+
+    s = read (sp->timerfd, &u, sizeof (uint64_t));
+    if (s < 0)
+      {
+        if (errno != EAGAIN)
+            log_error ("read failed");
+        return;
+      }
+
+    take_sample (sp);
+}
+
+void
+sampler_read (struct sampler *sp, struct sampler_snapshot *snap)
+{
+    unsigned int seq;
+
+    do
+      {
+        seq = seqlock_read_begin (&sp->lock);
+        *snap = sp->snap;
+      }
+    while (seqlock_read_retry (&sp->lock, seq));
+}
+
+void
+sampler_close (struct sampler *sp)
+{
+    for (int i = 0; i < sp->nzones; i++)
+        close (sp->zone_fds[i]);
+    sp->nzones = 0;
+
+    if (sp->freq_fd >= 0)
+        close (sp->freq_fd);
+    sp->freq_fd = -1;
+
+    clock_timer_close (sp->timerfd);
+    sp->timerfd = -1;
+}
+
+/* Start routine for sampler thread */
+void *
+thread_sampler_start (void *arg)
+{
+    ssize_t s, events;
+    struct thread_data *tdata = arg;
+    struct pollfd poll_fds[2];
+
+    memset (&poll_fds, 0, sizeof (poll_fds));
+
+    poll_fds[0].fd = tdata->sampler.timerfd;
+    poll_fds[0].events = events = POLLIN | POLLPRI;
+
+    poll_fds[1] = poll_fds[0];
+    poll_fds[1].fd = tdata->timerpipe[0];
+
+    status_refresh (tdata->status, &tdata->sensors);
+
+    while (1)
+      {
+        /* Passing -1 to poll as third argument means to block (INFTIM) */
+        s = poll (poll_fds, 2, -1);
+
+        if (s < 0)
+          {
+            log_error ("poll failed");
+            metrics_inc (METRIC_POLL_ERRORS);
+          }
+        else if (s > 0)
+          {
+            /* If there is data to read on timerpipe, we shall exit */
+            if (poll_fds[1].revents & events)
+                break;
+
+            if (poll_fds[0].revents & events)
+              {
+                sampler_handle_timer (&tdata->sampler);
+                status_refresh (tdata->status, &tdata->sensors);
+                tsdb_drain (&tdata->tsdb);
+              }
+          }
+      }
+
+    return NULL;
+}
@@ -0,0 +1,69 @@
+/*
+ *  sampler.h
+ *    Periodic sampling of thermal zones and CPU frequency
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include <stdint.h>
+
+#include "seqlock.h"
+
+#define SAMPLER_MAX_ZONES 8
+
+/* Values from the last sample. Temperatures are in tenths of a degree like
+   SensorData.cputemp */
+struct sampler_snapshot {
+    int      nzones;
+    float    zone_temp[SAMPLER_MAX_ZONES];
+    uint32_t cpu_freq_khz;
+    uint64_t taken_ns; /* clock_now_ns () */
+};
+
+struct sampler {
+    int                     timerfd;
+    int                     nzones;
+    int                     zone_fds[SAMPLER_MAX_ZONES];
+    int                     freq_fd;
+    struct seqlock          lock;
+    struct sampler_snapshot snap;
+};
+
+/* Open every thermal zone and the CPU frequency, take a first sample and
+   arm a timerfd firing every period_ms */
+extern int sampler_init (struct sampler *, long);
+
+/* Called when sampler->timerfd is readable, reads all files with pread and
+   publishes a new snapshot */
+extern void sampler_handle_timer (struct sampler *);
+
+/* Copy the latest snapshot, never blocks and makes no syscalls */
+extern void sampler_read (struct sampler *, struct sampler_snapshot *);
+
+extern void sampler_close (struct sampler *);
+
+/* Start routine for the sampler thread, which also refreshes the status
+   page and writes staged time series points. It runs in reactor mode too,
+   to keep that off the motion path */
+extern void *thread_sampler_start (void *);
+
+#endif /* _SAMPLER_H_ */
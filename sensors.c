@@ -0,0 +1,168 @@
+/*
+ *  sensors.c
+ *    Sensor types known to core and how their payload values are stored
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sensors.h"
+#include "common.h"
+#include "log.h"
+
+/* To add a sensor, add a field to struct SensorData and a row here and bump
+   SENSOR_COUNT. The order decides the order of the answer payload */
+const struct sensor_type sensor_types[SENSOR_COUNT] = {
+    { OUTTEMP,  "outtemp",  1, offsetof (struct SensorData, outtemp),
+      TSDB_SERIES_OUTTEMP,  false },
+    { INTEMP,   "intemp",   1, offsetof (struct SensorData, intemp),
+      TSDB_SERIES_INTEMP,   false },
+    { PRESSURE, "pressure", 1, offsetof (struct SensorData, pressure),
+      TSDB_SERIES_PRESSURE, false },
+    { HUMIDITY, "humidity", 1, offsetof (struct SensorData, humidity),
+      TSDB_SERIES_HUMIDITY, false },
+    { CPUTEMP,  "cputemp",  1, offsetof (struct SensorData, cputemp),
+      TSDB_SERIES_CPUTEMP,  true  },
+};
+
+_Static_assert (SENSOR_COUNT <= 32, "SensorData.present holds 32 bits");
+
+/* Indexed by sensor id, filled in by sensors_init */
+static const struct sensor_type *dispatch[SENSOR_ID_MAX];
+static uint32_t local_mask;
+
+void
+sensors_init (void)
+{
+    for (int i = 0; i < SENSOR_COUNT; i++)
+      {
+        const struct sensor_type *t = &sensor_types[i];
+
+        if (t->id < 0 || t->id >= SENSOR_ID_MAX)
+          {
+            log_error_en (ERANGE, "sensor id out of range");
+            continue;
+          }
+        dispatch[t->id] = t;
+        if (t->local)
+            local_mask |= 1U << i;
+      }
+}
+
+const struct sensor_type *
+sensors_lookup (int32_t id)
+{
+    if (id < 0 || id >= SENSOR_ID_MAX)
+        return NULL;
+
+    return dispatch[id];
+}
+
+uint32_t
+sensors_decode (struct SensorData *sd, const int32_t *payload, int length)
+{
+    uint32_t mask = 0;
+
+    for (int i = 0; i + 1 < length; i += 2)
+      {
+        const struct sensor_type *t = sensors_lookup (payload[i]);
+
+        if (t == NULL)
+          {
+            if (payload[i] != 0)
+                _log_debug ("ignoring unknown sensor id %" PRId32 "\n",
+                            payload[i]);
+            continue;
+          }
+
+        *sensor_slot (sd, t) = payload[i + 1] / t->scale;
+        mask |= 1U << sensor_index (t);
+      }
+    sd->present |= mask;
+
+    return mask;
+}
+
+int
+sensors_encode (const struct SensorData *sd, uint32_t mask, int32_t *payload)
+{
+    int length = 0;
+
+    mask &= sd->present;
+    for (int i = 0; i < SENSOR_COUNT; i++)
+      {
+        const struct sensor_type *t = &sensor_types[i];
+
+        if (!(mask & (1U << i)))
+            continue;
+
+        float v = *sensor_slot ((struct SensorData *) sd, t) * t->scale;
+        payload[length++] = t->id;
+        payload[length++] = (int32_t) (v < 0 ? v - 0.5f : v + 0.5f);
+      }
+
+    return length;
+}
+
+uint32_t
+sensors_local_mask (void)
+{
+    return local_mask;
+}
+
+int
+sensors_store_init (struct sensor_store *st)
+{
+    memset (&st->data, 0, sizeof (st->data));
+    seqlock_init (&st->lock);
+
+    return pthread_mutex_init (&st->write_mutex, NULL);
+}
+
+void
+sensors_store_destroy (struct sensor_store *st)
+{
+    ssize_t s;
+
+    s = pthread_mutex_destroy (&st->write_mutex);
+    if (s != 0)
+        log_error_en (s, "error in pthread_mutex_destroy");
+}
+
+void
+sensors_write_begin (struct sensor_store *st, struct SensorData *sd)
+{
+    pthread_mutex_lock (&st->write_mutex);
+
+    /* Only writers change it and this is the only one now */
+    *sd = st->data;
+}
+
+void
+sensors_write_end (struct sensor_store *st, const struct SensorData *sd)
+{
+    seqlock_write_begin (&st->lock);
+    st->data = *sd;
+    seqlock_write_end (&st->lock);
+
+    pthread_mutex_unlock (&st->write_mutex);
+}
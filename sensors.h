@@ -0,0 +1,111 @@
+/*
+ *  sensors.h
+ *    Registry of sensor types and table driven payload decoding
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SENSORS_H_
+#define _SENSORS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "seqlock.h"
+#include "common.h"
+
+/* Number of entries in the registry, see sensor_types in sensors.c */
+#define SENSOR_COUNT 5
+
+/* Sensor ids in payloads must be below this to be decoded */
+#define SENSOR_ID_MAX 64
+
+struct sensor_type {
+    int32_t    id;     /* Type sent in the payload, e.g. OUTTEMP */
+    const char *name;
+    float      scale;  /* Payload value is stored value times scale */
+    size_t     slot;   /* Offset of the value in struct SensorData */
+    int        series; /* Series in the time series file */
+    bool       local;  /* Measured by core, always part of the answer */
+};
+
+extern const struct sensor_type sensor_types[SENSOR_COUNT];
+
+/* Build the id to type dispatch table, call once before decoding */
+extern void sensors_init (void);
+
+/* Registry entry for id, NULL if unknown */
+extern const struct sensor_type *sensors_lookup (int32_t);
+
+/* Index of a registry entry, used as bit in SensorData.present */
+static inline int
+sensor_index (const struct sensor_type *t)
+{
+    return t - sensor_types;
+}
+
+static inline float *
+sensor_slot (struct SensorData *sd, const struct sensor_type *t)
+{
+    return (float *) ((char *) sd + t->slot);
+}
+
+/* Decode (id, value) pairs in any order into sd. Returns a mask of the
+   registry entries that were updated */
+extern uint32_t sensors_decode (struct SensorData *, const int32_t *, int);
+
+/* Encode the entries in mask as (id, value) pairs, payload must hold
+   2 * SENSOR_COUNT values. Returns the payload length */
+extern int sensors_encode (const struct SensorData *, uint32_t, int32_t *);
+
+/* Mask of entries with local set */
+extern uint32_t sensors_local_mask (void);
+
+/* Start with an empty version, returns non-zero on failure */
+extern int sensors_store_init (struct sensor_store *);
+
+extern void sensors_store_destroy (struct sensor_store *);
+
+/* Copy the latest version into sd and return its number, which changes with
+   every write. Never blocks and makes no syscalls */
+static inline unsigned int
+sensors_read (struct sensor_store *st, struct SensorData *sd)
+{
+    unsigned int seq;
+
+    do
+      {
+        seq = seqlock_read_begin (&st->lock);
+        *sd = st->data;
+      }
+    while (seqlock_read_retry (&st->lock, seq));
+
+    return seq / 2;
+}
+
+/* Copy the latest version into sd for a writer to change. Other writers
+   wait until it is published with sensors_write_end */
+extern void sensors_write_begin (struct sensor_store *, struct SensorData *);
+
+/* Publish sd as the latest version */
+extern void sensors_write_end (struct sensor_store *,
+                               const struct SensorData *);
+
+#endif /* _SENSORS_H_ */
@@ -0,0 +1,77 @@
+/*
+ *  seqlock.h
+ *    Sequence lock for data with one writer and readers that must not block
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* The sequence is odd while a write is in progress. A reader copies the
+   data between seqlock_read_begin and seqlock_read_retry and starts over if
+   the sequence changed meanwhile. Writers must be serialized by the caller */
+struct seqlock {
+    atomic_uint seq;
+};
+
+static inline void
+seqlock_init (struct seqlock *l)
+{
+    atomic_init (&l->seq, 0);
+}
+
+static inline unsigned int
+seqlock_read_begin (const struct seqlock *l)
+{
+    unsigned int seq;
+
+    while ((seq = atomic_load_explicit ((atomic_uint *) &l->seq,
+                                        memory_order_acquire)) & 1)
+        ;
+
+    return seq;
+}
+
+static inline bool
+seqlock_read_retry (const struct seqlock *l, unsigned int seq)
+{
+    atomic_thread_fence (memory_order_acquire);
+
+    return atomic_load_explicit ((atomic_uint *) &l->seq,
+                                 memory_order_relaxed) != seq;
+}
+
+static inline void
+seqlock_write_begin (struct seqlock *l)
+{
+    atomic_fetch_add_explicit (&l->seq, 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+}
+
+static inline void
+seqlock_write_end (struct seqlock *l)
+{
+    atomic_fetch_add_explicit (&l->seq, 1, memory_order_release);
+}
+
+#endif /* _SEQLOCK_H_ */
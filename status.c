@@ -0,0 +1,201 @@
+/*
+ *  status.c
+ *    Live status published in shared memory for local readers
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "status.h"
+#include "metrics.h"
+#include "sensors.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+struct status {
+    const char         *name;
+    struct status_page *page;
+    atomic_flag        motion_busy;  /* Taken by the motion writer */
+    unsigned int       sensors_seq;  /* Store version last published */
+};
+
+struct status *
+status_open (const char *name)
+{
+    int fd;
+    ssize_t s;
+    struct status *st;
+    struct status_page *page;
+
+    st = calloc (1, sizeof (struct status));
+    if (st == NULL)
+      {
+        log_error ("calloc failed for status");
+        return NULL;
+      }
+
+    fd = shm_open (name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      {
+        log_error ("shm_open failed");
+        free (st);
+        return NULL;
+      }
+
+    /* A page left by an earlier run is set up again in place. Cutting it
+       away first would fault readers that still map it */
+    s = ftruncate (fd, sizeof (struct status_page));
+    if (s < 0)
+      {
+        log_error ("ftruncate failed");
+        close (fd);
+        shm_unlink (name);
+        free (st);
+        return NULL;
+      }
+
+    page = mmap (NULL, sizeof (struct status_page), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    close (fd);
+    if (page == MAP_FAILED)
+      {
+        log_error ("mmap failed");
+        shm_unlink (name);
+        free (st);
+        return NULL;
+      }
+
+    st->name = name;
+    st->page = page;
+    atomic_flag_clear (&st->motion_busy);
+
+    /* Readers stop trusting an old page before it changes under them */
+    page->magic = 0;
+    atomic_thread_fence (memory_order_release);
+
+    memset ((char *) page + sizeof (page->magic), 0,
+            sizeof (*page) - sizeof (page->magic));
+    seqlock_init (&page->recording.lock);
+    seqlock_init (&page->motion.lock);
+    seqlock_init (&page->sampled.lock);
+    page->version = STATUS_VERSION;
+    page->size = sizeof (struct status_page);
+    page->pid = getpid ();
+    page->recording.record_state = RECORD_IDLE;
+    page->sampled.updated_ms = clock_wall_ms ();
+
+    /* Last, a reader seeing the magic sees the rest */
+    atomic_thread_fence (memory_order_release);
+    page->magic = STATUS_MAGIC;
+
+    return st;
+}
+
+void
+status_close (struct status *st)
+{
+    if (st == NULL)
+        return;
+
+    munmap (st->page, sizeof (struct status_page));
+    shm_unlink (st->name);
+    free (st);
+}
+
+void
+status_recording (struct status *st, struct recording *r)
+{
+    enum record_state state;
+    struct status_page *page;
+
+    if (st == NULL)
+        return;
+
+    state = record_get_state (r);
+    page = st->page;
+    seqlock_write_begin (&page->recording.lock);
+    page->recording.record_state = state;
+    page->recording.cameras = atomic_load (&r->cameras);
+
+    /* From when the first camera records until the last one has stopped */
+    if (state == RECORD_IDLE || state == RECORD_STARTING)
+        page->recording.recording_start_ms = 0;
+    else if (page->recording.recording_start_ms == 0)
+        page->recording.recording_start_ms = clock_wall_ms ();
+    seqlock_write_end (&page->recording.lock);
+}
+
+void
+status_motion (struct status *st, uint32_t zones)
+{
+    struct status_page *page;
+
+    if (st == NULL)
+        return;
+
+    /* With wiringPi every zone has a thread of its own. Rather than wait,
+       the one coming second leaves the motion of the first on the page */
+    if (atomic_flag_test_and_set_explicit (&st->motion_busy,
+                                           memory_order_acquire))
+        return;
+
+    page = st->page;
+    seqlock_write_begin (&page->motion.lock);
+    page->motion.last_motion_ms = clock_wall_ms ();
+    page->motion.last_motion_zones = zones;
+    seqlock_write_end (&page->motion.lock);
+
+    atomic_flag_clear_explicit (&st->motion_busy, memory_order_release);
+}
+
+void
+status_refresh (struct status *st, struct sensor_store *store)
+{
+    unsigned int seq;
+    int64_t now_ms;
+    struct SensorData sd;
+    struct status_page *page;
+
+    if (st == NULL)
+        return;
+
+    seq = sensors_read (store, &sd);
+    now_ms = clock_wall_ms ();
+
+    page = st->page;
+    seqlock_write_begin (&page->sampled.lock);
+    if (seq != st->sensors_seq)
+      {
+        page->sampled.sensors = sd;
+        page->sampled.sensors_ms = now_ms;
+        st->sensors_seq = seq;
+      }
+    page->sampled.edges = metrics_read (METRIC_ISR);
+    page->sampled.recordings = metrics_read (METRIC_RECORDINGS_STARTED);
+    page->sampled.recorded_ms = metrics_read (METRIC_RECORDING_MS_SUM);
+    page->sampled.sensor_requests = metrics_read (METRIC_SENSOR_REQUESTS);
+    page->sampled.updated_ms = now_ms;
+    seqlock_write_end (&page->sampled.lock);
+}
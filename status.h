@@ -0,0 +1,145 @@
+/*
+ *  status.h
+ *    Live status published in shared memory for local readers
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _STATUS_H_
+#define _STATUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "seqlock.h"
+#include "common.h"
+
+#define STATUS_MAGIC 0x54534746 /* "FGST" */
+
+/* Bumped whenever struct status_page changes */
+#define STATUS_VERSION 2
+
+/* Times status_read tries a section before giving up on a write that never
+   ends, e.g. because core died in the middle of it */
+#define STATUS_READ_TRIES 1000
+
+/* Layout of the segment STATUS_SHM_NAME. Readers map it read-only and copy
+   it with status_read, core never waits for them. Each section has a
+   single writer and a seqlock of its own, so no writer waits for another.
+   Times are milliseconds since epoch */
+struct status_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                          /* sizeof (struct status_page) */
+    int32_t  pid;                           /* Of core */
+
+    /* Written by the thread watching picam on every change */
+    struct {
+        struct seqlock lock;
+        int32_t        record_state;        /* enum record_state */
+        uint32_t       cameras;             /* Mask of cameras recording */
+        int64_t        recording_start_ms;  /* 0 unless recording */
+    } recording;
+
+    /* Written on motion by whichever thread delivered the edges */
+    struct {
+        struct seqlock lock;
+        int64_t        last_motion_ms;
+        uint32_t       last_motion_zones;
+    } motion;
+
+    /* Refreshed every SAMPLER_PERIOD_MS by the sampler thread, counters
+       are as of updated_ms */
+    struct {
+        struct seqlock    lock;
+        struct SensorData sensors;
+        int64_t           sensors_ms;       /* When sensors last changed */
+        int64_t           updated_ms;
+        uint64_t          edges;
+        uint64_t          recordings;       /* Started */
+        uint64_t          recorded_ms;      /* Of recordings stopped */
+        uint64_t          sensor_requests;
+    } sampled;
+};
+
+struct status;
+
+/* Create the segment name and publish an empty page. Returns NULL on
+   failure, the status is then not published */
+extern struct status *status_open (const char *);
+
+/* Unmap and remove the segment, readers still mapping it keep the last
+   page */
+extern void status_close (struct status *);
+
+/* Publish the state of the recording. Called by the thread watching picam
+   on every change. Nothing if the status is NULL, like below */
+extern void status_recording (struct status *, struct recording *);
+
+/* Publish motion in zones just now. Never blocks, an update racing one
+   from another zone's thread is dropped */
+extern void status_motion (struct status *, uint32_t);
+
+/* Publish the counters and the latest version in the sensor store, called
+   by the sampler thread */
+extern void status_refresh (struct status *, struct sensor_store *);
+
+/* Copy one section under its seqlock, giving up after STATUS_READ_TRIES */
+static inline int
+status_read_section (const struct seqlock *lock, void *copy,
+                     const void *section, size_t size)
+{
+    unsigned int seq;
+
+    for (int i = 0; i < STATUS_READ_TRIES; i++)
+      {
+        seq = atomic_load_explicit ((atomic_uint *) &lock->seq,
+                                    memory_order_acquire);
+        if (seq & 1)
+            continue;
+        memcpy (copy, section, size);
+        if (!seqlock_read_retry (lock, seq))
+            return 0;
+      }
+
+    return 1;
+}
+
+/* Copy a consistent page into copy, for readers in other processes. Each
+   section is consistent by itself. Returns non-zero if page is not a
+   status page of this version or a section is never left alone */
+static inline int
+status_read (const struct status_page *page, struct status_page *copy)
+{
+    if (page->magic != STATUS_MAGIC || page->version != STATUS_VERSION ||
+        page->size != sizeof (struct status_page))
+        return 1;
+
+    memcpy (copy, page, offsetof (struct status_page, recording));
+
+    return status_read_section (&page->recording.lock, &copy->recording,
+                                &page->recording, sizeof (page->recording)) ||
+           status_read_section (&page->motion.lock, &copy->motion,
+                                &page->motion, sizeof (page->motion)) ||
+           status_read_section (&page->sampled.lock, &copy->sampled,
+                                &page->sampled, sizeof (page->sampled));
+}
+
+#endif /* _STATUS_H_ */
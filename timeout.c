@@ -29,20 +29,17 @@
 #include <stdbool.h>
 #include <string.h>
 
-#include <wiringPi/wiringPi.h>
-
 #include "motion.h"
 #include "timeout.h"
+#include "picam_state.h"
+#include "metrics.h"
+#include "clock.h"
 #include "common.h"
 #include "log.h"
 
-/* Forward declarations used in this file. */
-static void cleanup_handler (void *);
-
 /* Used internally by thread to store allocated resources  */
 struct internal_t_data {
     int             poll_fds_len;
-    pthread_mutex_t record_mutex;
     struct pollfd   poll_fds[2];
 };
 
@@ -51,12 +48,9 @@ void *
 thread_timeout_start (void *arg)
 {
     ssize_t s, events;
-    uint64_t u;
     struct thread_data *tdata = arg;
     struct internal_t_data itdata;
 
-    itdata.record_mutex = tdata->record_mutex;
-
     /* Put the thread in deferred cancellation mode to avoid the scenario
        where the thread gets cancelled in the middle of the execution of 
        our cleanup handler */
@@ -82,54 +76,61 @@ thread_timeout_start (void *arg)
         _log_debug ("timeout.c: poll call blocking, waiting for fd %d\n", itdata.poll_fds[0].fd);
         s = poll (itdata.poll_fds, 2, -1);
 
-        _log_debug ("timeout.c: poll returned %d on fd %d\n", s, itdata.poll_fds[0].fd);
+        _log_debug ("timeout.c: poll returned %zd on fd %d\n", s, itdata.poll_fds[0].fd);
         if (s < 0)
+          {
             log_error("poll failed");
+            metrics_inc (METRIC_POLL_ERRORS);
+          }
         else if (s > 0)
           {
-            if (!check_sensor_active (tdata) &&
-                atomic_load (&tdata->is_recording))
-              {
-                pthread_cleanup_push (&cleanup_handler, &itdata);
-                pthread_mutex_lock (&itdata.record_mutex);
-
-                /* Instead of using a pthread condition variable we use a
-                   eventfd object to notify other threads because we can then
-                   poll on multiple file descriptors */
-                u = 2;
-                s = write (tdata->record_eventfd, &u, sizeof (uint64_t));
-                if (s < 0)
-                    log_error ("write failed");
-
-                pthread_cleanup_pop (1);
-              }
-            else
-              {
-                _log_debug ("not stopping recording (is_recording = %s)\n",
-                            atomic_load (&tdata->is_recording) ? "true" :
-                                                                 "false");
-              }
-
             /* If there is data to read on timerpipe, we shall exit */
             if (itdata.poll_fds[1].revents & events)
               {
                 break;
               }
 
-            s = read (itdata.poll_fds[0].fd, &u, sizeof (uint64_t));
-            if (s < 0)
-                log_error ("read failed");
+            if (itdata.poll_fds[0].revents & events)
+                timeout_handle_expiration (tdata);
           }
       }
 
     return NULL;
 }
 
-/* This function is used to cleanup thread */
-static void
-cleanup_handler(void *arg)
+/* Called when timerfd is readable, either from the timer thread or from the
+   reactor. Tells the picam thread to stop recording if PIR sensor is LOW */
+void
+timeout_handle_expiration (struct thread_data *tdata)
 {
-    struct internal_t_data *itdata = arg;
+    ssize_t s;
+    uint64_t u;
+    struct cmd cmd;
+
+    s = read (tdata->timerfd, &u, sizeof (uint64_t));
+    if (s < 0)
+      {
+        /* EAGAIN means the timer was re-armed after it expired */
+        if (errno != EAGAIN)
+            log_error ("read failed");
+        return;
+      }
+    metrics_inc (METRIC_TIMER_EXPIRATIONS);
 
-    pthread_mutex_unlock (&itdata->record_mutex);
-}
\ No newline at end of file
+    if (!check_sensor_active (tdata) && record_active (&tdata->recording) &&
+        !motion_defer_stop (tdata))
+      {
+        /* Every camera of the recording stops together, including those
+           that joined it later */
+        memset (&cmd, 0, sizeof (cmd));
+        cmd.type = CMD_STOP;
+        cmd.source = CMD_SOURCE_TIMER;
+        cmd.trigger_ns = clock_now_ns ();
+        picam_send (tdata, &cmd);
+      }
+    else
+      {
+        _log_debug ("not stopping recording (recording is %s)\n",
+                    record_state_name (record_get_state (&tdata->recording)));
+      }
+}
@@ -27,7 +27,12 @@
 #include <pthread.h>
 #include <poll.h>
 
+#include "common.h"
+
 /* This function is invoked by core as the timer thread is created */
 extern void *thread_timeout_start (void *);
 
+/* Handle a readable timerfd, used by both the timer thread and the reactor */
+extern void timeout_handle_expiration (struct thread_data *);
+
 #endif /* _TIMEOUT_H_ */
\ No newline at end of file
@@ -49,6 +49,7 @@
 #include <sys/ioctl.h>
 
 #include "touch.h"
+#include "clock.h"
 #include "common.h"
 #include "log.h"
 
@@ -98,7 +99,7 @@ touch (const char *file)
       new_times[0] = info.st_atim;
 
       /* set mtime to current time */
-      clock_gettime (CLOCK_REALTIME, &new_times[1]);
+      clock_wall_ts (&new_times[1]);
     }
 
   if (fdutimensat (fd, AT_FDCWD, file, new_times, 0))
@@ -0,0 +1,113 @@
+/*
+ *  trace.c
+ *    Per stage latency of motion to recording
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <time.h>
+
+#include "trace.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+static const char *const stage_names[TRACE_NSTAGES] = {
+    "edge_to_signal",
+    "signal_to_wakeup",
+    "wakeup_to_hook",
+    "hook_to_recording",
+    "total"
+};
+
+void
+trace_init (struct trace *t)
+{
+    atomic_init (&t->active, false);
+    for (int i = 0; i < TRACE_NPOINTS; i++)
+        atomic_init (&t->stamps[i], 0);
+    for (int i = 0; i < TRACE_NSTAGES; i++)
+        hist_init (&t->stages[i]);
+}
+
+void
+trace_begin (struct trace *t, uint64_t edge_ns)
+{
+    for (int i = 0; i < TRACE_NPOINTS; i++)
+        atomic_store_explicit (&t->stamps[i], 0, memory_order_relaxed);
+    atomic_store_explicit (&t->stamps[TRACE_EDGE], edge_ns,
+                           memory_order_relaxed);
+    atomic_store_explicit (&t->active, true, memory_order_release);
+}
+
+void
+trace_mark (struct trace *t, enum trace_point point)
+{
+    if (atomic_load_explicit (&t->active, memory_order_acquire))
+        atomic_store_explicit (&t->stamps[point], clock_now_ns (),
+                               memory_order_relaxed);
+}
+
+void
+trace_end (struct trace *t, enum trace_point point)
+{
+    uint64_t stamps[TRACE_NPOINTS];
+
+    if (!atomic_compare_exchange_strong (&t->active, (_Bool[]) { true },
+                                         false))
+        return;
+
+    atomic_store_explicit (&t->stamps[point], clock_now_ns (),
+                           memory_order_relaxed);
+    for (int i = 0; i < TRACE_NPOINTS; i++)
+        stamps[i] = atomic_load_explicit (&t->stamps[i],
+                                          memory_order_relaxed);
+
+    for (int i = 0; i < TRACE_NPOINTS - 1; i++)
+      {
+        if (stamps[i] == 0 || stamps[i + 1] < stamps[i])
+            continue;
+        hist_record (&t->stages[i], (stamps[i + 1] - stamps[i]) / 1000);
+      }
+
+    if (stamps[point] >= stamps[TRACE_EDGE])
+        hist_record (&t->stages[TRACE_NSTAGES - 1],
+                     (stamps[point] - stamps[TRACE_EDGE]) / 1000);
+}
+
+const char *
+trace_stage_name (int stage)
+{
+    return stage_names[stage];
+}
+
+void
+trace_dump (struct trace *t)
+{
+    for (int i = 0; i < TRACE_NSTAGES; i++)
+      {
+        struct histogram *h = &t->stages[i];
+
+        _log_debug ("%s: %" PRIuFAST64 " samples, p50 %" PRIu64 " us, p90 %"
+                    PRIu64 " us, p99 %" PRIu64 " us, max %" PRIuFAST64
+                    " us\n", stage_names[i], atomic_load (&h->count),
+                    hist_percentile (h, 50), hist_percentile (h, 90),
+                    hist_percentile (h, 99), atomic_load (&h->max));
+      }
+}
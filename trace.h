@@ -0,0 +1,74 @@
+/*
+ *  trace.h
+ *    Timestamps of a recording trigger through each stage to picam
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "hist.h"
+
+/* Points a recording trigger passes in order */
+enum trace_point {
+    TRACE_EDGE,      /* PIR rising edge, kernel timestamp when available */
+    TRACE_SIGNALLED, /* Start written to record_eventfd */
+    TRACE_WAKEUP,    /* Picam thread has read record_eventfd */
+    TRACE_HOOK,      /* Start hook delivered */
+    TRACE_RECORDING, /* Picam reports record = true */
+    TRACE_NPOINTS
+};
+
+/* Histogram i holds the time from point i to point i + 1, the last one
+   the time from edge to recording */
+#define TRACE_NSTAGES TRACE_NPOINTS
+
+/* Only one start can be in flight since recording.start_queued guards it,
+   so a single set of stamps is enough. Stamps are written by the thread
+   reaching the point and the eventfd and state file hand offs order them */
+struct trace {
+    atomic_bool          active;
+    atomic_uint_fast64_t stamps[TRACE_NPOINTS];
+    struct histogram     stages[TRACE_NSTAGES];
+};
+
+extern void trace_init (struct trace *);
+
+/* Start tracing a trigger whose edge happened at edge_ns (gpio_now_ns) */
+extern void trace_begin (struct trace *, uint64_t);
+
+/* Stamp point with the current time */
+extern void trace_mark (struct trace *, enum trace_point);
+
+/* Stamp point as the last one reached and record every stage, points not
+   reached are skipped */
+extern void trace_end (struct trace *, enum trace_point);
+
+/* Stage names for dumps, "total" for the last one */
+extern const char *trace_stage_name (int);
+
+/* Log count and percentiles of every stage */
+extern void trace_dump (struct trace *);
+
+#endif /* _TRACE_H_ */
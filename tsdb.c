@@ -0,0 +1,667 @@
+/*
+ *  tsdb.c
+ *    Chunked time series file using delta-of-delta timestamps and XOR
+ *    compressed values
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+/*
+ * Each series has one chunk in memory. Points are bit packed into it as in
+ * Facebook's Gorilla paper: the first point is stored raw, after that the
+ * timestamp is stored as the difference between consecutive deltas using a
+ * variable length prefix code, and the value as the XOR with the previous
+ * value where only the meaningful bits are kept. When the chunk is full, or
+ * its first point is older than TSDB_SEAL_AGE_MS, it gets its header and
+ * CRC and is written with one pwrite at the end of the file.
+ *
+ * Appending only stages the point in a lock-free ring, so the picam and
+ * fgevents threads never wait for the SD card. The sampler thread drains
+ * the ring into the chunks and does the writes.
+ *
+ * A power cut can at worst leave a torn last chunk, which fails its CRC and
+ * is cut off by tsdb_open.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tsdb.h"
+#include "clock.h"
+#include "common.h"
+#include "log.h"
+
+#define HEADER_LEN sizeof (struct tsdb_chunk_header)
+#define BODY_BITS ((TSDB_CHUNK_SIZE - HEADER_LEN) * 8)
+
+/* Worst case size of one point: '1111' + 64 bit delta-of-delta and
+   '11' + 5 + 6 + 64 bit value */
+#define MAX_POINT_BITS (4 + 64 + 2 + 5 + 6 + 64)
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void
+init_crc_table (void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+      {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+      }
+}
+
+/* CRC-32 of a chunk, computed as if the crc field was zero */
+static uint32_t
+chunk_crc (const uint8_t *chunk)
+{
+    uint32_t c = 0xFFFFFFFF;
+    size_t crc_off = offsetof (struct tsdb_chunk_header, crc);
+
+    pthread_once (&crc_once, &init_crc_table);
+    for (size_t i = 0; i < TSDB_CHUNK_SIZE; i++)
+      {
+        uint8_t b = i >= crc_off && i < crc_off + 4 ? 0 : chunk[i];
+        c = crc_table[(c ^ b) & 0xFF] ^ (c >> 8);
+      }
+
+    return c ^ 0xFFFFFFFF;
+}
+
+static bool
+chunk_valid (const uint8_t *chunk)
+{
+    const struct tsdb_chunk_header *h = (const void *) chunk;
+
+    return h->magic == TSDB_MAGIC && h->series < TSDB_NSERIES &&
+           h->nbits <= BODY_BITS && h->crc == chunk_crc (chunk);
+}
+
+static void
+put_bits (uint8_t *body, uint32_t *pos, uint64_t v, int n)
+{
+    for (int i = n - 1; i >= 0; i--)
+      {
+        if ((v >> i) & 1)
+            body[*pos >> 3] |= 0x80 >> (*pos & 7);
+        (*pos)++;
+      }
+}
+
+static uint64_t
+get_bits (const uint8_t *body, uint32_t *pos, int n)
+{
+    uint64_t v = 0;
+
+    for (int i = 0; i < n; i++)
+      {
+        v = (v << 1) | ((body[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+        (*pos)++;
+      }
+
+    return v;
+}
+
+static uint64_t
+double_bits (double d)
+{
+    uint64_t u;
+
+    memcpy (&u, &d, sizeof (u));
+    return u;
+}
+
+static double
+bits_double (uint64_t u)
+{
+    double d;
+
+    memcpy (&d, &u, sizeof (d));
+    return d;
+}
+
+int64_t
+tsdb_now_ms (void)
+{
+    return clock_wall_ms ();
+}
+
+/* Write the open chunk of series to the end of the file and reset it */
+static int
+seal_chunk (struct tsdb *db, int series)
+{
+    ssize_t s;
+    struct tsdb_open_chunk *oc = &db->open[series];
+    struct tsdb_chunk_header *h = (struct tsdb_chunk_header *) oc->buf;
+    int64_t now;
+
+    if (oc->count == 0)
+        return 0;
+
+    now = tsdb_now_ms ();
+    if (now < db->last_seal_ts)
+        now = db->last_seal_ts;
+
+    h->magic = TSDB_MAGIC;
+    h->series = series;
+    h->count = oc->count;
+    h->first_ts = oc->first_ts;
+    h->last_ts = oc->prev_ts;
+    h->seal_ts = now;
+    h->nbits = oc->nbits;
+    h->crc = chunk_crc (oc->buf);
+
+    s = pwrite (db->fd, oc->buf, TSDB_CHUNK_SIZE,
+                db->nchunks * TSDB_CHUNK_SIZE);
+    if (s != TSDB_CHUNK_SIZE)
+      {
+        if (s >= 0)
+            errno = EIO;
+        log_error ("could not write time series chunk");
+        /* Keep the points, the next seal retries at the same offset */
+        return 1;
+      }
+
+    db->nchunks++;
+    db->last_seal_ts = now;
+
+    memset (oc->buf, 0, TSDB_CHUNK_SIZE);
+    oc->nbits = 0;
+    oc->count = 0;
+
+    return 0;
+}
+
+int
+tsdb_open (struct tsdb *db, const char *path)
+{
+    ssize_t s;
+    struct stat st;
+    uint8_t *chunk;
+
+    memset (db, 0, sizeof (*db));
+    db->fd = -1;
+    for (size_t i = 0; i < TSDB_STAGE_SIZE; i++)
+        atomic_init (&db->stage[i].seq, i);
+    atomic_init (&db->stage_head, 0);
+    atomic_init (&db->stage_tail, 0);
+    atomic_init (&db->dropped, 0);
+
+    chunk = malloc (TSDB_CHUNK_SIZE);
+    if (chunk == NULL)
+      {
+        log_error ("malloc failed for time series chunk");
+        return 1;
+      }
+
+    db->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (db->fd < 0)
+      {
+        log_error ("could not open time series file");
+        free (chunk);
+        return 1;
+      }
+
+    s = fstat (db->fd, &st);
+    if (s < 0)
+      {
+        log_error ("fstat failed");
+        free (chunk);
+        close (db->fd);
+        db->fd = -1;
+        return 1;
+      }
+
+    /* Only the tail can be torn, drop chunks from the end until one is
+       intact */
+    db->nchunks = st.st_size / TSDB_CHUNK_SIZE;
+    while (db->nchunks > 0)
+      {
+        s = pread (db->fd, chunk, TSDB_CHUNK_SIZE,
+                   (db->nchunks - 1) * TSDB_CHUNK_SIZE);
+        if (s == TSDB_CHUNK_SIZE && chunk_valid (chunk))
+          {
+            db->last_seal_ts = ((struct tsdb_chunk_header *) chunk)->seal_ts;
+            break;
+          }
+        db->nchunks--;
+      }
+    free (chunk);
+
+    if ((off_t) (db->nchunks * TSDB_CHUNK_SIZE) != st.st_size)
+      {
+        _log_debug ("tsdb: truncating torn tail of %s\n", path);
+        if (ftruncate (db->fd, db->nchunks * TSDB_CHUNK_SIZE) < 0)
+            log_error ("ftruncate failed");
+      }
+
+    for (int i = 0; i < TSDB_NSERIES; i++)
+      {
+        if (posix_memalign ((void **) &db->open[i].buf, TSDB_CHUNK_SIZE,
+                            TSDB_CHUNK_SIZE) != 0)
+          {
+            log_error ("posix_memalign failed for time series chunk");
+            tsdb_close (db);
+            return 1;
+          }
+        memset (db->open[i].buf, 0, TSDB_CHUNK_SIZE);
+      }
+
+    pthread_mutex_init (&db->mutex, NULL);
+
+    return 0;
+}
+
+/* Bit pack one point into the open chunk */
+static void
+encode_point (struct tsdb_open_chunk *oc, int64_t ts, uint64_t value)
+{
+    uint8_t *body = oc->buf + HEADER_LEN;
+
+    if (oc->count == 0)
+      {
+        put_bits (body, &oc->nbits, (uint64_t) ts, 64);
+        put_bits (body, &oc->nbits, value, 64);
+        oc->first_ts = ts;
+        oc->prev_delta = 0;
+        oc->prev_leading = -1;
+      }
+    else
+      {
+        int64_t delta = ts - oc->prev_ts;
+        int64_t dod = delta - oc->prev_delta;
+        uint64_t x = value ^ oc->prev_value;
+
+        if (dod == 0)
+            put_bits (body, &oc->nbits, 0, 1);
+        else if (dod >= -63 && dod <= 64)
+          {
+            put_bits (body, &oc->nbits, 0x2, 2);
+            put_bits (body, &oc->nbits, dod + 63, 7);
+          }
+        else if (dod >= -255 && dod <= 256)
+          {
+            put_bits (body, &oc->nbits, 0x6, 3);
+            put_bits (body, &oc->nbits, dod + 255, 9);
+          }
+        else if (dod >= -2047 && dod <= 2048)
+          {
+            put_bits (body, &oc->nbits, 0xE, 4);
+            put_bits (body, &oc->nbits, dod + 2047, 12);
+          }
+        else
+          {
+            put_bits (body, &oc->nbits, 0xF, 4);
+            put_bits (body, &oc->nbits, (uint64_t) dod, 64);
+          }
+        oc->prev_delta = delta;
+
+        if (x == 0)
+            put_bits (body, &oc->nbits, 0, 1);
+        else
+          {
+            int leading = __builtin_clzll (x);
+            int trailing = __builtin_ctzll (x);
+
+            if (leading > 31)
+                leading = 31;
+
+            put_bits (body, &oc->nbits, 1, 1);
+            if (oc->prev_leading >= 0 && leading >= oc->prev_leading &&
+                trailing >= oc->prev_trailing)
+              {
+                /* Meaningful bits fit the previous window */
+                int len = 64 - oc->prev_leading - oc->prev_trailing;
+                put_bits (body, &oc->nbits, 0, 1);
+                put_bits (body, &oc->nbits, x >> oc->prev_trailing, len);
+              }
+            else
+              {
+                int len = 64 - leading - trailing;
+                put_bits (body, &oc->nbits, 1, 1);
+                put_bits (body, &oc->nbits, leading, 5);
+                put_bits (body, &oc->nbits, len - 1, 6);
+                put_bits (body, &oc->nbits, x >> trailing, len);
+                oc->prev_leading = leading;
+                oc->prev_trailing = trailing;
+              }
+          }
+      }
+
+    oc->prev_ts = ts;
+    oc->prev_value = value;
+    oc->count++;
+}
+
+int
+tsdb_append (struct tsdb *db, int series, int64_t ts, double value)
+{
+    size_t pos, seq;
+    struct tsdb_point *p;
+
+    if (db == NULL || db->fd < 0 || series < 0 || series >= TSDB_NSERIES)
+        return 1;
+
+    pos = atomic_load_explicit (&db->stage_head, memory_order_relaxed);
+    while (1)
+      {
+        p = &db->stage[pos & (TSDB_STAGE_SIZE - 1)];
+        seq = atomic_load_explicit (&p->seq, memory_order_acquire);
+        if (seq == pos)
+          {
+            if (atomic_compare_exchange_weak_explicit (&db->stage_head,
+                                                       &pos, pos + 1,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed))
+                break;
+          }
+        else if ((ptrdiff_t) (seq - pos) < 0)
+          {
+            /* Still holding a point from the previous lap */
+            atomic_fetch_add_explicit (&db->dropped, 1,
+                                       memory_order_relaxed);
+            return 1;
+          }
+        else
+            pos = atomic_load_explicit (&db->stage_head,
+                                        memory_order_relaxed);
+      }
+
+    p->series = series;
+    p->ts = ts;
+    p->value = value;
+    atomic_store_explicit (&p->seq, pos + 1, memory_order_release);
+
+    return 0;
+}
+
+/* Encode one staged point, db->mutex held */
+static int
+encode_staged (struct tsdb *db, const struct tsdb_point *p)
+{
+    ssize_t s = 0;
+    int64_t ts = p->ts;
+    struct tsdb_open_chunk *oc = &db->open[p->series];
+
+    /* Timestamps must not go backwards within a chunk */
+    if (oc->count > 0 && ts < oc->prev_ts)
+        ts = oc->prev_ts;
+
+    if (oc->nbits + MAX_POINT_BITS > BODY_BITS || oc->count == UINT16_MAX)
+        s = seal_chunk (db, p->series);
+
+    if (s == 0 || oc->nbits + MAX_POINT_BITS <= BODY_BITS)
+        encode_point (oc, ts, double_bits (p->value));
+
+    return s;
+}
+
+/* Encode every point staged so far, db->mutex held. A point still being
+   written by its producer ends the drain, the next one picks it up */
+static int
+drain_stage (struct tsdb *db)
+{
+    ssize_t s = 0;
+    size_t tail = atomic_load_explicit (&db->stage_tail, memory_order_relaxed);
+
+    while (1)
+      {
+        struct tsdb_point *p = &db->stage[tail & (TSDB_STAGE_SIZE - 1)];
+
+        if (atomic_load_explicit (&p->seq, memory_order_acquire) != tail + 1)
+            break;
+
+        s |= encode_staged (db, p);
+        atomic_store_explicit (&p->seq, tail + TSDB_STAGE_SIZE,
+                               memory_order_release);
+        tail++;
+      }
+    atomic_store_explicit (&db->stage_tail, tail, memory_order_relaxed);
+
+    return s;
+}
+
+int
+tsdb_drain (struct tsdb *db)
+{
+    ssize_t s;
+    int64_t now;
+
+    if (db == NULL || db->fd < 0)
+        return 1;
+
+    pthread_mutex_lock (&db->mutex);
+    s = drain_stage (db);
+
+    /* Bound how much a crash can lose */
+    now = tsdb_now_ms ();
+    for (int i = 0; i < TSDB_NSERIES; i++)
+      {
+        if (db->open[i].count > 0 &&
+            now - db->open[i].first_ts >= TSDB_SEAL_AGE_MS)
+            s |= seal_chunk (db, i);
+      }
+    pthread_mutex_unlock (&db->mutex);
+
+    return s;
+}
+
+int
+tsdb_flush (struct tsdb *db)
+{
+    ssize_t s;
+
+    if (db == NULL || db->fd < 0)
+        return 1;
+
+    pthread_mutex_lock (&db->mutex);
+    s = drain_stage (db);
+    for (int i = 0; i < TSDB_NSERIES; i++)
+        s |= seal_chunk (db, i);
+    if (fdatasync (db->fd) < 0)
+      {
+        log_error ("fdatasync failed");
+        s = 1;
+      }
+    pthread_mutex_unlock (&db->mutex);
+
+    return s;
+}
+
+void
+tsdb_close (struct tsdb *db)
+{
+    if (db->fd >= 0)
+      {
+        _log_debug ("tsdb: %" PRIuFAST64 " points dropped by a full "
+                    "stage\n", atomic_load (&db->dropped));
+        tsdb_flush (db);
+        close (db->fd);
+        pthread_mutex_destroy (&db->mutex);
+      }
+    db->fd = -1;
+
+    for (int i = 0; i < TSDB_NSERIES; i++)
+      {
+        free (db->open[i].buf);
+        db->open[i].buf = NULL;
+      }
+}
+
+int
+tsdb_reader_open (struct tsdb_reader *rd, const char *path)
+{
+    struct stat st;
+
+    memset (rd, 0, sizeof (*rd));
+
+    rd->fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (rd->fd < 0)
+      {
+        log_error ("could not open time series file");
+        return 1;
+      }
+
+    if (fstat (rd->fd, &st) < 0)
+      {
+        log_error ("fstat failed");
+        close (rd->fd);
+        return 1;
+      }
+
+    rd->nchunks = st.st_size / TSDB_CHUNK_SIZE;
+    rd->map_len = rd->nchunks * TSDB_CHUNK_SIZE;
+    if (rd->map_len == 0)
+        return 0;
+
+    rd->map = mmap (NULL, rd->map_len, PROT_READ, MAP_SHARED, rd->fd, 0);
+    if (rd->map == MAP_FAILED)
+      {
+        log_error ("mmap failed");
+        rd->map = NULL;
+        close (rd->fd);
+        return 1;
+      }
+
+    /* Ignore a torn tail the same way the writer does */
+    while (rd->nchunks > 0 &&
+           !chunk_valid (rd->map + (rd->nchunks - 1) * TSDB_CHUNK_SIZE))
+        rd->nchunks--;
+
+    return 0;
+}
+
+uint64_t
+tsdb_reader_seek (struct tsdb_reader *rd, int64_t ts)
+{
+    uint64_t lo = 0, hi = rd->nchunks;
+
+    /* A chunk holding a point at or after ts was sealed at or after ts */
+    while (lo < hi)
+      {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const struct tsdb_chunk_header *h =
+                (const void *) (rd->map + mid * TSDB_CHUNK_SIZE);
+
+        if (h->seal_ts < ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+      }
+
+    return lo;
+}
+
+/* Decode every point of chunk and pass those in range to cb */
+static void
+decode_chunk (const uint8_t *chunk, int64_t from, int64_t to,
+              tsdb_point_cb cb, void *arg)
+{
+    const struct tsdb_chunk_header *h = (const void *) chunk;
+    const uint8_t *body = chunk + HEADER_LEN;
+    uint32_t pos = 0;
+    int64_t ts = 0, delta = 0;
+    uint64_t value = 0;
+    int leading = 0, trailing = 0;
+
+    for (uint32_t i = 0; i < h->count && pos <= h->nbits; i++)
+      {
+        if (i == 0)
+          {
+            ts = (int64_t) get_bits (body, &pos, 64);
+            value = get_bits (body, &pos, 64);
+          }
+        else
+          {
+            int64_t dod;
+
+            if (get_bits (body, &pos, 1) == 0)
+                dod = 0;
+            else if (get_bits (body, &pos, 1) == 0)
+                dod = (int64_t) get_bits (body, &pos, 7) - 63;
+            else if (get_bits (body, &pos, 1) == 0)
+                dod = (int64_t) get_bits (body, &pos, 9) - 255;
+            else if (get_bits (body, &pos, 1) == 0)
+                dod = (int64_t) get_bits (body, &pos, 12) - 2047;
+            else
+                dod = (int64_t) get_bits (body, &pos, 64);
+            delta += dod;
+            ts += delta;
+
+            if (get_bits (body, &pos, 1) == 1)
+              {
+                if (get_bits (body, &pos, 1) == 1)
+                  {
+                    leading = get_bits (body, &pos, 5);
+                    trailing = 64 - leading -
+                               ((int) get_bits (body, &pos, 6) + 1);
+                  }
+                value ^= get_bits (body, &pos, 64 - leading - trailing) <<
+                         trailing;
+              }
+          }
+
+        if (ts >= from && ts <= to)
+            cb (arg, h->series, ts, bits_double (value));
+      }
+}
+
+int
+tsdb_query (struct tsdb_reader *rd, int series, int64_t from, int64_t to,
+            tsdb_point_cb cb, void *arg)
+{
+    for (uint64_t i = tsdb_reader_seek (rd, from); i < rd->nchunks; i++)
+      {
+        const uint8_t *chunk = rd->map + i * TSDB_CHUNK_SIZE;
+        const struct tsdb_chunk_header *h = (const void *) chunk;
+
+        if ((series >= 0 && h->series != series) || h->last_ts < from ||
+            h->first_ts > to)
+            continue;
+
+        if (!chunk_valid (chunk))
+          {
+            _log_debug ("tsdb: skipping corrupt chunk %" PRIu64 "\n", i);
+            continue;
+          }
+
+        decode_chunk (chunk, from, to, cb, arg);
+      }
+
+    return 0;
+}
+
+void
+tsdb_reader_close (struct tsdb_reader *rd)
+{
+    if (rd->map)
+        munmap ((void *) rd->map, rd->map_len);
+    if (rd->fd >= 0)
+        close (rd->fd);
+    rd->map = NULL;
+    rd->fd = -1;
+}
@@ -0,0 +1,153 @@
+/*
+ *  tsdb.h
+ *    Append-only compressed time series file for readings and events
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _TSDB_H_
+#define _TSDB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* The file is a sequence of chunks of this size, each written once with a
+   single page sized write */
+#define TSDB_CHUNK_SIZE 4096
+
+/* An open chunk is written out once its first point is this old even if it
+   is not full, which bounds what a power cut can lose (milliseconds) */
+#define TSDB_SEAL_AGE_MS (60 * 60 * 1000)
+
+#define TSDB_MAGIC 0x53544746 /* "FGTS" */
+
+/* Points staged between drains, a power of two. A sensor request stages
+   one per sensor, motion one per recording */
+#define TSDB_STAGE_SIZE 1024
+
+/* Sensor series are referenced from the sensor registry */
+enum tsdb_series {
+    TSDB_SERIES_OUTTEMP,
+    TSDB_SERIES_INTEMP,
+    TSDB_SERIES_PRESSURE,
+    TSDB_SERIES_HUMIDITY,
+    TSDB_SERIES_CPUTEMP,
+    TSDB_SERIES_MOTION,        /* 1 when a recording is triggered */
+    TSDB_SERIES_RECORD_LENGTH, /* Seconds, when picam stops recording */
+    TSDB_NSERIES
+};
+
+/* Stored at the start of every chunk, crc covers the whole chunk with the
+   crc field set to zero. seal_ts never decreases through the file so it can
+   be binary searched */
+struct tsdb_chunk_header {
+    uint32_t magic;
+    uint16_t series;
+    uint16_t count;
+    int64_t  first_ts;
+    int64_t  last_ts;
+    int64_t  seal_ts;
+    uint32_t nbits;
+    uint32_t crc;
+};
+
+/* Encoder state of the chunk being filled for one series */
+struct tsdb_open_chunk {
+    uint8_t  *buf;
+    uint32_t nbits;
+    uint16_t count;
+    int64_t  first_ts;
+    int64_t  prev_ts;
+    int64_t  prev_delta;
+    uint64_t prev_value;
+    int      prev_leading;
+    int      prev_trailing;
+};
+
+/* A point waiting in the stage, seq works as in struct cmdq_slot */
+struct tsdb_point {
+    atomic_size_t seq;
+    int           series;
+    int64_t       ts;
+    double        value;
+};
+
+/* Any thread appends to the stage without a lock. The open chunks and the
+   file belong to whoever holds mutex, which only tsdb_drain and tsdb_flush
+   take */
+struct tsdb {
+    int                    fd;
+    uint64_t               nchunks;
+    int64_t                last_seal_ts;
+    pthread_mutex_t        mutex;
+    struct tsdb_open_chunk open[TSDB_NSERIES];
+    struct tsdb_point      stage[TSDB_STAGE_SIZE];
+    atomic_size_t          stage_head; /* Next position to append */
+    atomic_size_t          stage_tail; /* Next position to drain */
+    atomic_uint_fast64_t   dropped;    /* Points lost to a full stage */
+};
+
+struct tsdb_reader {
+    int           fd;
+    const uint8_t *map;
+    size_t        map_len;
+    uint64_t      nchunks;
+};
+
+/* Called by tsdb_query for every point in range, timestamps are in
+   milliseconds since epoch */
+typedef void (*tsdb_point_cb) (void *, int, int64_t, double);
+
+/* Open or create the file at path. A torn chunk left by a crash is cut off
+   and appending continues after the last intact chunk */
+extern int tsdb_open (struct tsdb *, const char *);
+
+/* Stage a point for the next drain. Never blocks and makes no syscalls,
+   returns non-zero if the stage is full */
+extern int tsdb_append (struct tsdb *, int, int64_t, double);
+
+/* Encode the staged points into the open chunks and write out the chunks
+   that are full or older than TSDB_SEAL_AGE_MS. Called periodically by the
+   sampler thread */
+extern int tsdb_drain (struct tsdb *);
+
+/* Drain and write out every non-empty open chunk */
+extern int tsdb_flush (struct tsdb *);
+
+/* Flush and close */
+extern void tsdb_close (struct tsdb *);
+
+/* Map the file read-only */
+extern int tsdb_reader_open (struct tsdb_reader *, const char *);
+
+/* Index of the first chunk that may hold points at or after ts */
+extern uint64_t tsdb_reader_seek (struct tsdb_reader *, int64_t);
+
+/* Call cb for every point of series (-1 for all) between from and to */
+extern int tsdb_query (struct tsdb_reader *, int, int64_t, int64_t,
+                       tsdb_point_cb, void *);
+
+extern void tsdb_reader_close (struct tsdb_reader *);
+
+/* Milliseconds since epoch */
+extern int64_t tsdb_now_ms (void);
+
+#endif /* _TSDB_H_ */
@@ -0,0 +1,347 @@
+/*
+ *  zones.c
+ *    Per zone PIR state machines and one hold timer for all zones
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <poll.h>
+
+#include "zones.h"
+#include "clock.h"
+#include "metrics.h"
+#include "common.h"
+#include "log.h"
+
+static const char *const policy_names[] = {
+    "any",
+    "vote",
+    "priority"
+};
+
+const char *
+zones_policy_name (enum zone_policy policy)
+{
+    return policy_names[policy];
+}
+
+/* Whether a zone whose until_ns is until is active at ts */
+static inline bool
+active_at (uint64_t until, uint64_t ts)
+{
+    return until == ZONE_UNTIL_HIGH || until > ts;
+}
+
+uint64_t
+zone_active_ns (struct zone *z, uint64_t now)
+{
+    uint64_t until = atomic_load (&z->until_ns);
+    uint64_t since = atomic_load (&z->since_ns);
+    uint64_t active = atomic_load (&z->stats.active_ns);
+
+    if (until == 0)
+        return active;
+    if (until > now)
+        until = now;
+
+    return active + (until > since ? until - since : 0);
+}
+
+/* Mask of the zones active at ts */
+static uint32_t
+active_mask (struct zones *zs, uint64_t ts)
+{
+    uint32_t active = 0;
+
+    for (int i = 0; i < zs->n; i++)
+        if (active_at (atomic_load (&zs->zone[i].until_ns), ts))
+            active |= 1U << i;
+
+    return active;
+}
+
+/* Whether the policy starts a recording on the zones in active */
+static bool
+policy_accepts (struct zones *zs, uint32_t active)
+{
+    switch (zs->policy)
+      {
+        case ZONE_POLICY_VOTE:
+            return __builtin_popcount (active) >= zs->vote_k;
+        case ZONE_POLICY_PRIORITY:
+            for (int i = 0; i < zs->n; i++)
+                if ((active & (1U << i)) &&
+                    zs->zone[i].cfg->priority >= zs->start_priority)
+                    return true;
+            return false;
+        default:
+            return active != 0;
+      }
+}
+
+/* The PIR of z went high at ts. An activity that ended since the last edge
+   is accounted now that it is known to be over */
+static void
+zone_rise (struct zone *z, uint64_t ts)
+{
+    uint64_t until = atomic_exchange (&z->until_ns, ZONE_UNTIL_HIGH);
+    uint64_t since = atomic_load (&z->since_ns);
+
+    if (active_at (until, ts))
+        return;
+
+    if (until > since)
+        atomic_fetch_add_explicit (&z->stats.active_ns, until - since,
+                                   memory_order_relaxed);
+    atomic_store (&z->since_ns, ts);
+    atomic_fetch_add_explicit (&z->stats.activations, 1,
+                               memory_order_relaxed);
+}
+
+/* The PIR of z went low at ts, it holds for hold_ms */
+static void
+zone_fall (struct zone *z, uint64_t ts)
+{
+    if (atomic_load (&z->until_ns) != ZONE_UNTIL_HIGH)
+        return;
+
+    atomic_store (&z->until_ns, ts + z->cfg->hold_ms * 1000000ULL);
+}
+
+/* Edge callback of each zone's gpio_dev. Runs on the thread delivering the
+   edges of z, which is the only one writing its state. Nothing here
+   blocks, the debug log is written once the motion handler returned */
+static void
+on_zone_edges (void *arg, const struct gpio_edge *edges, size_t n)
+{
+    bool rising = false, trigger = false;
+    uint64_t edge_ns = 0;
+    uint32_t active, old;
+    unsigned int bit;
+    struct zone *z = arg;
+    struct zones *zs = z->zones;
+
+    if (n == 0)
+        return;
+
+    bit = 1U << (z - zs->zone);
+
+    for (size_t i = 0; i < n; i++)
+      {
+        uint64_t ts = edges[i].timestamp_ns;
+
+        if (edges[i].level)
+          {
+            zone_rise (z, ts);
+            old = atomic_fetch_or (&zs->high_mask, bit);
+            if (!rising)
+                edge_ns = ts;
+            rising = true;
+          }
+        else
+          {
+            zone_fall (z, ts);
+            old = atomic_fetch_and (&zs->high_mask, ~bit);
+          }
+
+        /* The hold time controller learns from the gaps between motion
+           anywhere, not from each zone. The edges that change whether any
+           PIR is high are those seeing no other zone high */
+        if (zs->holdtime && (old & ~bit) == 0 &&
+            (old & bit) != (edges[i].level ? bit : 0))
+            holdtime_edge (zs->holdtime, edges[i].level, ts);
+      }
+    if (!rising)
+        edge_ns = edges[n - 1].timestamp_ns;
+
+    active = active_mask (zs, edge_ns);
+    if (rising && policy_accepts (zs, active))
+      {
+        trigger = true;
+        for (int i = 0; i < zs->n; i++)
+            if (active & (1U << i))
+                atomic_fetch_add_explicit (&zs->zone[i].stats.triggers, 1,
+                                           memory_order_relaxed);
+      }
+
+    zs->cb (zs->cb_arg, trigger, active, edge_ns);
+
+    _log_debug ("zone %s: %zu edges, %s at %" PRIu64 "%s\n", z->cfg->name,
+                n, edges[n - 1].level ? "rising" : "falling",
+                edges[n - 1].timestamp_ns, trigger ? ", motion" : "");
+}
+
+int
+zones_open (struct zones *zs, const struct gpio_backend *backend,
+            const struct zone_config *cfgs, int n,
+            const struct gpio_filter *filter, enum zone_policy policy,
+            int vote_k, int start_priority, struct holdtime *ht, zones_cb cb,
+            void *arg)
+{
+    ssize_t s;
+    int opened = 0;
+
+    memset (zs, 0, sizeof (*zs));
+    atomic_init (&zs->high_mask, 0);
+    zs->policy = policy;
+    zs->vote_k = vote_k;
+    zs->start_priority = start_priority;
+    zs->holdtime = ht;
+    zs->cb = cb;
+    zs->cb_arg = arg;
+
+    if (n > ZONE_MAX)
+      {
+        log_error_en (ERANGE, "too many zones, ignoring the last ones");
+        n = ZONE_MAX;
+      }
+
+    for (int i = 0; i < n; i++)
+      {
+        struct zone *z = &zs->zone[i];
+
+        z->cfg = &cfgs[i];
+        z->zones = zs;
+        z->dev.fd = -1;
+        atomic_init (&z->until_ns, 0);
+        atomic_init (&z->since_ns, 0);
+        zs->n = i + 1;
+
+        gpio_set_filter (&z->dev, cfgs[i].min_pulse_ms * 1000000ULL,
+                         filter->max_edges, filter->window_ns);
+        s = gpio_open (&z->dev, backend, cfgs[i].pin, &on_zone_edges, z);
+        if (s != 0)
+          {
+            _log_debug ("zone %s is not available\n", cfgs[i].name);
+            continue;
+          }
+        opened++;
+
+        /* A PIR already high has no rising edge to come, its zone starts
+           out high. The backend may be delivering edges by now, and then
+           the zone has seen the level itself */
+        if (gpio_read_level (&z->dev))
+          {
+            uint64_t expected = 0;
+
+            atomic_store (&z->since_ns, gpio_now_ns ());
+            if (atomic_compare_exchange_strong (&z->until_ns, &expected,
+                                                ZONE_UNTIL_HIGH))
+                atomic_fetch_or (&zs->high_mask, 1U << i);
+          }
+      }
+
+    _log_debug ("%d of %d zones open, policy %s\n", opened, n,
+                zones_policy_name (policy));
+
+    return opened == 0;
+}
+
+bool
+zones_high (struct zones *zs)
+{
+    return atomic_load (&zs->high_mask) != 0;
+}
+
+void
+zones_close (struct zones *zs)
+{
+    for (int i = 0; i < zs->n; i++)
+      {
+        struct zone *z = &zs->zone[i];
+
+        if (z->dev.backend == NULL)
+            continue;
+
+        _log_debug ("zone %s: %" PRIuFAST64 " activations, %" PRIuFAST64
+                    " triggers, active %.1f s\n", z->cfg->name,
+                    atomic_load (&z->stats.activations),
+                    atomic_load (&z->stats.triggers),
+                    zone_active_ns (z, clock_now_ns ()) / 1E9);
+        gpio_close (&z->dev);
+      }
+}
+
+/* Start routine for zones thread */
+void *
+thread_zones_start (void *arg)
+{
+    ssize_t s, events;
+    int nfds = 0;
+    struct thread_data *tdata = arg;
+    struct zones *zs = &tdata->zones;
+    struct {
+        struct gpio_dev *dev;
+        int             (*handle) (struct gpio_dev *);
+    } srcs[2 * ZONE_MAX];
+    struct pollfd poll_fds[2 * ZONE_MAX + 1];
+
+    memset (&poll_fds, 0, sizeof (poll_fds));
+    events = POLLIN | POLLPRI;
+
+    poll_fds[nfds].fd = tdata->timerpipe[0];
+    poll_fds[nfds++].events = events;
+
+    /* Backends with a thread of their own have no fd to poll. Edges come
+       before pulse timers, so a timer never passes on an edge whose end is
+       already waiting to be read */
+    for (int i = 0; i < zs->n; i++)
+      {
+        if (zs->zone[i].dev.fd < 0)
+            continue;
+        srcs[nfds - 1].dev = &zs->zone[i].dev;
+        srcs[nfds - 1].handle = &gpio_dispatch;
+        poll_fds[nfds].fd = zs->zone[i].dev.fd;
+        poll_fds[nfds++].events = events;
+      }
+    for (int i = 0; i < zs->n; i++)
+      {
+        if (zs->zone[i].dev.pulse_fd < 0)
+            continue;
+        srcs[nfds - 1].dev = &zs->zone[i].dev;
+        srcs[nfds - 1].handle = &gpio_handle_pulse;
+        poll_fds[nfds].fd = zs->zone[i].dev.pulse_fd;
+        poll_fds[nfds++].events = events;
+      }
+
+    while (1)
+      {
+        /* Passing -1 to poll as third argument means to block (INFTIM) */
+        s = poll (poll_fds, nfds, -1);
+
+        if (s < 0)
+          {
+            log_error ("poll failed");
+            metrics_inc (METRIC_POLL_ERRORS);
+          }
+        else if (s > 0)
+          {
+            /* If there is data to read on timerpipe, we shall exit */
+            if (poll_fds[0].revents & events)
+                break;
+
+            for (int i = 1; i < nfds; i++)
+                if (poll_fds[i].revents & events)
+                    srcs[i - 1].handle (srcs[i - 1].dev);
+          }
+      }
+
+    return NULL;
+}
@@ -0,0 +1,123 @@
+/*
+ *  zones.h
+ *    PIR zones and the policy combining them into motion
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _ZONES_H_
+#define _ZONES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "gpio.h"
+#include "holdtime.h"
+
+/* Zones are bits in 32 bit masks */
+#define ZONE_MAX 8
+
+/* How active zones combine into starting a recording. Once recording, any
+   zone whose PIR is high keeps it going */
+enum zone_policy {
+    ZONE_POLICY_ANY,      /* A rising edge in any zone */
+    ZONE_POLICY_VOTE,     /* At least vote_k zones active */
+    ZONE_POLICY_PRIORITY  /* An active zone of at least start_priority */
+};
+
+/* One PIR input. A zone stays active for hold_ms after its PIR goes low,
+   which is how long it counts towards a vote or a priority decision */
+struct zone_config {
+    const char *name;
+    int        pin;
+    uint32_t   min_pulse_ms; /* Debounce, 0 disables */
+    uint32_t   hold_ms;
+    int        priority;
+};
+
+/* until_ns of a zone whose PIR is high */
+#define ZONE_UNTIL_HIGH UINT64_MAX
+
+struct zone_stats {
+    atomic_uint_fast64_t activations; /* From idle to high */
+    atomic_uint_fast64_t triggers;    /* Active when the policy accepted
+                                         motion */
+    atomic_uint_fast64_t active_ns;   /* Time high or holding, accounted
+                                         when the zone is next seen idle */
+};
+
+struct zones;
+
+/* Only the thread delivering the edges of a zone writes its state, others
+   read it. A hold ends by itself once until_ns has passed, there is no
+   timer to move the zone to idle */
+struct zone {
+    const struct zone_config *cfg;
+    struct zones             *zones;
+    struct gpio_dev          dev;
+    atomic_uint_fast64_t     until_ns; /* ZONE_UNTIL_HIGH, end of the hold
+                                          or 0 if never active */
+    atomic_uint_fast64_t     since_ns; /* Start of the latest activity */
+    struct zone_stats        stats;
+};
+
+/* Called for every batch of edges, after zone states are updated. trigger
+   is true if the batch had a rising edge and the policy accepts it, active
+   is the mask of zones active then. edge_ns is that edge or else the last
+   edge of the batch */
+typedef void (*zones_cb) (void *, bool, uint32_t, uint64_t);
+
+struct zones {
+    int              n;
+    struct zone      zone[ZONE_MAX];
+    enum zone_policy policy;
+    int              vote_k;
+    int              start_priority;
+    atomic_uint      high_mask;   /* Zones whose PIR is high */
+    struct holdtime  *holdtime;   /* Fed when any PIR goes high or all low */
+    zones_cb         cb;
+    void             *cb_arg;
+};
+
+/* Open n zones on backend. Every zone gets its own debounce and the rate
+   limit in filter, and starts out at the level its PIR has. ht may be
+   NULL. Returns non-zero if no zone could be opened */
+extern int zones_open (struct zones *, const struct gpio_backend *,
+                       const struct zone_config *, int,
+                       const struct gpio_filter *, enum zone_policy, int, int,
+                       struct holdtime *, zones_cb, void *);
+
+/* True if the PIR of any zone is high */
+extern bool zones_high (struct zones *);
+
+/* Time z has been active up to now, including an activity not accounted
+   in its stats yet */
+extern uint64_t zone_active_ns (struct zone *, uint64_t);
+
+extern const char *zones_policy_name (enum zone_policy);
+
+/* Close every zone and log its statistics */
+extern void zones_close (struct zones *);
+
+/* Start routine for the thread polling the zones when not in reactor
+   mode */
+extern void *thread_zones_start (void *);
+
+#endif /* _ZONES_H_ */